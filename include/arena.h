@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NANOSVC_ARENA_H
+#define NANOSVC_ARENA_H
+
+#include "stream.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The number of bytes in a slab.  This is the size of a transparent huge
+ * page on x86_64, so that a slab can be backed by a single huge page.
+ */
+#define NSV_ARENA_SLAB_SIZE (2 * 1024 * 1024)
+
+/**
+ * This data structure is a block of memory that objects are carved from.
+ */
+struct nsv_arena_slab_t
+{
+  struct nsv_arena_slab_t *next; /*< The previously filled slab. */
+  size_t used;                  /*< The number of bytes in use. */
+  size_t size;                  /*< The number of bytes in 'data'. */
+  void *data[];                 /*< The objects, aligned for pointers. */
+};
+
+/**
+ * The number of bytes in a record table.  Tables are aligned to their
+ * size, so that the table of a record is found from its address.
+ */
+#define NSV_ARENA_TABLE_SIZE NSV_ARENA_SLAB_SIZE
+
+/**
+ * This data structure is a block of records that are split in a hot and a
+ * cold part.  The hot parts are packed together, and the cold part of the
+ * record at index i is at index i of a parallel array behind them, so that
+ * scanning the hot parts does not load the cold ones.
+ */
+struct nsv_arena_table_t
+{
+  struct nsv_arena_table_t *next; /*< The previously filled table. */
+  size_t hot_size;              /*< The size of a hot part. */
+  size_t cold_size;             /*< The size of a cold part. */
+  uint32_t capacity;            /*< The number of records that fit. */
+  uint32_t used;                /*< The number of records in use. */
+  char *hot;                    /*< The hot parts. */
+  char *cold;                   /*< The cold parts, in the same order. */
+  struct nsv_arena_slab_t *mark_slab; /*< The slab that was being filled
+                                          when the last record was made. */
+  size_t mark_used;             /*< The 'used' of 'mark_slab' then. */
+};
+
+/**
+ * This data structure is an element in the list of chunks an arena holds.
+ */
+struct nsv_arena_chunk_t
+{
+  struct nsv_arena_chunk_t *next; /*< The previously held chunk. */
+  struct nsv_chunk_t *chunk;    /*< The chunk. */
+};
+
+/**
+ * This data structure is a region of memory for objects that are removed
+ * from memory at the same time, such as the segments and reads of a run.
+ * Allocating an object takes a pointer increment, and destroying the arena
+ * frees all of its objects in one go, without visiting them.
+ *
+ * An arena is not thread-safe.  Each thread fills an arena of its own,
+ * and the arenas are joined with nsv_arena_merge afterwards.
+ */
+struct nsv_arena_t
+{
+  struct nsv_arena_slab_t *slabs; /*< The slab that objects are taken from. */
+  struct nsv_arena_table_t *tables; /*< The table that records are taken
+                                        from. */
+  struct nsv_arena_chunk_t *chunks; /*< The chunks the objects point into. */
+};
+
+/**
+ * This function creates an empty arena.  When nsv_config.huge_pages is
+ * set, the slabs are backed by transparent huge pages where available.
+ *
+ * @return A pointer to a dynamically allocated nsv_arena_t object.
+ */
+struct nsv_arena_t *nsv_arena_new (void);
+
+/**
+ * This function allocates memory from an arena.  The memory is aligned
+ * for pointers and is not initialized.
+ * @param arena  The arena to allocate from, or NULL to use malloc.
+ * @param size   The number of bytes to allocate.
+ *
+ * @return A pointer to the memory, or NULL on an allocation failure.
+ */
+void *nsv_arena_alloc (struct nsv_arena_t *arena, size_t size);
+
+/**
+ * This function is like nsv_arena_alloc, but aligns the memory to
+ * 'alignment' bytes.
+ * @param arena      The arena to allocate from, or NULL to use
+ *                   posix_memalign.
+ * @param size       The number of bytes to allocate.
+ * @param alignment  A power of two that is a multiple of sizeof (void *).
+ *
+ * @return A pointer to the memory, or NULL on an allocation failure.
+ */
+void *nsv_arena_alloc_aligned (struct nsv_arena_t *arena, size_t size,
+                               size_t alignment);
+
+/**
+ * This function allocates a record that is split in a hot and a cold part.
+ * The hot parts of consecutive records are adjacent, and the cold part is
+ * found with nsv_arena_record_cold.  The memory is not initialized.
+ * @param arena      The arena to allocate from.
+ * @param hot_size   The size of the hot part, a power of two.
+ * @param cold_size  The size of the cold part, a multiple of
+ *                   sizeof (void *).
+ *
+ * @return A pointer to the hot part, or NULL on an allocation failure.
+ */
+void *nsv_arena_alloc_record (struct nsv_arena_t *arena, size_t hot_size,
+                              size_t cold_size);
+
+/**
+ * This function returns the cold part of a record made with
+ * nsv_arena_alloc_record.
+ * @param hot  The hot part of the record.
+ *
+ * @return A pointer to the cold part.
+ */
+static inline void *
+nsv_arena_record_cold (const void *hot)
+{
+  struct nsv_arena_table_t *table = (struct nsv_arena_table_t *)
+    ((uintptr_t)hot & ~((uintptr_t)NSV_ARENA_TABLE_SIZE - 1));
+
+  size_t index = ((const char *)hot - table->hot) / table->hot_size;
+  return table->cold + index * table->cold_size;
+}
+
+/**
+ * This function is like nsv_arena_alloc, but fills the memory with zeros.
+ * @param arena  The arena to allocate from, or NULL to use calloc.
+ * @param size   The number of bytes to allocate.
+ *
+ * @return A pointer to the memory, or NULL on an allocation failure.
+ */
+void *nsv_arena_alloc0 (struct nsv_arena_t *arena, size_t size);
+
+/**
+ * This function copies 'length' bytes of 'text' and a null character into
+ * an arena.
+ * @param arena   The arena to allocate from, or NULL to use malloc.
+ * @param text    The text to copy.
+ * @param length  The number of bytes to copy.
+ *
+ * @return A pointer to the copy, or NULL on an allocation failure.
+ */
+char *nsv_arena_strndup (struct nsv_arena_t *arena, const char *text,
+                         size_t length);
+
+/**
+ * This function gives back the memory from 'pointer' onwards, so that an
+ * object that turns out to be of no use can be dropped right after it was
+ * made, or the unused end of the last allocation can be returned.
+ * When 'pointer' is the last record of nsv_arena_alloc_record, the record
+ * and the objects allocated after it are given back.  Nothing happens when
+ * 'pointer' does not belong to the slab or table that is being filled.
+ * @param arena    The arena 'pointer' was allocated from.
+ * @param pointer  The first allocation to give back.
+ */
+void nsv_arena_free_from (struct nsv_arena_t *arena, void *pointer);
+
+/**
+ * This function keeps a reference to 'chunk' until the arena is
+ * destroyed, for objects in the arena that point into the chunk.  A chunk
+ * that is held already is not referenced again.
+ * @param arena  The arena to hold the reference.
+ * @param chunk  The chunk to reference.
+ *
+ * @return true on success, false on an allocation failure.
+ */
+bool nsv_arena_hold_chunk (struct nsv_arena_t *arena,
+                           struct nsv_chunk_t *chunk);
+
+/**
+ * This function moves the memory of 'other' into 'arena', and removes the
+ * empty 'other' from memory.  The objects keep their addresses.  This
+ * function does not allocate memory, so it cannot fail.
+ * @param arena  The arena to move the memory to.
+ * @param other  The arena to move the memory from.
+ */
+void nsv_arena_merge (struct nsv_arena_t *arena, struct nsv_arena_t *other);
+
+/**
+ * This function removes an arena and all objects in it from memory.
+ * @param arena  The arena to destroy.
+ */
+void nsv_arena_destroy (struct nsv_arena_t *arena);
+
+#endif
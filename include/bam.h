@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NANOSVC_BAM_H
+#define NANOSVC_BAM_H
+
+#include "bgzf.h"
+#include "segment.h"
+#include "stream.h"
+#include "contig.h"
+#include "nanosvc.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+ * This data structure contains the state of a BAM file that is being read.
+ */
+struct nsv_bam_t
+{
+  FILE *stream;                 /*< The underlying file. */
+  struct nsv_bgzf_t *bgzf;      /*< The decompressor for 'stream'. */
+
+  struct nsv_contigs_t *contigs; /*< The dictionary the header was added to. */
+  int32_t *reference_ids;       /*< The contig index of each reference in
+                                    the header. */
+  int32_t references_len;       /*< The number of references. */
+
+  uint8_t *record;              /*< Buffer for the current record. */
+  uint32_t record_capacity;     /*< The allocated size of 'record'. */
+  int32_t pending_len;          /*< The length of a record that has not been
+                                    read yet, or 0. */
+  bool error;                   /*< Set when a record could not be read,
+                                    as opposed to the end of the file. */
+};
+
+/**
+ * This function opens a BAM file and reads its header.  The references in
+ * the header are added to 'contigs', which must outlive the nsv_bam_t.
+ * @param filename  The file to open.
+ * @param contigs   The contig dictionary to add the references to.
+ * @param threads   The number of threads to decompress the file with.
+ *
+ * @return A pointer to a dynamically allocated nsv_bam_t object, or NULL
+ *         when the file could not be opened or is not a BAM file.
+ */
+struct nsv_bam_t *nsv_bam_open (const char *filename,
+                                struct nsv_contigs_t *contigs,
+                                uint16_t threads);
+
+/**
+ * This function decodes the next alignment record of a BAM file into a
+ * segment, without going through the SAM text representation.
+ * Only the string fields in 'columns' are decoded; the others are NULL.
+ * The NM, MD and SA fields are decoded when 'columns' has NSV_COLUMN_TAGS.
+ * Reference indexes refer to the contig dictionary given to nsv_bam_open.
+ * @param bam        The BAM file to read from.
+ * @param arena      The arena to allocate the segment from, or NULL.
+ * @param columns    A combination of nsv_segment_column_e values.
+ * @param filter     The filter to skip records with, or NULL.  Skipped
+ *                   records are counted in its 'rejected_count'.
+ * @param qname_ptr  A pointer to a char* in which the qname will be placed.
+ *                   The qname is valid until the next call to this function.
+ *
+ * @return A pointer to a dynamically allocated nsv_segment_t, or NULL at
+ *         the end of the file or on an error.  On an error, the 'error'
+ *         field of 'bam' is set.
+ */
+struct nsv_segment_t *nsv_bam_read_segment (struct nsv_bam_t *bam,
+                                            struct nsv_arena_t *arena,
+                                            uint32_t columns,
+                                            struct nsv_segment_filter_t *filter,
+                                            const char **qname_ptr);
+
+/**
+ * This function applies a filter to an alignment record that has already
+ * been read from the file, without decoding it.  It can be called from
+ * multiple threads at once.
+ * @param filter      The filter to apply.
+ * @param record      The record, without its leading block_size field.
+ * @param record_len  The size of 'record' in bytes.
+ *
+ * @return true when the record must be rejected, false otherwise.
+ *         Malformed records are left for the decoder to report.
+ */
+bool nsv_bam_filter_record (const struct nsv_segment_filter_t *filter,
+                            const uint8_t *record, uint32_t record_len);
+
+/**
+ * This function is like nsv_segment_line_is_split, but for an alignment
+ * record that has already been read from the file.
+ * @param record      The record, without its leading block_size field.
+ * @param record_len  The size of 'record' in bytes.
+ * @param qname_ptr   A pointer to a char* in which the qname is placed.
+ * @param qname_len   A pointer to a size_t in which the length of the
+ *                    qname, without its null character, is placed.
+ *
+ * @return true when the read of 'record' may have other alignments, false
+ *         otherwise.
+ */
+bool nsv_bam_record_is_split (const uint8_t *record, uint32_t record_len,
+                              const char **qname_ptr, size_t *qname_len);
+
+/**
+ * This function decodes a single alignment record that has already been
+ * read from the file.  It does not modify 'bam', so it can be called from
+ * multiple threads at once.
+ * @param bam         The BAM file the record was read from.
+ * @param record      The record, without its leading block_size field.
+ * @param record_len  The size of 'record' in bytes.
+ * @param arena       The arena to allocate the segment from, or NULL.
+ * @param columns     A combination of nsv_segment_column_e values.
+ * @param qname_ptr   A pointer to a char* in which the qname will be placed.
+ *                    The qname points into 'record'.
+ *
+ * @return A pointer to a dynamically allocated nsv_segment_t, or NULL on
+ *         an error.
+ */
+struct nsv_segment_t *nsv_bam_decode_record (struct nsv_bam_t *bam,
+                                             const uint8_t *record,
+                                             uint32_t record_len,
+                                             struct nsv_arena_t *arena,
+                                             uint32_t columns,
+                                             const char **qname_ptr);
+
+/**
+ * This function reads as many whole alignment records as fit in a chunk,
+ * without decoding them.  Each record is preceded by its length as an
+ * int32_t in host byte order.  The records can be decoded with
+ * nsv_bam_decode_record, for example on another thread.
+ * @param bam         The BAM file to read from.
+ * @param length_ptr  A pointer to a size_t in which the number of bytes
+ *                    used in the chunk is placed.
+ *
+ * @return A pointer to a chunk with a single reference, or NULL at the end
+ *         of the file or on an error.  On an error, the 'error' field of
+ *         'bam' is set.  A chunk can be returned before an error, so the
+ *         field must be checked after the last chunk.
+ */
+struct nsv_chunk_t *nsv_bam_read_records (struct nsv_bam_t *bam,
+                                          size_t *length_ptr);
+
+/**
+ * This function returns the virtual file offset of the next record.
+ * @param bam  The BAM file.
+ *
+ * @return The virtual file offset, as used in BAM indexes.
+ */
+uint64_t nsv_bam_tell (struct nsv_bam_t *bam);
+
+/**
+ * This function moves to the record at a virtual file offset.
+ * @param bam     The BAM file.
+ * @param offset  The virtual file offset, as found in a BAM index.
+ *
+ * @return true on success, false on failure.
+ */
+bool nsv_bam_seek (struct nsv_bam_t *bam, uint64_t offset);
+
+/**
+ * This function closes a BAM file and removes its nsv_bam_t from memory.
+ * @param bam  The BAM file to close.
+ */
+void nsv_bam_close (struct nsv_bam_t *bam);
+
+#endif
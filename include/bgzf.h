@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NANOSVC_BGZF_H
+#define NANOSVC_BGZF_H
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The maximum size of a BGZF block, both compressed and uncompressed.
+ */
+#define NSV_BGZF_MAX_BLOCK_SIZE 65536
+
+/**
+ * The number of blocks each worker thread inflates per batch.
+ */
+#define NSV_BGZF_BLOCKS_PER_THREAD 8
+
+/**
+ * This data structure contains a single BGZF block, in both its compressed
+ * and its inflated form.
+ */
+struct nsv_bgzf_block_t
+{
+  uint8_t compressed[NSV_BGZF_MAX_BLOCK_SIZE]; /*< The raw block contents. */
+  uint32_t compressed_len;                     /*< Bytes in 'compressed'. */
+  uint8_t data[NSV_BGZF_MAX_BLOCK_SIZE];       /*< The inflated contents. */
+  uint32_t data_len;                           /*< Bytes in 'data'. */
+  uint64_t offset;                             /*< The position of the block
+                                                   in the file. */
+  bool failed;                                 /*< Set when inflating failed. */
+};
+
+/**
+ * A batch is a series of consecutive blocks that is inflated in parallel.
+ * While the caller consumes one batch, the other one is being inflated.
+ */
+struct nsv_bgzf_batch_t
+{
+  struct nsv_bgzf_block_t *blocks;
+  uint32_t blocks_len;         /*< The number of blocks filled in this batch. */
+  uint32_t pending;            /*< Blocks that have not been inflated yet. */
+};
+
+/**
+ * This data structure contains the state of a BGZF reader.
+ */
+struct nsv_bgzf_t
+{
+  FILE *stream;                    /*< The compressed input. */
+  uint16_t threads;                /*< The number of inflating threads. */
+  GThreadPool *pool;               /*< The inflating threads, or NULL. */
+  GMutex mutex;                    /*< Protects the 'pending' counters. */
+  GCond condition;                 /*< Signals a completed batch. */
+
+  struct nsv_bgzf_batch_t batches[2];
+  uint32_t batch_capacity;         /*< The number of blocks per batch. */
+  uint8_t current;                 /*< The batch that is being consumed. */
+  uint32_t block_index;            /*< The block that is being consumed. */
+  uint32_t block_pos;              /*< The position inside that block. */
+  uint64_t end_offset;             /*< The file position after the last
+                                       block that was read. */
+
+  bool eof;                        /*< Set when 'stream' has been exhausted. */
+  bool read_error;                 /*< Set when a block could not be read.
+                                       The blocks before it are still
+                                       returned by nsv_bgzf_read. */
+  bool error;                      /*< Set when nsv_bgzf_read reaches a
+                                       malformed block. */
+};
+
+/**
+ * This function opens a BGZF stream for reading.  Blocks are inflated on
+ * 'threads' worker threads.
+ * @param stream   The stream to read from.
+ * @param threads  The number of threads to inflate blocks with.
+ *
+ * @return A pointer to a dynamically allocated nsv_bgzf_t object.
+ */
+struct nsv_bgzf_t *nsv_bgzf_new (FILE *stream, uint16_t threads);
+
+/**
+ * This function reads 'length' inflated bytes into 'buffer'.
+ * @param bgzf    The reader to read from.
+ * @param buffer  The memory to copy the inflated bytes into.
+ * @param length  The number of bytes to read.
+ *
+ * @return The number of bytes read, which is smaller than 'length' at the
+ *         end of the stream or on an error.  The 'error' field of 'bgzf'
+ *         tells the two apart.
+ */
+size_t nsv_bgzf_read (struct nsv_bgzf_t *bgzf, void *buffer, size_t length);
+
+/**
+ * This function returns the virtual file offset of the next byte that
+ * nsv_bgzf_read will return.  The upper 48 bits hold the position of a
+ * block in the file, and the lower 16 bits the position inside the
+ * inflated block.
+ * @param bgzf  The reader.
+ *
+ * @return The virtual file offset.
+ */
+uint64_t nsv_bgzf_tell (struct nsv_bgzf_t *bgzf);
+
+/**
+ * This function moves the reader to a virtual file offset, as found in BAM
+ * indexes.  Blocks that have already been inflated are reused when
+ * possible.
+ * @param bgzf    The reader.
+ * @param offset  The virtual file offset to continue reading at.
+ *
+ * @return true on success, false on failure.
+ */
+bool nsv_bgzf_seek (struct nsv_bgzf_t *bgzf, uint64_t offset);
+
+/**
+ * This function removes a nsv_bgzf_t from memory.  The underlying stream
+ * is not closed.
+ * @param bgzf  The reader to destroy.
+ */
+void nsv_bgzf_destroy (struct nsv_bgzf_t *bgzf);
+
+#endif
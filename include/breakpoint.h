@@ -21,11 +21,21 @@
 #include "trie.h"
 #include "segment.h"
 #include "read.h"
+#include "arena.h"
+#include "segments.h"
 #include "nanosvc.h"
 
 #include <glib.h>
 #include <stdbool.h>
 
+/**
+ * The bits of nsv_breakpoint_t's 'orientation', which tell on which
+ * strand each segment is taken to be.  They start out as the 0x10 flags
+ * of the segments, so that the segments themselves never have to change.
+ */
+#define NSV_BREAKPOINT_REVERSE_FIRST  0x1
+#define NSV_BREAKPOINT_REVERSE_SECOND 0x2
+
 /**
  * This data structure contains the information about a read of a
  * sequence alignment map.
@@ -48,6 +58,9 @@ struct nsv_breakpoint_t
 
   int32_t breakpoints[2];            /*< The position of the breakpoints. */
   int32_t gap;                       /*< The gap between the segments. */
+  uint8_t orientation;               /*< NSV_BREAKPOINT_REVERSE_* bits. */
+  bool in_arena;                     /*< Set when an arena or a GArray owns
+                                         the memory of the breakpoint. */
 };
 
 /**
@@ -57,21 +70,33 @@ struct nsv_breakpoint_t
  */
 struct nsv_breakpoint_t *nsv_breakpoint_new (void);
 
+/**
+ * This function creates an empty breakpoint base structure in an arena.
+ * @param arena  The arena to allocate from, or NULL to use the heap.
+ *
+ * @return A pointer to an nsv_breakpoint_t object.
+ */
+struct nsv_breakpoint_t *
+nsv_breakpoint_new_in_arena (struct nsv_arena_t *arena);
+
 /**
  * This function creates a breakpoint base structure with 'first' and 'second'
  * as its segments.
  * @param first  The first segment.
  * @param second the second segment.
+ * @param arena  The arena to allocate from, or NULL to use the heap.
  *
- * @return A pointer to a dynamically allocated nsv_breakpoint_t object.
+ * @return A pointer to an nsv_breakpoint_t object.
  */
 struct nsv_breakpoint_t *
 nsv_breakpoint_new_with_segments (struct nsv_segment_t *first,
-                                  struct nsv_segment_t *second);
+                                  struct nsv_segment_t *second,
+                                  struct nsv_arena_t *arena);
 
 /**
- * This function switches the segments in the breakpoint and toggles the
- * 0x10 flag as a side-effect.
+ * This function switches the segments in the breakpoint, and takes each of
+ * them to be on the other strand.  The strands are kept in the breakpoint's
+ * orientation bits, so the segments are not modified.
  * @param breakpoint  The breakpoint to switch the segments of.
  *
  * @return TRUE on success, FALSE on failure to switch the segments.
@@ -79,19 +104,53 @@ nsv_breakpoint_new_with_segments (struct nsv_segment_t *first,
 bool
 nsv_breakpoint_switch_segments (struct nsv_breakpoint_t *breakpoint);
 
+/**
+ * This function fills in a breakpoint in place, with 'first' and 'second'
+ * as its segments.  It does not allocate memory, so it can be used on the
+ * elements of an array of breakpoints.
+ * @param breakpoint  The breakpoint to fill in.
+ * @param first       The first segment.
+ * @param second      The second segment.
+ */
+void nsv_breakpoint_init (struct nsv_breakpoint_t *breakpoint,
+                          struct nsv_segment_t *first,
+                          struct nsv_segment_t *second);
+
 /**
  * This function determines whether there is a breakpoint in a nsv_read_t
- * struct specified by 'read_ptr'.  If it finds a breakpoint, it adds its
- * nsv_breakpoint_t struct to the list provided in 'list_ptr'.
- * @param read_ptr  The read to analyze.
- * @param list_ptr  The list to add the possible breakpoint to.
+ * struct specified by 'read_obj'.  For each pair of consecutive segments,
+ * ordered by their first clip, it appends an nsv_breakpoint_t to
+ * 'breakpoints'.  The list of segments of the read is not modified.
+ * @param read_obj     The read to analyze.
+ * @param breakpoints  A GArray of nsv_breakpoint_t to append to.
+ *
+ * @return TRUE on success, FALSE on failure.
+ */
+bool nsv_breakpoints_from_read (struct nsv_read_t *read_obj,
+                                GArray *breakpoints);
+
+/**
+ * This function does what nsv_breakpoints_from_read does for every read in
+ * a segment table, in the order of the reads.  The table must be sorted
+ * with nsv_segments_sort_by_clip, after which the breakpoints are found
+ * from its flag, pos, end, clip and seq_len columns alone.
+ *
+ * The reads are divided into slices that are handled on up to
+ * 'max_threads' threads, each with an array of its own.  The arrays are
+ * appended to 'breakpoints' in the order of the reads, so the result does
+ * not depend on the number of threads.
+ * @param segments     The table of segments to analyze.
+ * @param breakpoints  A GArray of nsv_breakpoint_t to append to.
  *
  * @return TRUE on success, FALSE on failure.
  */
-bool nsv_breakpoints_from_read (void *read_ptr, void **list_ptr);
+bool nsv_breakpoints_from_segments (struct nsv_segments_t *segments,
+                                    GArray *breakpoints);
 
 /**
- * This function sets the breakpoint positions for a given breakpoint.
+ * This function sets the breakpoint positions for a given breakpoint: the
+ * end of a segment on the forward strand, or the start of a segment on the
+ * reverse strand, according to the breakpoint's orientation bits.
  * @param breakpoint  The breakpoint to set the breakpoint positions for.
  *
  * @return TRUE on success, FALSE on failure.
@@ -100,14 +159,18 @@ bool nsv_breakpoint_set_breakpoint (struct nsv_breakpoint_t *breakpoint);
 
 /**
  * This function removes a nsv_breakpoint_t from memory.  A void pointer
- * is used to play nicely with generic 'free' callback handlers.
+ * is used to play nicely with generic 'free' callback handlers.  A
+ * breakpoint in an arena or a GArray is left alone; it goes with its
+ * owner.
  * @param breakpoint   A pointer to a nsv_breakpoint_t struct.
  */
 void nsv_breakpoint_destroy (void *breakpoint);
 
 /**
  * This function removes a nsv_breakpoint_t from memory, including the
- * nsv_segment_t instances linked to this breakpoint.
+ * nsv_segment_t instances linked to this breakpoint.  Like
+ * nsv_breakpoint_destroy, a breakpoint in an arena or a GArray, or a
+ * segment in an arena, is left alone.
  * @param breakpoint   A pointer to a nsv_breakpoint_t struct.
  */
 void nsv_breakpoint_destroy_full (void *breakpoint);
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NANOSVC_CIGAR_H
+#define NANOSVC_CIGAR_H
+
+#include "segment.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * This enumeration contains the implementations of nsv_cigar_overview.
+ * They give the same results, bit for bit, but use different instruction
+ * sets.
+ */
+enum nsv_cigar_kernel_e {
+  NSV_CIGAR_KERNEL_SCALAR = 0,  /*< Plain C, which runs everywhere. */
+  NSV_CIGAR_KERNEL_SSE41  = 1,  /*< Four operations at a time. */
+  NSV_CIGAR_KERNEL_AVX2   = 2   /*< Eight operations at a time. */
+};
+
+/**
+ * This function selects the fastest kernel the processor supports.  It is
+ * called once at startup, before any threads are started.  Until it is
+ * called, the scalar kernel is used.
+ */
+void nsv_cigar_init (void);
+
+/**
+ * This function selects a specific kernel, for tests and benchmarks.
+ * @param kernel  The kernel to use.
+ *
+ * @return true when the processor supports 'kernel', false otherwise, in
+ *         which case the kernel is left alone.
+ */
+bool nsv_cigar_set_kernel (enum nsv_cigar_kernel_e kernel);
+
+/**
+ * This function returns the kernel that is in use.
+ * @return The kernel that nsv_cigar_overview runs.
+ */
+enum nsv_cigar_kernel_e nsv_cigar_kernel (void);
+
+/**
+ * This function returns the name of a kernel.
+ * @param kernel  The kernel.
+ * @return A static string.
+ */
+const char *nsv_cigar_kernel_name (enum nsv_cigar_kernel_e kernel);
+
+/**
+ * This function sums the lengths of the operations in 'cigar' by
+ * operation, and finds the first and last clip.  Each element must hold
+ * one of the operations in nsv_cigar_operation_e.
+ * @param cigar      The packed CIGAR operations.
+ * @param cigar_len  The number of operations in 'cigar'.
+ * @param overview   Where to store the result.
+ */
+void nsv_cigar_overview (const uint32_t *cigar, uint32_t cigar_len,
+                         struct nsv_segment_cigar_overview_t *overview);
+
+#endif
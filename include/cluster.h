@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NANOSVC_CLUSTER_H
+#define NANOSVC_CLUSTER_H
+
+#include "breakpoint.h"
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * This data structure contains a cluster of breakpoints: breakpoints on
+ * the same pair of reference sequences, with the same orientation, whose
+ * ends are linked by a chain of breakpoints that are at most
+ * 'cluster_distance' apart at both ends.  A structural variant is called
+ * from a cluster.
+ */
+struct nsv_cluster_t
+{
+  int32_t rname_ids[2];         /*< The reference sequence of each end. */
+  uint8_t orientation;          /*< NSV_BREAKPOINT_REVERSE_* bits. */
+  int32_t starts[2];            /*< The lowest position of each end. */
+  int32_t ends[2];              /*< The highest position of each end. */
+  uint32_t breakpoints_len;     /*< The number of breakpoints. */
+  struct nsv_breakpoint_t **breakpoints; /*< The breakpoints, ordered by
+                                             the position of their first
+                                             end. */
+};
+
+/**
+ * This data structure contains the clusters found in an array of
+ * breakpoints.  The 'breakpoints' of each cluster point into the
+ * 'breakpoints' of the table, so a cluster does not own any memory.
+ */
+struct nsv_clusters_t
+{
+  uint32_t length;              /*< The number of clusters. */
+  struct nsv_cluster_t *clusters; /*< The clusters, ordered by reference
+                                      sequences, orientation and position. */
+  uint32_t breakpoints_len;     /*< The number of breakpoints. */
+  struct nsv_breakpoint_t **breakpoints; /*< All breakpoints, cluster by
+                                             cluster. */
+};
+
+/**
+ * This function groups the breakpoints in 'breakpoints' into clusters of
+ * at least 'cluster_count' breakpoints.  Two breakpoints are linked when
+ * they are on the same pair of reference sequences, with the same
+ * orientation, and both of their ends are at most 'cluster_distance'
+ * apart.  A cluster is a group of breakpoints that are linked directly or
+ * through other breakpoints.
+ *
+ * The breakpoints of each pair of reference sequences and orientation are
+ * clustered on up to 'max_threads' threads, by sorting them on their first
+ * end and sweeping over them.  The breakpoints themselves are not modified.
+ * @param breakpoints  A GArray of nsv_breakpoint_t.
+ *
+ * @return A pointer to a dynamically allocated nsv_clusters_t object, or
+ *         NULL on failure.
+ */
+struct nsv_clusters_t *nsv_clusters_from_breakpoints (GArray *breakpoints);
+
+/**
+ * This function removes a table of clusters from memory.  The breakpoints
+ * it refers to are left alone.
+ * @param clusters  The table to destroy, or NULL.
+ */
+void nsv_clusters_destroy (struct nsv_clusters_t *clusters);
+
+#endif
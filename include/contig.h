@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NANOSVC_CONTIG_H
+#define NANOSVC_CONTIG_H
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * This data structure contains the information about a reference sequence,
+ * as described by an @SQ header line.
+ */
+struct nsv_contig_t
+{
+  char *name;                   /*< The reference sequence name (SN). */
+  uint32_t length;              /*< The reference sequence length (LN). */
+  int32_t index;                /*< The position in the contig dictionary. */
+};
+
+/**
+ * This data structure maps reference sequence names to integer identifiers.
+ * Segments store these identifiers instead of the names themselves.  The
+ * dictionary can be used from multiple threads.
+ *
+ * Once the header has been read, the dictionary is sealed: the names of
+ * the header are no longer modified, so they are looked up without taking
+ * the lock.  Names that are added after that go into 'unlisted'.
+ */
+struct nsv_contigs_t
+{
+  GPtrArray *contigs;           /*< The nsv_contig_t objects, by index. */
+  GHashTable *names;            /*< The nsv_contig_t objects, by name. */
+  GHashTable *unlisted;         /*< The contigs added after sealing. */
+  uint32_t serial;              /*< Tells dictionaries apart in the
+                                    per-thread lookup cache. */
+  bool sealed;                  /*< Whether 'names' is read-only. */
+  GMutex mutex;                 /*< Protects the members above, except
+                                    'names' once 'sealed' is set. */
+};
+
+/**
+ * This data structure describes a genomic region.
+ */
+struct nsv_region_t
+{
+  int32_t rname_id;             /*< The index of the contig. */
+  int64_t begin;                /*< The 0-based start of the region. */
+  int64_t end;                  /*< The 0-based end, exclusive. */
+};
+
+/**
+ * This function creates an empty contig dictionary.
+ *
+ * @return A pointer to a dynamically allocated nsv_contigs_t object.
+ */
+struct nsv_contigs_t *nsv_contigs_new (void);
+
+/**
+ * This function adds a reference sequence to the dictionary.  When a contig
+ * with the same name exists, its index is returned, and its length is
+ * updated when 'length' is not 0.
+ * @param contigs  The dictionary to add the contig to.
+ * @param name     The name of the reference sequence.
+ * @param length   The length of the reference sequence, or 0 if unknown.
+ *
+ * @return The index of the contig, or -1 on an allocation error.
+ */
+int32_t nsv_contigs_add (struct nsv_contigs_t *contigs, const char *name,
+                         uint32_t length);
+
+/**
+ * This function seals the dictionary after the header has been read, so
+ * that the contigs it holds are looked up without locking.  It must be
+ * called before the dictionary is shared with other threads.
+ * @param contigs  The dictionary to seal.
+ */
+void nsv_contigs_seal (struct nsv_contigs_t *contigs);
+
+/**
+ * This function looks up the index of a reference sequence.
+ * @param contigs  The dictionary to search in.
+ * @param name     The name of the reference sequence.
+ *
+ * @return The index of the contig, or -1 when it is not in the dictionary.
+ */
+int32_t nsv_contigs_lookup (struct nsv_contigs_t *contigs, const char *name);
+
+/**
+ * This function returns the name of a reference sequence.
+ * @param contigs  The dictionary to search in.
+ * @param index    The index of the contig.
+ *
+ * @return The name of the contig, or "*" when 'index' is not in the
+ *         dictionary.
+ */
+const char *nsv_contigs_name (struct nsv_contigs_t *contigs, int32_t index);
+
+/**
+ * This function returns the length of a reference sequence.
+ * @param contigs  The dictionary to search in.
+ * @param index    The index of the contig.
+ *
+ * @return The length of the contig, or 0 when it is unknown.
+ */
+uint32_t nsv_contigs_length (struct nsv_contigs_t *contigs, int32_t index);
+
+/**
+ * This function parses a region of the form 'name', 'name:start' or
+ * 'name:start-end', with 1-based, inclusive coordinates.  Thousands
+ * separators in the coordinates are ignored.
+ * @param contigs  The dictionary to look up 'name' in.
+ * @param text     The region to parse.
+ * @param region   The nsv_region_t to store the region in.
+ *
+ * @return true on success, false when 'text' is not a valid region.
+ */
+bool nsv_contigs_parse_region (struct nsv_contigs_t *contigs,
+                               const char *text,
+                               struct nsv_region_t *region);
+
+/**
+ * This function returns the number of contigs in the dictionary.
+ * @param contigs  The dictionary.
+ *
+ * @return The number of contigs.
+ */
+uint32_t nsv_contigs_count (struct nsv_contigs_t *contigs);
+
+/**
+ * This function adds the reference sequence of an @SQ header line to the
+ * dictionary.  Other header lines are ignored.
+ * @param contigs  The dictionary to add the contig to.
+ * @param line     The header line, starting with '@'.
+ * @param length   The length of the line, excluding the newline.
+ *
+ * @return true on success, false on failure.
+ */
+bool nsv_contigs_add_header_line (struct nsv_contigs_t *contigs,
+                                  const char *line, size_t length);
+
+/**
+ * This function removes a nsv_contigs_t and its contigs from memory.
+ * @param contigs  The dictionary to destroy.
+ */
+void nsv_contigs_destroy (struct nsv_contigs_t *contigs);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NANOSVC_FILTER_H
+#define NANOSVC_FILTER_H
+
+#include "segment.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * The largest number of clauses in a filter expression.
+ */
+#define NSV_FILTER_MAX_CLAUSES 16
+
+/**
+ * This enumeration contains the values a clause can look at.
+ */
+enum nsv_filter_field_e {
+  NSV_FILTER_FLAG     = 0,      /*< flag */
+  NSV_FILTER_MAPQ     = 1,      /*< mapq */
+  NSV_FILTER_LENGTH   = 2,      /*< length, the reference bases covered */
+  NSV_FILTER_IDENTITY = 3,      /*< identity, see nsv_segment_cigar_pid */
+  NSV_FILTER_TAG_NM   = 4,      /*< [NM] */
+  NSV_FILTER_TAG_MD   = 5       /*< [MD], the mismatches in the MD tag */
+};
+
+/**
+ * This data structure contains a compiled clause.  Every comparison is
+ * turned into a range of values to keep, so that a clause is evaluated
+ * the same way whatever its operator.
+ */
+struct nsv_filter_clause_t
+{
+  uint8_t field;                /*< One of nsv_filter_field_e. */
+  bool negate;                  /*< Keep the values outside the range. */
+  uint32_t mask;                /*< The bits of an integer value to use. */
+  double low;                   /*< The lowest value in the range. */
+  double high;                  /*< The highest value in the range. */
+  char *text;                   /*< The clause as it was written. */
+};
+
+/**
+ * This data structure contains a compiled filter expression: a list of
+ * clauses that a segment must all pass.
+ */
+struct nsv_filter_t
+{
+  struct nsv_filter_clause_t clauses[NSV_FILTER_MAX_CLAUSES];
+  uint32_t clauses_len;
+};
+
+/**
+ * This function compiles a filter expression of the form
+ * "clause && clause && ...", in which each clause has the form
+ * "field [& mask] operator value".  The fields are flag, mapq, length,
+ * identity, [NM] and [MD], and the operators are ==, !=, <, <=, > and >=.
+ * @param expression  The expression to compile.
+ *
+ * @return A pointer to a dynamically allocated nsv_filter_t, or NULL when
+ *         the expression is not valid, in which case an error is logged.
+ */
+struct nsv_filter_t *nsv_filter_compile (const char *expression);
+
+/**
+ * This function removes a compiled filter from memory.
+ * @param filter  The filter to remove, or NULL.
+ */
+void nsv_filter_destroy (struct nsv_filter_t *filter);
+
+/**
+ * This function evaluates the clauses of 'filter' for a segment, in order,
+ * until one of them fails.  It does not modify 'filter', so it can be
+ * called from multiple threads at once.
+ * @param filter           The filter to apply, or NULL.
+ * @param segment          The segment to look at.
+ * @param rejected_counts  An array of NSV_FILTER_MAX_CLAUSES counters.  The
+ *                         counter of the clause that fails is incremented.
+ *
+ * @return true when 'segment' passes all clauses, false otherwise.
+ */
+bool nsv_filter_keep (const struct nsv_filter_t *filter,
+                      struct nsv_segment_t *segment,
+                      uint32_t *rejected_counts);
+
+/**
+ * This function logs the number of segments each clause rejected.
+ * @param filter           The filter, or NULL.
+ * @param rejected_counts  The counters filled by nsv_filter_keep.
+ */
+void nsv_filter_log_counts (const struct nsv_filter_t *filter,
+                            const uint32_t *rejected_counts);
+
+#endif
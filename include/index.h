@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NANOSVC_INDEX_H
+#define NANOSVC_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A chunk is a range of virtual file offsets in a BAM file.  The range
+ * starts at 'begin' and ends right before 'end'.
+ */
+struct nsv_index_chunk_t
+{
+  uint64_t begin;               /*< The virtual offset of the first record. */
+  uint64_t end;                 /*< The virtual offset past the last record. */
+};
+
+/**
+ * A bin holds the chunks of records that fall inside the same genomic
+ * interval, as described in section 5 of the SAMv1 specification.
+ */
+struct nsv_index_bin_t
+{
+  uint32_t bin;                 /*< The bin number. */
+  uint64_t loffset;             /*< The smallest virtual offset of a record
+                                    in the bin (CSI only). */
+  uint32_t chunks_len;          /*< The number of chunks. */
+  struct nsv_index_chunk_t *chunks;
+};
+
+/**
+ * This data structure contains the index of a single reference sequence.
+ */
+struct nsv_index_reference_t
+{
+  uint32_t bins_len;            /*< The number of bins. */
+  struct nsv_index_bin_t *bins; /*< The bins, sorted by bin number. */
+  uint32_t intervals_len;       /*< The number of linear index entries. */
+  uint64_t *intervals;          /*< The linear index (BAI only). */
+};
+
+/**
+ * This data structure contains a BAI or CSI index of a BAM file.  A BAI
+ * index is a CSI index with a minimal interval of 2^14 and a depth of 5.
+ */
+struct nsv_index_t
+{
+  int32_t min_shift;            /*< The size of the smallest bins, as 2^n. */
+  int32_t depth;                /*< The number of levels below the root. */
+  bool is_csi;                  /*< Set for CSI indexes. */
+  int32_t references_len;       /*< The number of references. */
+  struct nsv_index_reference_t *references;
+};
+
+/**
+ * This function loads the index of a BAM file.  It looks for
+ * '<filename>.bai' first, and for '<filename>.csi' otherwise.
+ * @param filename  The name of the BAM file, not of the index.
+ *
+ * @return A pointer to a dynamically allocated nsv_index_t object, or NULL
+ *         when no index could be loaded.
+ */
+struct nsv_index_t *nsv_index_open (const char *filename);
+
+/**
+ * This function returns the largest position a reference can have in the
+ * index.
+ * @param index  The index.
+ *
+ * @return The number of positions the bins of 'index' can describe.
+ */
+int64_t nsv_index_max_position (struct nsv_index_t *index);
+
+/**
+ * This function finds the chunks that can contain records overlapping a
+ * region.  The chunks are sorted, and chunks that overlap are merged, so
+ * that no record is read twice.
+ * @param index       The index to search in.
+ * @param reference   The index of the reference sequence in the BAM file.
+ * @param begin       The 0-based start of the region.
+ * @param end         The 0-based end of the region, exclusive.
+ * @param chunks_len  A pointer to a uint32_t in which the number of chunks
+ *                    is placed.
+ *
+ * @return A dynamically allocated array of chunks, which must be freed
+ *         with free, or NULL when there are none.
+ */
+struct nsv_index_chunk_t *nsv_index_query (struct nsv_index_t *index,
+                                           int32_t reference,
+                                           int64_t begin, int64_t end,
+                                           uint32_t *chunks_len);
+
+/**
+ * This function removes a nsv_index_t from memory.
+ * @param index  The index to destroy.
+ */
+void nsv_index_destroy (struct nsv_index_t *index);
+
+#endif
@@ -19,6 +19,7 @@
 #define NANOSVC_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <libinfra/logger.h>
 
 /**
@@ -46,7 +47,17 @@ struct nsv_config_t {
   uint32_t max_window_size;
   uint32_t min_map_quality;
   uint32_t max_split;
+  uint32_t cluster_distance;
+  uint32_t cluster_count;
   float min_identity;
+  bool zero_copy;
+  bool grouped;
+  bool indexed;
+  bool sa_tag;
+  bool huge_pages;
+  bool prefilter;
+  char *region;
+  struct nsv_filter_t *filter;
   struct infra_logger_t *logger;
 };
 
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NANOSVC_QNAMES_H
+#define NANOSVC_QNAMES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The length of a qname in the form of a UUID, such as
+ * "1027c4d1-c386-bbc4-cd61-3e30d8f16adf", without its null character.
+ */
+#define NSV_QNAME_UUID_LEN 36
+
+/**
+ * This data structure is a qname in the form in which it is compared and
+ * hashed.  Nanopore reads are named by a UUID, which is stored as two
+ * integers instead of 36 characters.  Other names are kept as a string.
+ */
+struct nsv_qname_t
+{
+  uint64_t words[2];            /*< The UUID, or the hash and length of
+                                    'name'. */
+  const char *name;             /*< The name, or NULL for a UUID. */
+};
+
+/**
+ * This data structure is a slot in the table of an nsv_qnames_t.
+ */
+struct nsv_qnames_slot_t
+{
+  struct nsv_qname_t key;       /*< The qname. */
+  void *element;                /*< The element, or NULL for an empty slot. */
+};
+
+/**
+ * This data structure maps qnames to elements.  It is a hash table with
+ * open addressing and linear probing, so a lookup usually touches a single
+ * cache line of the table.  UUIDs are stored in the table itself.  Other
+ * keys refer to the name of their element, which the caller keeps, and
+ * their hashes are stored next to them, so that the table can grow
+ * without hashing the keys again.
+ */
+struct nsv_qnames_t
+{
+  struct nsv_qnames_slot_t *slots; /*< The table, of 'capacity' slots. */
+  uint32_t capacity;            /*< The number of slots, a power of two. */
+  uint32_t count;               /*< The number of slots in use. */
+};
+
+/**
+ * This data structure is a Bloom filter of qnames.  It tells whether a
+ * qname may have been added to it, in a bit more than a byte per qname.
+ * All bits of a qname are in the same block of 64 bytes, so that a lookup
+ * touches a single cache line.
+ */
+struct nsv_qnames_bloom_t
+{
+  uint64_t *blocks;             /*< The blocks, of 8 words each. */
+  size_t blocks_mask;           /*< The number of blocks minus one. */
+};
+
+/**
+ * This function hashes a qname.  Unlike nsv_qname_init, it does not need
+ * a null-terminated name.
+ * @param key     The name.
+ * @param length  The number of characters in 'key'.
+ *
+ * @return The hash of 'key'.
+ */
+uint64_t nsv_qnames_hash (const char *key, size_t length);
+
+/**
+ * This function prepares 'qname' for use as a key.  A lowercase UUID is
+ * encoded as two integers.  Any other name is referred to, not copied, so
+ * 'key' is only valid as long as 'qname' is.
+ * @param key    The key to fill in.
+ * @param qname  The null-terminated name.
+ */
+void nsv_qname_init (struct nsv_qname_t *key, const char *qname);
+
+/**
+ * This function compares two keys.
+ * @param a  The first key.
+ * @param b  The second key.
+ *
+ * @return true when both keys are the same name, false otherwise.
+ */
+bool nsv_qname_equal (const struct nsv_qname_t *a,
+                      const struct nsv_qname_t *b);
+
+/**
+ * This function returns the name of a key as a string.
+ * @param key     The key.
+ * @param buffer  Memory for at least NSV_QNAME_UUID_LEN + 1 characters,
+ *                which is used to write out a UUID.
+ *
+ * @return The name, which is either 'buffer' or the name of 'key'.
+ */
+const char *nsv_qname_string (const struct nsv_qname_t *key, char *buffer);
+
+/**
+ * This function creates an empty qname index.
+ * @param capacity  The number of qnames to make room for, or 0.
+ *
+ * @return A pointer to a dynamically allocated nsv_qnames_t object.
+ */
+struct nsv_qnames_t *nsv_qnames_new (uint32_t capacity);
+
+/**
+ * This function adds an element to the index.  When 'qname' is already in
+ * the index, its element is replaced.
+ * @param qnames   The index to add the element to.
+ * @param qname    The key to store the element under.  Its name is not
+ *                 copied, so it must stay valid until the index is
+ *                 destroyed, for example by being the name of 'element'.
+ * @param element  The element to store, which cannot be NULL.
+ *
+ * @return true on success, false on an allocation failure.
+ */
+bool nsv_qnames_insert (struct nsv_qnames_t *qnames,
+                        const struct nsv_qname_t *qname, void *element);
+
+/**
+ * This function looks up the element stored under 'qname'.
+ * @param qnames  The index to search in.
+ * @param qname   The key to look for.
+ *
+ * @return The element, or NULL when 'qname' is not in the index.
+ */
+void *nsv_qnames_find (struct nsv_qnames_t *qnames,
+                       const struct nsv_qname_t *qname);
+
+/**
+ * This function returns the number of qnames in the index.
+ * @param qnames  The index.
+ *
+ * @return The number of qnames in the index.
+ */
+uint32_t nsv_qnames_count (struct nsv_qnames_t *qnames);
+
+/**
+ * This function removes the index from memory.  The elements and the names
+ * of the keys are not freed.
+ * @param qnames  The index to destroy.
+ */
+void nsv_qnames_destroy (struct nsv_qnames_t *qnames);
+
+/**
+ * This function creates a Bloom filter that is just large enough for a
+ * known set of qnames.
+ * @param hashes      The nsv_qnames_hash values of the qnames.
+ * @param hashes_len  The number of values in 'hashes'.
+ *
+ * @return A pointer to a dynamically allocated nsv_qnames_bloom_t object,
+ *         or NULL on an allocation failure.
+ */
+struct nsv_qnames_bloom_t *nsv_qnames_bloom_new (const uint64_t *hashes,
+                                                 size_t hashes_len);
+
+/**
+ * This function tells whether a qname may be in a Bloom filter.  It does
+ * not modify 'bloom', so it can be called from multiple threads at once.
+ * @param bloom  The filter to look in.
+ * @param hash   The nsv_qnames_hash value of the qname.
+ *
+ * @return false when the qname was not added, true when it probably was.
+ */
+bool nsv_qnames_bloom_find (const struct nsv_qnames_bloom_t *bloom,
+                            uint64_t hash);
+
+/**
+ * This function removes a Bloom filter from memory.
+ * @param bloom  The filter to destroy, or NULL.
+ */
+void nsv_qnames_bloom_destroy (struct nsv_qnames_bloom_t *bloom);
+
+#endif
@@ -19,7 +19,10 @@
 #define NANOSVC_READ_H
 
 #include "trie.h"
+#include "qnames.h"
 #include "segment.h"
+#include "contig.h"
+#include "arena.h"
 #include "nanosvc.h"
 
 #include <glib.h>
@@ -38,12 +41,25 @@ struct nsv_read_t
   /*----------------------------------------------------------------------.
    | Other elements.
    '----------------------------------------------------------------------*/
-  char *qname;
+  struct nsv_qname_t qname;     /* Use nsv_qname_string to print it. */
   //uint32_t seq_len;             /* This cannot be determined easily. */
-  GList *segments;
+  GList *segments;              /* In an arena, the links are too. */
   GTree *btree;
+  bool in_arena;                /* Set when the read belongs to an arena. */
 };
 
+/**
+ * The type of function that is called for each read by
+ * nsv_reads_foreach_in_sam and nsv_reads_foreach_in_bam.  The read is
+ * removed from memory when the function returns.
+ * @param read       The read, with all of its segments.
+ * @param user_data  The pointer that was passed along with the function.
+ *
+ * @return true to continue, false to stop reading with an error.
+ */
+typedef bool (*nsv_read_callback_t) (struct nsv_read_t *read,
+                                     void *user_data);
+
 /**
  * This function creates an empty read base structure.
  * @param A pointer to a dynamically allocated nsv_read_t object.
@@ -51,7 +67,18 @@ struct nsv_read_t
 struct nsv_read_t *nsv_read_new (void);
 
 /**
- * This function adds a segment to a read.
+ * This function creates an empty read in an arena.  The read, its qname
+ * and the links of its list of segments are removed from memory along
+ * with the arena.
+ * @param arena  The arena to allocate the read from, or NULL to use malloc
+ *               like nsv_read_new.
+ *
+ * @return A pointer to an nsv_read_t object.
+ */
+struct nsv_read_t *nsv_read_new_in_arena (struct nsv_arena_t *arena);
+
+/**
+ * This function adds a segment to a read that is not in an arena.
  * @param read     
  * @param segment  
  *
@@ -62,21 +89,97 @@ bool nsv_read_add_segment (struct nsv_read_t *read,
 
 /**
  * This function extracts a list of nsv_read_t objects from a BAM file.
- * @param filename  The file to read.
+ *
+ * When 'arena' is given, the reads and their segments are allocated from
+ * it.  They are then removed from memory by destroying the arena, after
+ * freeing the list itself with g_list_free.  Each worker thread fills an
+ * arena of its own, which is merged into 'arena' afterwards.
+ * @param filename     The file to read.
+ * @param contigs      The contig dictionary to add the file's references to.
+ * @param arena        The arena to allocate the reads from, or NULL.
+ * @param success_ptr  A pointer to a bool that is set to false on failure,
+ *                     and to true otherwise.  An empty list is not a
+ *                     failure: it means that no read passed the filters.
  * @return A GList containing nsv_read_t objects.
  */
-GList * nsv_reads_from_bam (const char *filename);
+GList * nsv_reads_from_bam (const char *filename,
+                            struct nsv_contigs_t *contigs,
+                            struct nsv_arena_t *arena,
+                            bool *success_ptr);
 
 /**
  * This function extracts a list of nsv_read_t objects from a SAM file.
- * @param filename  The file to read.
+ * See nsv_reads_from_bam for the use of 'arena' and 'success_ptr'.
+ * @param filename     The file to read.
+ * @param contigs      The contig dictionary to add the file's references to.
+ * @param arena        The arena to allocate the reads from, or NULL.
+ * @param success_ptr  A pointer to a bool that is set to false on failure,
+ *                     and to true otherwise.
+ * @return A GList containing nsv_read_t objects.
+ */
+GList * nsv_reads_from_sam (const char *filename,
+                            struct nsv_contigs_t *contigs,
+                            struct nsv_arena_t *arena,
+                            bool *success_ptr);
+
+/**
+ * This function calls 'callback' for each read in a SAM file whose
+ * segments are grouped by qname, such as name-sorted or collated output.
+ * A read is handed over as soon as the qname changes, so only one read is
+ * kept in memory at a time.  When the segments of a read are not adjacent
+ * in the input, the read is reported once for each group.
+ * @param filename   The file to read.
+ * @param contigs    The contig dictionary to add the file's references to.
+ * @param callback   The function to call for each read.
+ * @param user_data  A pointer that is passed to 'callback'.
+ *
+ * @return true on success, false on failure.
+ */
+bool nsv_reads_foreach_in_sam (const char *filename,
+                               struct nsv_contigs_t *contigs,
+                               nsv_read_callback_t callback,
+                               void *user_data);
+
+/**
+ * This function is the BAM equivalent of nsv_reads_foreach_in_sam.
+ * @param filename   The file to read.
+ * @param contigs    The contig dictionary to add the file's references to.
+ * @param callback   The function to call for each read.
+ * @param user_data  A pointer that is passed to 'callback'.
+ *
+ * @return true on success, false on failure.
+ */
+bool nsv_reads_foreach_in_bam (const char *filename,
+                               struct nsv_contigs_t *contigs,
+                               nsv_read_callback_t callback,
+                               void *user_data);
+
+/**
+ * This function extracts a list of nsv_read_t objects from a
+ * coordinate-sorted BAM file with a .bai or .csi index.  The reference
+ * sequences are split into tiles that are read on separate threads, each
+ * with its own file handle.  Only segments that overlap 'region' are kept.
+ * See nsv_reads_from_bam for the use of 'arena' and 'success_ptr'.
+ * @param filename     The file to read.
+ * @param contigs      The contig dictionary to add the file's references to.
+ * @param region       A region in the form "chr", "chr:start" or
+ *                     "chr:start-end", or NULL to read all references.
+ * @param arena        The arena to allocate the reads from, or NULL.
+ * @param success_ptr  A pointer to a bool that is set to false on failure,
+ *                     and to true otherwise.
+ *
  * @return A GList containing nsv_read_t objects.
  */
-GList * nsv_reads_from_sam (const char *filename);
+GList * nsv_reads_from_bam_index (const char *filename,
+                                  struct nsv_contigs_t *contigs,
+                                  const char *region,
+                                  struct nsv_arena_t *arena,
+                                  bool *success_ptr);
 
 /**
  * This function removes a nsv_read_t from memory.  A void pointer
- * is used to play nicely with generic 'free' callback handlers.
+ * is used to play nicely with generic 'free' callback handlers.  Reads in
+ * an arena are left alone, because they go with the arena.
  * @param read_obj   A pointer to a nsv_read_t struct.
  */
 void nsv_read_destroy (void *read_obj);
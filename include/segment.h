@@ -19,67 +19,229 @@
 #define NANOSVC_SEGMENT_H
 
 #include "nanosvc.h"
+#include "stream.h"
+#include "contig.h"
+#include "arena.h"
+#include "qnames.h"
 #include <glib.h>
 
+/**
+ * This enumeration contains the CIGAR operations, numbered like in BAM
+ * files.  A CIGAR is stored as an array of uint32_t values, each holding
+ * the length of an operation in the upper 28 bits and the operation in
+ * the lower 4 bits.
+ */
+enum nsv_cigar_operation_e {
+  NSV_CIGAR_MATCH     = 0,      /*< M */
+  NSV_CIGAR_INSERTION = 1,      /*< I */
+  NSV_CIGAR_DELETION  = 2,      /*< D */
+  NSV_CIGAR_SKIP      = 3,      /*< N */
+  NSV_CIGAR_SOFT_CLIP = 4,      /*< S */
+  NSV_CIGAR_HARD_CLIP = 5,      /*< H */
+  NSV_CIGAR_PADDING   = 6,      /*< P */
+  NSV_CIGAR_EQUAL     = 7,      /*< = */
+  NSV_CIGAR_DIFF      = 8       /*< X */
+};
+
+/**
+ * The characters of the CIGAR operations, indexed by nsv_cigar_operation_e.
+ */
+#define NSV_CIGAR_OPERATORS "MIDNSHP=X"
+
+/**
+ * This function returns the operation of a packed CIGAR element.
+ * @param element  An element of a CIGAR array.
+ * @return The nsv_cigar_operation_e of 'element'.
+ */
+static inline uint8_t
+nsv_cigar_operation (uint32_t element)
+{
+  return element & 0xf;
+}
+
+/**
+ * This function returns the length of a packed CIGAR element.
+ * @param element  An element of a CIGAR array.
+ * @return The number of bases 'element' spans.
+ */
+static inline uint32_t
+nsv_cigar_length (uint32_t element)
+{
+  return element >> 4;
+}
+
+/**
+ * This function returns the character of a packed CIGAR element.
+ * @param element  An element of a CIGAR array.
+ * @return One of the characters in NSV_CIGAR_OPERATORS.
+ */
+static inline char
+nsv_cigar_operator (uint32_t element)
+{
+  return NSV_CIGAR_OPERATORS[element & 0xf];
+}
+
 /**
  * This data structure contains the quantitative information from a CIGAR
- * string.
+ * string.  The counters are 32 bits wide, because a single operation of an
+ * ultra-long read can be longer than 65535 bases.
  */
 struct nsv_segment_cigar_overview_t
 {
-  uint16_t insertions;        /*< Number of insertions. */
-  uint16_t deletions;         /*< Number of deletions. */
-  uint16_t alignment_matches; /*< Number of alignment matches. */
-  uint16_t matches;           /*< Number of matches to the reference. */
-  uint16_t mismatches;        /*< Number of mismatches to the reference. */
-  uint16_t skipped;           /*< Number of skipped bases from the reference. */
-  uint16_t soft_clip;         /*< Number of soft clipping sequences. */
-  uint16_t hard_clip;         /*< Position of the hard clipping point. */
-  uint16_t padding;           /*< Number of silent deletions from the
+  uint32_t insertions;        /*< Number of insertions. */
+  uint32_t deletions;         /*< Number of deletions. */
+  uint32_t alignment_matches; /*< Number of alignment matches. */
+  uint32_t matches;           /*< Number of matches to the reference. */
+  uint32_t mismatches;        /*< Number of mismatches to the reference. */
+  uint32_t skipped;           /*< Number of skipped bases from the reference. */
+  uint32_t soft_clip;         /*< Number of soft clipped bases. */
+  uint32_t hard_clip;         /*< Number of hard clipped bases. */
+  uint32_t padding;           /*< Number of silent deletions from the
                                   padded reference. */
+  uint32_t query_length;      /*< The sum of M, I, S, = and X. */
+  uint32_t reference_length;  /*< The sum of M, D, N, = and X. */
+  int32_t first_clip;         /*< The length of the first clip, or -1. */
+  int32_t last_clip;          /*< The length of the last clip, or -1. */
+};
+
+/**
+ * This enumeration contains a bit for each column of a SAM alignment line.
+ * A combination of these bits tells the parser which columns to store.
+ */
+enum nsv_segment_column_e {
+  NSV_COLUMN_QNAME = 1 << 0,
+  NSV_COLUMN_FLAG  = 1 << 1,
+  NSV_COLUMN_RNAME = 1 << 2,
+  NSV_COLUMN_POS   = 1 << 3,
+  NSV_COLUMN_MAPQ  = 1 << 4,
+  NSV_COLUMN_CIGAR = 1 << 5,
+  NSV_COLUMN_RNEXT = 1 << 6,
+  NSV_COLUMN_PNEXT = 1 << 7,
+  NSV_COLUMN_TLEN  = 1 << 8,
+  NSV_COLUMN_SEQ   = 1 << 9,
+  NSV_COLUMN_QUAL  = 1 << 10,
+  NSV_COLUMN_TAGS  = 1 << 11
 };
 
+/**
+ * All mandatory columns of a SAM alignment line.  The optional fields,
+ * NSV_COLUMN_TAGS, must be asked for separately.
+ */
+#define NSV_COLUMNS_ALL 0x7ff
+
+/**
+ * The columns needed to detect breakpoints.  The sequence length is
+ * derived from the CIGAR string when the sequence itself is not stored.
+ * The optional fields hold the NM and MD tags, from which the identity of
+ * alignments with M operations is derived, and the SA tag.
+ */
+#define NSV_COLUMNS_BREAKPOINT (NSV_COLUMN_QNAME | NSV_COLUMN_FLAG     \
+                                | NSV_COLUMN_RNAME | NSV_COLUMN_POS    \
+                                | NSV_COLUMN_MAPQ | NSV_COLUMN_CIGAR   \
+                                | NSV_COLUMN_TAGS)
+
+/**
+ * The largest size of an nsv_segment_t, in bytes, and the alignment of
+ * each segment.  With this size, a segment never spans two cache lines.
+ */
+#define NSV_SEGMENT_HOT_SIZE 32
+
 /**
  * This data structure contains the information about a segment of a
- * sequence alignment map.
+ * sequence alignment map that filtering, breakpoint detection and
+ * clustering look at.  The other fields are in an nsv_segment_cold_t,
+ * which is reached with nsv_segment_cold.
  */
 struct nsv_segment_t
 {
   /*----------------------------------------------------------------------.
    | Object identification elements.
    '----------------------------------------------------------------------*/
-  enum nanosvc_e type;          /*< Data type specification. */
+  uint8_t type;                 /*< Data type specification, a nanosvc_e
+                                    value. */
+  bool in_arena;                /*< Set when the segment and its strings
+                                    belong to an nsv_arena_t. */
 
   /*----------------------------------------------------------------------.
    | SAMv1 elements.
    '----------------------------------------------------------------------*/
   /* The qname is stored by the read. */
-  int16_t flag;                 /*< Bitwise flag. */
-  char *rname;                  /*< Reference sequence name. */
+  uint16_t flag;                /*< Bitwise flag. */
+  int32_t rname_id;             /*< Reference sequence index, or -1. */
   int32_t pos;                  /*< 1-based left most mapping position. */
-  uint16_t mapq;                 /*< Mapping quality. */
-  char *cigar;                  /*< CIGAR string. */
-  char *rnext;                  /*< Reference name of the mate/next read. */
+
+  /*----------------------------------------------------------------------.
+   | Extra elements.
+   '----------------------------------------------------------------------*/
+  int32_t end;                  /*< The position after the last reference
+                                    base of the alignment. */
+  int32_t clip;                 /*< The first clip in the CIGAR string, or
+                                    -1. */
+  uint32_t seq_len;             /*< Segment sequence length. */
+  float pid;                    /*< The percentage identity. */
+  uint8_t mapq;                 /*< Mapping quality. */
+};
+
+_Static_assert (sizeof (struct nsv_segment_t) <= NSV_SEGMENT_HOT_SIZE,
+                "The hot fields of a segment must fit in half a cache line.");
+
+/**
+ * This data structure contains the fields of a segment that are only
+ * needed once in a while, such as its strings.
+ */
+struct nsv_segment_cold_t
+{
+  /*----------------------------------------------------------------------.
+   | SAMv1 elements.
+   '----------------------------------------------------------------------*/
+  uint32_t *cigar;              /*< CIGAR operations, see
+                                    nsv_cigar_operation_e. */
+  uint32_t cigar_len;           /*< The number of CIGAR operations. */
+  int32_t rnext_id;             /*< Reference sequence index of the
+                                    mate/next read, or -1. */
   int32_t pnext;                /*< Position of the mate/next read. */
   int32_t tlen;                 /*< Observed template length. */
   char *seq;                    /*< Segment sequence. */
   char *qual;                   /*< ASCII of the Phred-scaled base quality+33.*/
 
+  /*----------------------------------------------------------------------.
+   | Optional fields.  These are only set when NSV_COLUMN_TAGS is parsed.
+   '----------------------------------------------------------------------*/
+  int32_t nm;                   /*< Edit distance to the reference (NM), or
+                                    -1 when it is not known. */
+  int32_t md_mismatches;        /*< The number of mismatched bases in the MD
+                                    tag, or -1 when it is not known. */
+  char *sa;                     /*< Other alignments of the read (SA), in the
+                                    form "rname,pos,strand,CIGAR,mapQ,NM;",
+                                    or NULL. */
+
   /*----------------------------------------------------------------------.
    | Extra elements.
    '----------------------------------------------------------------------*/
   struct nsv_read_t *read;      /*< The read this segment belongs to. */
-  uint32_t seq_len;             /*< Segment sequence length. */
+  struct nsv_chunk_t *chunk;    /*< The input chunk the strings point into,
+                                    or NULL when the strings are copies. */
+  struct nsv_segment_cigar_overview_t overview; /*< The decoded CIGAR. */
+};
 
-  float rlength;                /*< Median length of the total reads. */
-  float plength;                /*< Median segment length percentage of the
-                                    two segments of the structural variant. */
-  int32_t clip;                 /*< The first clip value in the CIGAR string. */
+/**
+ * This function returns the cold fields of a segment.  The segments of an
+ * arena are packed together in a table, with their cold fields in a
+ * parallel array, and other segments have them right behind them.  Either
+ * way, no pointer to them has to be kept.
+ * @param segment  The segment.
+ *
+ * @return The cold fields of 'segment'.
+ */
+static inline struct nsv_segment_cold_t *
+nsv_segment_cold (struct nsv_segment_t *segment)
+{
+  if (segment->in_arena)
+    return nsv_arena_record_cold (segment);
 
-  int32_t end;
-  char *id;
-  float pid;
-};
+  return (struct nsv_segment_cold_t *)
+    ((char *)segment + NSV_SEGMENT_HOT_SIZE);
+}
 
 /**
  * This function creates an empty segment base structure.
@@ -88,9 +250,94 @@ struct nsv_segment_t
 struct nsv_segment_t * nsv_segment_new (void);
 
 /**
- * This function parses the CIGAR string and sets the clip member of a
- * @ref nsv_segment.
- * @param segment  The segment to analyze the CIGAR string of.
+ * This function creates an empty segment in an arena.  The segment and the
+ * strings it owns are removed from memory along with the arena.
+ * @param arena  The arena to allocate the segment from, or NULL to use
+ *               malloc like nsv_segment_new.
+ *
+ * @return A pointer to an nsv_segment_t object.
+ */
+struct nsv_segment_t * nsv_segment_new_in_arena (struct nsv_arena_t *arena);
+
+/**
+ * This function prepares an overview to which operations are added with
+ * nsv_segment_cigar_add.
+ * @param overview  The overview to clear.
+ */
+void nsv_segment_cigar_init (struct nsv_segment_cigar_overview_t *overview);
+
+/**
+ * This function adds a single CIGAR operation to an overview.
+ * @param overview  The overview to add the operation to.
+ * @param element   The packed operation and its length.
+ */
+void nsv_segment_cigar_add (struct nsv_segment_cigar_overview_t *overview,
+                            uint32_t element);
+
+/**
+ * This function returns the number of mismatched bases in the value of an
+ * MD tag, which are the reference bases that are not part of a deletion.
+ * @param md      The value of the MD tag, which does not have to be
+ *                null-terminated.
+ * @param length  The number of characters in 'md'.
+ *
+ * @return The number of mismatches.
+ */
+int32_t nsv_segment_md_mismatches (const char *md, size_t length);
+
+/**
+ * This function stores 'overview' as the decoded CIGAR of 'segment', and
+ * derives the fields that depend on it: the first clip, the percentage
+ * identity, the end position and, when no sequence was stored, the
+ * sequence length.  When the CIGAR has M operations, the identity is
+ * derived from the MD or NM tag, so the tags must be stored first.
+ * @param segment   The segment.
+ * @param overview  The decoded CIGAR of 'segment'.
+ */
+void
+nsv_segment_set_overview (struct nsv_segment_t *segment,
+                          const struct nsv_segment_cigar_overview_t *overview);
+
+/**
+ * This function converts a CIGAR string to an array of packed operations,
+ * and stores their overview, see nsv_cigar_overview.  Characters that are
+ * not an operation are skipped.  A CIGAR of "*" has no operations.
+ * @param text        The CIGAR string, which does not have to be
+ *                    null-terminated.
+ * @param length      The number of characters in 'text'.
+ * @param arena       The arena to allocate from, or NULL to use malloc.
+ * @param length_ptr  Where to store the number of operations.
+ * @param overview    Where to store the overview of the operations.
+ *
+ * @return The operations, or NULL on an allocation failure.
+ */
+uint32_t *
+nsv_segment_cigar_from_text (const char *text, size_t length,
+                             struct nsv_arena_t *arena, uint32_t *length_ptr,
+                             struct nsv_segment_cigar_overview_t *overview);
+
+/**
+ * This function writes the CIGAR operations of 'segment' as text, for
+ * output.
+ * @param segment  The segment.
+ *
+ * @return A dynamically allocated string, which must be freed, or NULL on
+ *         an allocation failure.
+ */
+char *nsv_segment_cigar_string (struct nsv_segment_t *segment);
+
+/**
+ * This function decodes the CIGAR operations of 'segment' in a single
+ * pass, and caches the result with nsv_segment_set_overview.  The parsers
+ * call it, so it is only needed after changing the operations of a
+ * segment.
+ * @param segment  The segment to decode the CIGAR operations of.
+ */
+void nsv_segment_cigar_decode (struct nsv_segment_t *segment);
+
+/**
+ * This function returns the decoded CIGAR string of a segment.
+ * @param segment  The segment.
  * @return A nsv_segment_cigar_overview_t struct.
  */
 struct nsv_segment_cigar_overview_t
@@ -98,17 +345,73 @@ nsv_segment_cigar_overview (struct nsv_segment_t *segment);
 
 /**
  * This function returns the value of the first clip (hard or soft)
- * it finds in the CIGAR string.
+ * in the CIGAR string.
  *
- * @param segment  The segment to analyze the CIGAR string of.
- * @return the first clip found in the CIGAR string.
+ * @param segment  The segment.
+ * @return the first clip found in the CIGAR string, or -1.
  */
 int32_t nsv_segment_cigar_first_clip (struct nsv_segment_t *segment);
 
 /**
- * This function returns the percentage identity to the reference.
- * @param segment  The segment to analyze th CIGAR string of.
- * @return The percentage identity to the reference.
+ * This function returns the value of the last clip (hard or soft) in the
+ * CIGAR string.
+ *
+ * @param segment  The segment.
+ * @return the last clip found in the CIGAR string, or -1.
+ */
+int32_t nsv_segment_cigar_last_clip (struct nsv_segment_t *segment);
+
+/**
+ * This function returns the length of the query sequence as described by
+ * the CIGAR string, which is the sum of the M, I, S, = and X operations.
+ *
+ * @param segment  The segment.
+ * @return The number of bases in the segment's sequence.
+ */
+uint32_t nsv_segment_cigar_query_length (struct nsv_segment_t *segment);
+
+/**
+ * This function returns the number of reference bases the segment is
+ * aligned to, which is the sum of the M, D, N, = and X operations.
+ *
+ * @param segment  The segment.
+ * @return The length of the alignment on the reference.
+ */
+uint32_t nsv_segment_cigar_reference_length (struct nsv_segment_t *segment);
+
+/**
+ * This function creates a segment for each alignment in the SA tag of
+ * 'segment'.  Aligners list all supplementary alignments of a read in the
+ * SA tag of its primary record, so the segments of a read can be found
+ * without looking at its other records.
+ *
+ * The new segments have the 0x800 flag set, and the 0x10 flag for
+ * alignments on the reverse strand.  Their sequence length is derived from
+ * the CIGAR string in the tag.
+ * @param segment       The segment with the SA tag.
+ * @param contigs       The contig dictionary to resolve reference names
+ *                      with.
+ * @param arena         The arena to allocate the new segments from, or
+ *                      NULL.
+ * @param segments_ptr  A pointer to a GList* to prepend the new segments
+ *                      to.
+ *
+ * @return true on success, false when the tag is malformed or on an
+ *         allocation failure.
+ */
+bool nsv_segment_sa_segments (struct nsv_segment_t *segment,
+                              struct nsv_contigs_t *contigs,
+                              struct nsv_arena_t *arena,
+                              GList **segments_ptr);
+
+/**
+ * This function returns the identity to the reference: the fraction of the
+ * aligned columns (M, =, X, I and D) that are matches.  The mismatches
+ * within M operations are taken from the MD tag, or else from the NM tag,
+ * so the identity of a CIGAR with M operations is only known when one of
+ * these tags was parsed.
+ * @param segment  The segment.
+ * @return The identity to the reference, or -1 when it is not known.
  */
 float nsv_segment_cigar_pid (struct nsv_segment_t *segment);
 
@@ -128,27 +431,136 @@ float nsv_segment_cigar_pid (struct nsv_segment_t *segment);
 int nsv_segment_clip_compare (const void *first, const void *second);
 
 /**
- * 
+ * This function removes a nsv_segment_t from memory.  A void pointer
+ * is used to play nicely with generic 'free' callback handlers.  Segments
+ * in an arena are left alone, because they go with the arena.
+ * @param segment_obj   A pointer to a nsv_segment_t struct.
  */
-void nsv_segment_plength (struct nsv_segment_t *segment);
+void nsv_segment_destroy (void *segment_obj);
 
-void nsv_segment_set_pid (void);
-void nsv_segment_set_clip (void);
+/**
+ * This data structure describes the records that can be rejected from
+ * their FLAG, MAPQ and CIGAR alone, before a segment is made for them.
+ * A record is rejected when it has any of the bits in 'flags', when its
+ * map quality is lower than 'min_mapq', or is 255 and 'reject_unavailable'
+ * is set, when 'require_clip' is set and its CIGAR has no clip, or when
+ * 'members' is set and does not have its qname.
+ */
+struct nsv_segment_filter_t
+{
+  uint16_t flags;               /*< The FLAG bits to reject. */
+  uint8_t min_mapq;             /*< The lowest map quality to accept. */
+  bool reject_unavailable;      /*< Whether to reject a map quality of 255. */
+  bool require_clip;            /*< Whether to reject CIGARs without S or H. */
+  const struct nsv_qnames_bloom_t *members; /*< The qnames to accept, or
+                                                NULL to accept all. */
+  uint32_t rejected_count;      /*< The number of records rejected. */
+};
 
 /**
- * This function removes a nsv_segment_t from memory.  A void pointer
- * is used to play nicely with generic 'free' callback handlers.
- * @param segment_obj   A pointer to a nsv_segment_t struct.
+ * This function applies the FLAG and MAPQ conditions of a filter.
+ * @param filter  The filter to apply.
+ * @param flag    The FLAG of a record.
+ * @param mapq    The MAPQ of a record.
+ *
+ * @return true when the record must be rejected, false otherwise.
  */
-void nsv_segment_destroy (void *segment_obj);
+static inline bool
+nsv_segment_filter_fields (const struct nsv_segment_filter_t *filter,
+                           uint16_t flag, uint8_t mapq)
+{
+  return ((flag & filter->flags)
+          || mapq < filter->min_mapq
+          || (mapq == 255 && filter->reject_unavailable));
+}
+
+/**
+ * This function applies a filter to a SAM alignment line, without
+ * modifying it or allocating memory.  Only the columns up to the CIGAR are
+ * looked at, so that lines that do not pass are skipped at the cost of
+ * finding six tabs.  It can be called from multiple threads at once.
+ * @param filter  The filter to apply.
+ * @param line    The line to look at.
+ * @param length  The length of the line, excluding the newline.
+ *
+ * @return true when the line must be rejected, false otherwise.  Lines
+ *         that are too short are left for the parser to report.
+ */
+bool nsv_segment_filter_line (const struct nsv_segment_filter_t *filter,
+                              const char *line, size_t length);
+
+/**
+ * This function tells whether a SAM alignment line may be one of several
+ * alignments of its read: whether it is paired, secondary or
+ * supplementary, or has an SA tag.  Only the qname and FLAG columns are
+ * parsed, and the line is searched for the SA tag.
+ * @param line       The line to look at.
+ * @param length     The length of the line, excluding the newline.
+ * @param qname_len  A pointer to a size_t in which the length of the
+ *                   qname, which starts the line, is placed.
+ *
+ * @return true when the read of 'line' may have other alignments, false
+ *         otherwise.
+ */
+bool nsv_segment_line_is_split (const char *line, size_t length,
+                                size_t *qname_len);
+
+/**
+ * This function parses a single SAM alignment line.  The tab characters in
+ * the line are replaced by null characters, as is the byte that follows
+ * the line.
+ *
+ * When 'chunk' is NULL, the string fields are copied.  Otherwise, the
+ * segment points into 'line' and keeps a reference to 'chunk', which must
+ * be the chunk that contains 'line'.  In an arena, that reference is held
+ * by the arena, once for all of its segments.
+ *
+ * Only the columns in 'columns' are stored.  The other string fields are
+ * left NULL, and parsing stops after the last requested column.  Of the
+ * optional fields, only NM and SA are kept.
+ *
+ * Reference names are stored as indexes into 'contigs'.  Names that are
+ * not in the dictionary yet are added to it.
+ * @param line       The line to parse.
+ * @param length     The length of the line, excluding the newline.
+ * @param chunk      The chunk containing 'line', or NULL.
+ * @param arena      The arena to allocate the segment and its copies from,
+ *                   or NULL.
+ * @param contigs    The contig dictionary to resolve reference names with.
+ * @param columns    A combination of nsv_segment_column_e values.
+ * @param qname_ptr  A pointer to a char* in which the qname will be placed.
+ *                   The qname points into 'line'.
+ *
+ * @return A pointer to a dynamically allocated nsv_segment_t.
+ */
+struct nsv_segment_t * nsv_segment_from_line (char *line, size_t length,
+                                              struct nsv_chunk_t *chunk,
+                                              struct nsv_arena_t *arena,
+                                              struct nsv_contigs_t *contigs,
+                                              uint32_t columns,
+                                              const char **qname_ptr);
 
 /**
- * This function attempts to read a segment from a stream.
- * @param stream  The stream to read from.
+ * This function attempts to read a segment from a stream.  The @SQ header
+ * lines are added to 'contigs', and other header lines are skipped.  When
+ * 'zero_copy' is set in the program's configuration, the segment points
+ * into the stream's chunk rather than owning copies of its strings.
+ * @param stream     The stream to read from.
+ * @param arena      The arena to allocate the segment from, or NULL.
+ * @param contigs    The contig dictionary to resolve reference names with.
+ * @param columns    A combination of nsv_segment_column_e values.
+ * @param filter     The filter to skip lines with, or NULL.  Skipped lines
+ *                   are counted in its 'rejected_count'.
  * @param qname_ptr  A pointer to a char* in which the qname will be placed.
+ *                   The qname is valid until the next call to this function.
  *
  * @return A pointer to a dynamically allocated nsv_segment_t.
  */
-struct nsv_segment_t * nsv_segment_from_stream (FILE *stream, char **qname_ptr);
+struct nsv_segment_t *
+nsv_segment_from_stream (struct nsv_stream_t *stream,
+                         struct nsv_arena_t *arena,
+                         struct nsv_contigs_t *contigs, uint32_t columns,
+                         struct nsv_segment_filter_t *filter,
+                         const char **qname_ptr);
 
 #endif
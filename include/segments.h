@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NANOSVC_SEGMENTS_H
+#define NANOSVC_SEGMENTS_H
+
+#include "segment.h"
+#include "read.h"
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * This data structure is a table of segments, stored column by column.
+ * Each column is an array with an element for every segment, so a stage
+ * that only looks at a few properties of each segment reads them from
+ * consecutive memory, instead of following a list link and a segment
+ * pointer per element.
+ *
+ * The segments of a read are stored next to each other.  The segments of
+ * read 'r' are the rows from 'read_offsets[r]' up to, but not including,
+ * 'read_offsets[r + 1]'.
+ */
+struct nsv_segments_t
+{
+  uint32_t length;              /*< The number of segments. */
+  uint16_t *flag;               /*< The bitwise flag of each segment. */
+  int32_t *rname_id;            /*< The reference sequence index. */
+  int32_t *pos;                 /*< The 1-based left most mapping position. */
+  int32_t *end;                 /*< The position the alignment ends at. */
+  uint8_t *mapq;                /*< The mapping quality. */
+  int32_t *clip;                /*< The first clip, or -1. */
+  float *pid;                   /*< The percentage identity. */
+  uint32_t *seq_len;            /*< The length of the sequence. */
+  uint32_t *read;               /*< The index of the read in 'reads'. */
+  struct nsv_segment_t **segments; /*< The segments, for the other fields. */
+
+  uint32_t reads_len;           /*< The number of reads. */
+  struct nsv_read_t **reads;    /*< The reads, in the order of the list. */
+  uint32_t *read_offsets;       /*< The first row of each read, followed by
+                                    'length'. */
+};
+
+/**
+ * This function creates a table of the segments of 'reads'.  The rows of a
+ * read are in the order of its list of segments.  The segments themselves
+ * are referred to, not copied, so the table must be destroyed before the
+ * reads are.
+ * @param reads  A GList of nsv_read_t objects.
+ *
+ * @return A pointer to a dynamically allocated nsv_segments_t object, or
+ *         NULL on an allocation failure.
+ */
+struct nsv_segments_t *nsv_segments_from_reads (GList *reads);
+
+/**
+ * This function orders the rows of each read by their first clip, like
+ * nsv_segment_clip_compare does for a list of segments.  Rows with the
+ * same clip keep their order.
+ * @param segments  The table to sort.
+ */
+void nsv_segments_sort_by_clip (struct nsv_segments_t *segments);
+
+/**
+ * This function removes a table from memory.  The segments and reads it
+ * refers to are left alone.
+ * @param segments  The table to destroy.
+ */
+void nsv_segments_destroy (struct nsv_segments_t *segments);
+
+#endif
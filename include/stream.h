@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NANOSVC_STREAM_H
+#define NANOSVC_STREAM_H
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The number of bytes read from the underlying file at once.
+ */
+#define NSV_STREAM_BUFFER_SIZE (4 * 1024 * 1024)
+
+/**
+ * A chunk is a reference-counted block of input.  Segments that are parsed
+ * without copying their fields keep a reference to the chunk they point
+ * into, so that the chunk is released when the last of them is destroyed.
+ */
+struct nsv_chunk_t
+{
+  int32_t references;           /*< The number of users of this chunk. */
+  size_t capacity;              /*< The usable size of 'data'. */
+  char data[];                  /*< The input bytes, with one spare byte. */
+};
+
+/**
+ * This function creates a chunk with a single reference.
+ * @param capacity  The number of bytes the chunk can hold.
+ *
+ * @return A pointer to a dynamically allocated nsv_chunk_t object.
+ */
+struct nsv_chunk_t *nsv_chunk_new (size_t capacity);
+
+/**
+ * This function adds a reference to a chunk.  It is safe to call this
+ * function from multiple threads.
+ * @param chunk  The chunk to reference.
+ *
+ * @return The chunk passed as 'chunk'.
+ */
+struct nsv_chunk_t *nsv_chunk_ref (struct nsv_chunk_t *chunk);
+
+/**
+ * This function drops a reference to a chunk, and removes the chunk from
+ * memory when it was the last reference.
+ * @param chunk  The chunk to release.
+ */
+void nsv_chunk_unref (struct nsv_chunk_t *chunk);
+
+/**
+ * This data structure contains the state of a block-buffered line reader.
+ * Instead of reading one character at a time, large blocks are read from
+ * the file, and lines are found with memchr.
+ */
+struct nsv_stream_t
+{
+  FILE *file;                   /*< The file to read from. */
+  struct nsv_chunk_t *chunk;    /*< The block that is being consumed. */
+  size_t begin;                 /*< The first unconsumed byte in 'chunk'. */
+  size_t end;                   /*< The number of bytes in 'chunk'. */
+  bool eof;                     /*< Set when 'file' has been exhausted. */
+  bool error;                   /*< Set when 'file' could not be read, or
+                                    when a chunk could not be allocated. */
+};
+
+/**
+ * This function creates a line reader for 'file'.
+ * @param file  The file to read from.
+ *
+ * @return A pointer to a dynamically allocated nsv_stream_t object.
+ */
+struct nsv_stream_t *nsv_stream_new (FILE *file);
+
+/**
+ * This function returns the next line of a stream.  The line is not
+ * terminated by a null character, and its trailing newline is not included.
+ * The byte following the line may be overwritten by the caller.
+ *
+ * The line lives in 'stream->chunk'.  Unless the caller takes a reference
+ * to that chunk, the returned pointer is only valid until the next call to
+ * this function.
+ * @param stream      The stream to read from.
+ * @param length_ptr  A pointer to a size_t in which the line length is placed.
+ *
+ * @return A pointer to the start of the line, or NULL at the end of the file
+ *         or on an error.  On an error, the 'error' field of 'stream' is
+ *         set.
+ */
+char *nsv_stream_next_line (struct nsv_stream_t *stream, size_t *length_ptr);
+
+/**
+ * This function returns all complete lines that are buffered in a stream,
+ * reading more of the file when there are none.  The lines, including their
+ * newlines, form a single block of 'length_ptr' bytes.  Only the last line
+ * of the file may lack a newline.
+ *
+ * Like with nsv_stream_next_line, the block lives in 'stream->chunk'.  A
+ * caller that takes a reference to that chunk can keep using the block
+ * after the next call, which is what allows blocks to be handed to other
+ * threads.
+ * @param stream      The stream to read from.
+ * @param length_ptr  A pointer to a size_t in which the block length is
+ *                    placed.
+ *
+ * @return A pointer to the start of the block, or NULL at the end of the
+ *         file or on an error.  On an error, the 'error' field of 'stream'
+ *         is set.
+ */
+char *nsv_stream_next_lines (struct nsv_stream_t *stream, size_t *length_ptr);
+
+/**
+ * This function removes a nsv_stream_t from memory.  The underlying file
+ * is not closed.
+ * @param stream  The stream to destroy.
+ */
+void nsv_stream_destroy (struct nsv_stream_t *stream);
+
+#endif
@@ -19,6 +19,7 @@
 #define NANOSV_STRUCTURAL_VARIANT_H
 
 #include "breakpoint.h"
+#include "cluster.h"
 
 struct nsv_sv_info_t
 {
@@ -40,6 +41,7 @@ struct nsv_sv_t {
   char *filter;
 
   struct nsv_breakpoint_t *breakpoint;
+  struct nsv_cluster_t *cluster;  /* The breakpoints the SV is called from. */
 };
 
 /**
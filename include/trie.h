@@ -24,25 +24,33 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct trie_pool_t;
+
 /**
  * A trie-like structure that can find an element by its name in 
- * -length of name- steps. */
+ * -length of name- steps.
+ *
+ * It is implemented as an adaptive radix tree.  Its inner nodes have room
+ * for 4, 16, 48 or 256 children, and grow as children are added.  Chains
+ * of nodes with a single child are compressed into a prefix, and a name
+ * ends in a leaf as soon as it differs from all other names.  The nodes
+ * are allocated from a pool that is freed in one go. */
 struct trie_node_t
 {
-  char key; /*< Should match the corresponding position of the identifier. */
-  struct trie_node_t **children; /*< The options after this key. */
-  size_t children_len; /*< The length of the children array.  */
-  void *element; /*< The element that can be identified at this point. */
+  void *root;                   /*< The root node or leaf, or NULL. */
+  uint32_t elements_len;        /*< The number of elements in the trie. */
+  struct trie_pool_t *pool;     /*< The memory the nodes are taken from. */
 };
 
 /**
- * Creates the root node of a trie.
+ * Creates an empty trie.
  * @return A pointer to a dynamically allocated trie_node_t.
  */
 struct trie_node_t * trie_new (void);
 
 /**
- * Inserts the element in the trie.
+ * Inserts the element in the trie.  When the name is already in the trie,
+ * its element is replaced.
  * @param trie     The trie to insert the element into.
  * @param name     The name to store the element under.
  * @param element  The element to insert in the trie.
@@ -61,7 +69,8 @@ bool trie_insert (struct trie_node_t *trie, const char *name, void *element);
 void * trie_find (struct trie_node_t *trie, const char *name);
 
 /**
- * Returns the number of elements in the trie.
+ * Returns the number of elements in the trie.  This number is kept up to
+ * date by trie_insert, so the trie is not traversed.
  * @param trie  The trie to analyze.
  *
  * @return The number of elements found in the trie.
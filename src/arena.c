@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "nanosvc.h"
+
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+/* Allocates a slab with room for at least 'size' bytes of objects. */
+static struct nsv_arena_slab_t *
+nsv_arena_slab_new (size_t size)
+{
+  size_t block_size = sizeof (struct nsv_arena_slab_t) + size;
+  if (block_size < NSV_ARENA_SLAB_SIZE)
+    block_size = NSV_ARENA_SLAB_SIZE;
+
+  struct nsv_arena_slab_t *slab = NULL;
+  if (nsv_config.huge_pages)
+    {
+      /* A huge page must be aligned to its size. */
+      block_size = (block_size + NSV_ARENA_SLAB_SIZE - 1)
+                   & ~((size_t)NSV_ARENA_SLAB_SIZE - 1);
+      if (posix_memalign ((void **)&slab, NSV_ARENA_SLAB_SIZE, block_size))
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
+      madvise (slab, block_size, MADV_HUGEPAGE);
+#endif
+    }
+  else
+    slab = malloc (block_size);
+
+  if (slab == NULL)
+    return NULL;
+
+  slab->next = NULL;
+  slab->used = 0;
+  slab->size = block_size - sizeof (struct nsv_arena_slab_t);
+  return slab;
+}
+
+/* Allocates a table for records of 'hot_size' and 'cold_size' bytes. */
+static struct nsv_arena_table_t *
+nsv_arena_table_new (size_t hot_size, size_t cold_size)
+{
+  /* The hot parts start at a multiple of their size after the header. */
+  size_t header = (sizeof (struct nsv_arena_table_t) + hot_size - 1)
+                  & ~(hot_size - 1);
+  if (header + hot_size + cold_size > NSV_ARENA_TABLE_SIZE)
+    return NULL;
+
+  struct nsv_arena_table_t *table;
+  if (posix_memalign ((void **)&table, NSV_ARENA_TABLE_SIZE,
+                      NSV_ARENA_TABLE_SIZE))
+    return NULL;
+
+#ifdef MADV_HUGEPAGE
+  if (nsv_config.huge_pages)
+    madvise (table, NSV_ARENA_TABLE_SIZE, MADV_HUGEPAGE);
+#endif
+
+  table->next = NULL;
+  table->hot_size = hot_size;
+  table->cold_size = cold_size;
+  table->capacity = (NSV_ARENA_TABLE_SIZE - header) / (hot_size + cold_size);
+  table->used = 0;
+  table->hot = (char *)table + header;
+  table->cold = table->hot + table->capacity * hot_size;
+  table->mark_slab = NULL;
+  table->mark_used = 0;
+  return table;
+}
+
+struct nsv_arena_t *
+nsv_arena_new (void)
+{
+  struct nsv_arena_t *arena = calloc (1, sizeof (struct nsv_arena_t));
+  if (arena == NULL)
+    infra_logger_error_alloc (nsv_config.logger);
+
+  return arena;
+}
+
+/* Returns the slab of 'arena' to allocate 'size' bytes from, after
+ * skipping to the next multiple of 'alignment'. */
+static struct nsv_arena_slab_t *
+nsv_arena_slab_for (struct nsv_arena_t *arena, size_t size, size_t alignment)
+{
+  struct nsv_arena_slab_t *slab = arena->slabs;
+  if (slab != NULL)
+    {
+      uintptr_t address = (uintptr_t)((char *)slab->data + slab->used);
+      size_t padding = -address & (alignment - 1);
+      if (slab->size - slab->used >= padding + size)
+        {
+          slab->used += padding;
+          return slab;
+        }
+    }
+
+  /* The data of a new slab is only aligned for pointers. */
+  slab = nsv_arena_slab_new (size + alignment - sizeof (void *));
+  if (slab == NULL)
+    return NULL;
+
+  slab->used = -(uintptr_t)slab->data & (alignment - 1);
+  slab->next = arena->slabs;
+  arena->slabs = slab;
+  return slab;
+}
+
+void *
+nsv_arena_alloc_aligned (struct nsv_arena_t *arena, size_t size,
+                         size_t alignment)
+{
+  if (arena == NULL)
+    {
+      void *memory;
+      return posix_memalign (&memory, alignment, size) ? NULL : memory;
+    }
+
+  /* Keep every object aligned for pointers. */
+  size = (size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+
+  struct nsv_arena_slab_t *slab = nsv_arena_slab_for (arena, size, alignment);
+  if (slab == NULL)
+    return NULL;
+
+  void *memory = (char *)slab->data + slab->used;
+  slab->used += size;
+  return memory;
+}
+
+void *
+nsv_arena_alloc (struct nsv_arena_t *arena, size_t size)
+{
+  if (arena == NULL)
+    return malloc (size);
+
+  return nsv_arena_alloc_aligned (arena, size, sizeof (void *));
+}
+
+void *
+nsv_arena_alloc_record (struct nsv_arena_t *arena, size_t hot_size,
+                        size_t cold_size)
+{
+  if (arena == NULL)
+    return NULL;
+
+  struct nsv_arena_table_t *table = arena->tables;
+  if (table == NULL
+      || table->used == table->capacity
+      || table->hot_size != hot_size
+      || table->cold_size != cold_size)
+    {
+      table = nsv_arena_table_new (hot_size, cold_size);
+      if (table == NULL)
+        return NULL;
+
+      table->next = arena->tables;
+      arena->tables = table;
+    }
+
+  /* The strings of a record are allocated from the slab after it, so the
+   * position of the slab is kept to give them back along with the
+   * record. */
+  table->mark_slab = arena->slabs;
+  table->mark_used = (arena->slabs != NULL) ? arena->slabs->used : 0;
+
+  void *memory = table->hot + (size_t)table->used * hot_size;
+  table->used++;
+  return memory;
+}
+
+void *
+nsv_arena_alloc0 (struct nsv_arena_t *arena, size_t size)
+{
+  if (arena == NULL)
+    return calloc (1, size);
+
+  void *memory = nsv_arena_alloc (arena, size);
+  if (memory != NULL)
+    memset (memory, 0, size);
+
+  return memory;
+}
+
+char *
+nsv_arena_strndup (struct nsv_arena_t *arena, const char *text,
+                   size_t length)
+{
+  char *copy = nsv_arena_alloc (arena, length + 1);
+  if (copy == NULL)
+    return NULL;
+
+  memcpy (copy, text, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+void
+nsv_arena_free_from (struct nsv_arena_t *arena, void *pointer)
+{
+  if (arena == NULL)
+    return;
+
+  struct nsv_arena_table_t *table = arena->tables;
+  if (table != NULL && table->used > 0
+      && (char *)pointer == table->hot + (table->used - 1) * table->hot_size)
+    {
+      table->used--;
+      if (table->mark_slab != NULL && table->mark_slab == arena->slabs)
+        arena->slabs->used = table->mark_used;
+
+      /* The slab position of the record before it is not known. */
+      table->mark_slab = NULL;
+      return;
+    }
+
+  if (arena->slabs == NULL)
+    return;
+
+  /* The offset is rounded up, so that 'pointer' can also be the end of an
+   * allocation that is cut short. */
+  char *data = (char *)arena->slabs->data;
+  if ((char *)pointer >= data && (char *)pointer < data + arena->slabs->used)
+    arena->slabs->used = ((char *)pointer - data + sizeof (void *) - 1)
+                         & ~(sizeof (void *) - 1);
+}
+
+bool
+nsv_arena_hold_chunk (struct nsv_arena_t *arena, struct nsv_chunk_t *chunk)
+{
+  if (arena == NULL || chunk == NULL)
+    return false;
+
+  /* Objects are made in input order, so a chunk that is held already is
+   * usually the last one. */
+  if (arena->chunks != NULL && arena->chunks->chunk == chunk)
+    return true;
+
+  struct nsv_arena_chunk_t *held = malloc (sizeof (struct nsv_arena_chunk_t));
+  if (held == NULL)
+    return false;
+
+  held->chunk = nsv_chunk_ref (chunk);
+  held->next = arena->chunks;
+  arena->chunks = held;
+  return true;
+}
+
+void
+nsv_arena_merge (struct nsv_arena_t *arena, struct nsv_arena_t *other)
+{
+  if (arena == NULL || other == NULL)
+    return;
+
+  if (other->chunks != NULL)
+    {
+      struct nsv_arena_chunk_t *last = other->chunks;
+      while (last->next != NULL)
+        last = last->next;
+
+      last->next = arena->chunks;
+      arena->chunks = other->chunks;
+    }
+
+  /* The table and the slab that 'arena' is filling stay in front. */
+  if (other->tables != NULL)
+    {
+      struct nsv_arena_table_t *last = other->tables;
+      while (last->next != NULL)
+        last = last->next;
+
+      if (arena->tables == NULL)
+        arena->tables = other->tables;
+      else
+        {
+          last->next = arena->tables->next;
+          arena->tables->next = other->tables;
+        }
+    }
+
+  if (other->slabs != NULL)
+    {
+      struct nsv_arena_slab_t *last = other->slabs;
+      while (last->next != NULL)
+        last = last->next;
+
+      if (arena->slabs == NULL)
+        arena->slabs = other->slabs;
+      else
+        {
+          last->next = arena->slabs->next;
+          arena->slabs->next = other->slabs;
+        }
+    }
+
+  free (other);
+}
+
+void
+nsv_arena_destroy (struct nsv_arena_t *arena)
+{
+  if (arena == NULL)
+    return;
+
+  while (arena->slabs != NULL)
+    {
+      struct nsv_arena_slab_t *next = arena->slabs->next;
+      free (arena->slabs);
+      arena->slabs = next;
+    }
+
+  while (arena->tables != NULL)
+    {
+      struct nsv_arena_table_t *next = arena->tables->next;
+      free (arena->tables);
+      arena->tables = next;
+    }
+
+  while (arena->chunks != NULL)
+    {
+      struct nsv_arena_chunk_t *next = arena->chunks->next;
+      nsv_chunk_unref (arena->chunks->chunk);
+      free (arena->chunks);
+      arena->chunks = next;
+    }
+
+  free (arena);
+}
@@ -0,0 +1,694 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bam.h"
+#include "bgzf.h"
+#include "segment.h"
+#include "cigar.h"
+#include "nanosvc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+/* The fixed-size part of an alignment record, see section 4.2 of the
+ * SAMv1 specification. */
+#define BAM_CORE_LEN 32
+
+static const char bam_nucleotides[] = "=ACMGRSVTWYHKDBN";
+
+static inline int32_t
+read_int32 (const uint8_t *buffer)
+{
+  return (int32_t)((uint32_t)buffer[0]
+                   | ((uint32_t)buffer[1] << 8)
+                   | ((uint32_t)buffer[2] << 16)
+                   | ((uint32_t)buffer[3] << 24));
+}
+
+static inline uint16_t
+read_uint16 (const uint8_t *buffer)
+{
+  return buffer[0] | (buffer[1] << 8);
+}
+
+/* Reads a little-endian int32_t.  Running out of input before the first
+ * byte is the end of the file; running out halfway is an error. */
+static bool
+nsv_bam_read_int32 (struct nsv_bam_t *bam, int32_t *value)
+{
+  uint8_t buffer[4];
+  size_t bytes = nsv_bgzf_read (bam->bgzf, buffer, 4);
+  if (bytes != 4)
+    {
+      if (bytes > 0 || bam->bgzf->error)
+        bam->error = true;
+
+      return false;
+    }
+
+  *value = read_int32 (buffer);
+  return true;
+}
+
+static bool
+nsv_bam_read_header (struct nsv_bam_t *bam)
+{
+  char magic[4];
+  if (nsv_bgzf_read (bam->bgzf, magic, 4) != 4
+      || memcmp (magic, "BAM\1", 4))
+    return false;
+
+  /* The plain-text header is repeated in binary form below, so we can
+   * skip over it. */
+  int32_t text_len;
+  if (!nsv_bam_read_int32 (bam, &text_len) || text_len < 0)
+    return false;
+
+  char skip_buffer[4096];
+  while (text_len > 0)
+    {
+      size_t bytes = (text_len < 4096) ? (size_t)text_len : 4096;
+      if (nsv_bgzf_read (bam->bgzf, skip_buffer, bytes) != bytes)
+        return false;
+
+      text_len -= bytes;
+    }
+
+  int32_t references_len;
+  if (!nsv_bam_read_int32 (bam, &references_len) || references_len < 0)
+    return false;
+
+  bam->reference_ids = calloc (references_len + 1, sizeof (int32_t));
+  if (bam->reference_ids == NULL)
+    return false;
+
+  int32_t index;
+  for (index = 0; index < references_len; index++)
+    {
+      int32_t name_len, reference_len;
+      if (!nsv_bam_read_int32 (bam, &name_len) || name_len < 1)
+        return false;
+
+      char *name = malloc (name_len);
+      if (name == NULL)
+        return false;
+
+      if (nsv_bgzf_read (bam->bgzf, name, name_len) != (size_t)name_len
+          || !nsv_bam_read_int32 (bam, &reference_len))
+        {
+          free (name);
+          return false;
+        }
+
+      /* The dictionary may already hold references from another input,
+       * so the reference IDs of this file are translated. */
+      name[name_len - 1] = '\0';
+      bam->reference_ids[index] = nsv_contigs_add (bam->contigs, name,
+                                                   reference_len);
+      free (name);
+
+      if (bam->reference_ids[index] < 0)
+        return false;
+
+      bam->references_len++;
+    }
+
+  return true;
+}
+
+struct nsv_bam_t *
+nsv_bam_open (const char *filename, struct nsv_contigs_t *contigs,
+              uint16_t threads)
+{
+  if (filename == NULL || contigs == NULL)
+    return NULL;
+
+  struct nsv_bam_t *bam = calloc (1, sizeof (struct nsv_bam_t));
+  if (bam == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  bam->contigs = contigs;
+  bam->stream = fopen (filename, "rb");
+  if (bam->stream == NULL)
+    {
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "Could not open the BAM file.");
+      nsv_bam_close (bam);
+      return NULL;
+    }
+
+  bam->bgzf = nsv_bgzf_new (bam->stream, threads);
+  if (bam->bgzf == NULL)
+    {
+      nsv_bam_close (bam);
+      return NULL;
+    }
+
+  if (!nsv_bam_read_header (bam))
+    {
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "Could not read the header of '%s'.", filename);
+      nsv_bam_close (bam);
+      return NULL;
+    }
+
+  /* Names in SA tags are looked up on the worker threads without locking
+   * the references of the header. */
+  nsv_contigs_seal (contigs);
+  return bam;
+}
+
+/* Returns a pointer to the value of the optional field 'tag' or NULL when
+ * the record does not have that field. */
+static const uint8_t *
+nsv_bam_aux_find (const uint8_t *aux, const uint8_t *end, const char *tag)
+{
+  while (aux + 3 <= end)
+    {
+      const uint8_t *value = aux + 3;
+      if (aux[0] == tag[0] && aux[1] == tag[1])
+        return aux + 2;
+
+      switch (aux[2])
+        {
+        case 'A': case 'c': case 'C': aux = value + 1; break;
+        case 's': case 'S':           aux = value + 2; break;
+        case 'i': case 'I': case 'f': aux = value + 4; break;
+        case 'Z': case 'H':
+          while (value < end && *value != '\0')
+            value++;
+          aux = value + 1;
+          break;
+        case 'B':
+          {
+            if (value + 5 > end)
+              return NULL;
+
+            uint32_t element_size;
+            switch (value[0])
+              {
+              case 'c': case 'C': element_size = 1; break;
+              case 's': case 'S': element_size = 2; break;
+              default:            element_size = 4; break;
+              }
+            aux = value + 5 + element_size * (uint32_t)read_int32 (value + 1);
+          }
+          break;
+        default:
+          return NULL;
+        }
+    }
+
+  return NULL;
+}
+
+/* Returns the integer value of the optional field at 'tag', as returned by
+ * nsv_bam_aux_find, or -1 when it does not hold an integer. */
+static int64_t
+nsv_bam_aux_integer (const uint8_t *tag, const uint8_t *end)
+{
+  const uint8_t *value = tag + 1;
+  switch (tag[0])
+    {
+    case 'c': return (value + 1 <= end) ? (int8_t)value[0] : -1;
+    case 'C': return (value + 1 <= end) ? value[0] : -1;
+    case 's': return (value + 2 <= end) ? (int16_t)read_uint16 (value) : -1;
+    case 'S': return (value + 2 <= end) ? read_uint16 (value) : -1;
+    case 'i': return (value + 4 <= end) ? read_int32 (value) : -1;
+    case 'I': return (value + 4 <= end)
+                ? (int64_t)(uint32_t)read_int32 (value)
+                : -1;
+    default:  return -1;
+    }
+}
+
+/* Returns a copy of the CIGAR operations, allocated from 'arena'.  The
+ * record stores them in the same packed form, only little-endian and
+ * possibly unaligned.  The overview of the operations is stored in
+ * 'overview'.  NULL is returned on an allocation failure, and when an
+ * operation is not valid, in which case 'malformed' is set. */
+static uint32_t *
+nsv_bam_cigar (const uint8_t *cigar, uint32_t cigar_len,
+               struct nsv_arena_t *arena,
+               struct nsv_segment_cigar_overview_t *overview,
+               bool *malformed)
+{
+  *malformed = false;
+
+  /* malloc (0) may return NULL, so an empty CIGAR gets one element. */
+  size_t size = ((cigar_len > 0) ? cigar_len : 1) * sizeof (uint32_t);
+  uint32_t *operations = nsv_arena_alloc (arena, size);
+  if (operations == NULL)
+    return NULL;
+
+  uint32_t index;
+  for (index = 0; index < cigar_len; index++)
+    {
+      operations[index] = (uint32_t)read_int32 (cigar + index * 4);
+      if (nsv_cigar_operation (operations[index]) > NSV_CIGAR_DIFF)
+        {
+          if (arena == NULL)
+            free (operations);
+          *malformed = true;
+          return NULL;
+        }
+    }
+
+  nsv_cigar_overview (operations, cigar_len, overview);
+  return operations;
+}
+
+struct nsv_segment_t *
+nsv_bam_decode_record (struct nsv_bam_t *bam, const uint8_t *record,
+                       uint32_t record_len, struct nsv_arena_t *arena,
+                       uint32_t columns, const char **qname_ptr)
+{
+  if (bam == NULL || record == NULL || qname_ptr == NULL)
+    return NULL;
+
+  if (record_len < BAM_CORE_LEN)
+    goto format_error;
+
+  int32_t reference_id = read_int32 (record);
+  int32_t pos          = read_int32 (record + 4);
+  uint8_t qname_len    = record[8];
+  uint8_t mapq         = record[9];
+  uint32_t cigar_len   = read_uint16 (record + 12);
+  uint16_t flag        = read_uint16 (record + 14);
+  int32_t seq_len      = read_int32 (record + 16);
+  int32_t next_id      = read_int32 (record + 20);
+  int32_t next_pos     = read_int32 (record + 24);
+  int32_t tlen         = read_int32 (record + 28);
+
+  const uint8_t *end = record + record_len;
+  const uint8_t *qname = record + BAM_CORE_LEN;
+  const uint8_t *cigar = qname + qname_len;
+  const uint8_t *seq = cigar + cigar_len * 4;
+  const uint8_t *qual = seq + (seq_len + 1) / 2;
+  const uint8_t *aux = qual + seq_len;
+
+  if (seq_len < 0 || aux > end || qname_len == 0
+      || qname[qname_len - 1] != '\0'
+      || reference_id >= bam->references_len
+      || next_id >= bam->references_len)
+    goto format_error;
+
+  /* CIGARs with more than 65535 operations are stored in the CG tag.  The
+   * CIGAR field then holds a placeholder of the form <l_seq>S<length>N. */
+  if (cigar_len == 2
+      && (uint32_t)read_int32 (cigar) == ((uint32_t)seq_len << 4 | 4)
+      && (read_int32 (cigar + 4) & 0xf) == 3)
+    {
+      const uint8_t *tag = nsv_bam_aux_find (aux, end, "CG");
+      if (tag != NULL && tag[0] == 'B' && tag[1] == 'I' && tag + 6 <= end)
+        {
+          uint32_t length = (uint32_t)read_int32 (tag + 2);
+          if (tag + 6 + (size_t)length * 4 <= end)
+            {
+              cigar = tag + 6;
+              cigar_len = length;
+            }
+        }
+    }
+
+  struct nsv_segment_t *segment = nsv_segment_new_in_arena (arena);
+  if (segment == NULL)
+    return NULL;
+
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+  struct nsv_segment_cigar_overview_t overview;
+
+  segment->flag = flag;
+  segment->pos = pos + 1;
+  segment->mapq = mapq;
+  cold->pnext = next_pos + 1;
+  cold->tlen = tlen;
+  segment->seq_len = seq_len;
+
+  segment->rname_id = (reference_id < 0)
+                      ? -1
+                      : bam->reference_ids[reference_id];
+  cold->rnext_id = (next_id < 0) ? -1 : bam->reference_ids[next_id];
+
+  bool malformed;
+  cold->cigar = nsv_bam_cigar (cigar, cigar_len, arena, &overview,
+                               &malformed);
+  cold->cigar_len = cigar_len;
+  if (malformed)
+    {
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "The BAM record '%s' has an invalid CIGAR "
+                        "operation.", (const char *)qname);
+      nsv_segment_destroy (segment);
+      return NULL;
+    }
+
+  if (columns & NSV_COLUMN_SEQ)
+    {
+      cold->seq = (seq_len == 0)
+                  ? nsv_arena_strndup (arena, "*", 1)
+                  : nsv_arena_alloc (arena, seq_len + 1);
+      if (cold->seq != NULL && seq_len > 0)
+        {
+          /* Bases are packed as two 4-bit codes per byte, high nybble
+           * first. */
+          int32_t index;
+          for (index = 0; index < seq_len; index++)
+            {
+              uint8_t code = seq[index / 2] >> ((~index & 1) << 2);
+              cold->seq[index] = bam_nucleotides[code & 0xf];
+            }
+
+          cold->seq[seq_len] = '\0';
+        }
+    }
+
+  if (columns & NSV_COLUMN_QUAL)
+    {
+      /* Missing qualities are stored as a run of 0xff. */
+      if (seq_len == 0 || qual[0] == 0xff)
+        cold->qual = nsv_arena_strndup (arena, "*", 1);
+      else if ((cold->qual = nsv_arena_alloc (arena, seq_len + 1)) != NULL)
+        {
+          int32_t index;
+          for (index = 0; index < seq_len; index++)
+            cold->qual[index] = qual[index] + 33;
+
+          cold->qual[seq_len] = '\0';
+        }
+    }
+
+  if (columns & NSV_COLUMN_TAGS)
+    {
+      const uint8_t *tag = nsv_bam_aux_find (aux, end, "NM");
+      if (tag != NULL)
+        cold->nm = nsv_bam_aux_integer (tag, end);
+
+      /* Z values are null-terminated, unless the record is truncated. */
+      const uint8_t *terminator;
+      tag = nsv_bam_aux_find (aux, end, "MD");
+      if (tag != NULL && tag[0] == 'Z'
+          && (terminator = memchr (tag + 1, '\0', end - tag - 1)) != NULL)
+        cold->md_mismatches = nsv_segment_md_mismatches ((const char *)tag + 1,
+                                                         terminator - tag - 1);
+
+      tag = nsv_bam_aux_find (aux, end, "SA");
+      if (tag != NULL && tag[0] == 'Z'
+          && memchr (tag + 1, '\0', end - tag - 1) != NULL)
+        {
+          cold->sa = nsv_arena_strndup (arena, (const char *)tag + 1,
+                                        strlen ((const char *)tag + 1));
+          if (cold->sa == NULL)
+            {
+              infra_logger_error_alloc (nsv_config.logger);
+              nsv_segment_destroy (segment);
+              return NULL;
+            }
+        }
+    }
+
+  if (cold->cigar == NULL
+      || ((columns & NSV_COLUMN_SEQ) && cold->seq == NULL)
+      || ((columns & NSV_COLUMN_QUAL) && cold->qual == NULL))
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      nsv_segment_destroy (segment);
+      return NULL;
+    }
+
+  /* The qname is null-terminated in the record itself. */
+  *qname_ptr = (const char *)qname;
+
+  /* Records without a stored sequence have an l_seq of zero, in which case
+   * the CIGAR tells how long the sequence is. */
+  nsv_segment_set_overview (segment, &overview);
+
+  return segment;
+
+ format_error:
+  infra_logger_log (nsv_config.logger, LOG_ERROR,
+                    "Encountered a malformed BAM record.");
+  return NULL;
+}
+
+bool
+nsv_bam_filter_record (const struct nsv_segment_filter_t *filter,
+                       const uint8_t *record, uint32_t record_len)
+{
+  if (record_len < BAM_CORE_LEN)
+    return false;
+
+  uint8_t qname_len  = record[8];
+  uint8_t mapq       = record[9];
+  uint32_t cigar_len = read_uint16 (record + 12);
+  uint16_t flag      = read_uint16 (record + 14);
+  if (nsv_segment_filter_fields (filter, flag, mapq))
+    return true;
+
+  const uint8_t *cigar = record + BAM_CORE_LEN + qname_len;
+  if (qname_len == 0 || cigar + cigar_len * 4 > record + record_len)
+    return false;
+
+  if (filter->members != NULL
+      && !nsv_qnames_bloom_find (filter->members,
+                                 nsv_qnames_hash ((const char *)record
+                                                  + BAM_CORE_LEN,
+                                                  qname_len - 1)))
+    return true;
+
+  if (!filter->require_clip)
+    return false;
+
+  /* The placeholder for a CIGAR in the CG tag starts with a soft clip, so
+   * such records are never rejected here. */
+  uint32_t index;
+  for (index = 0; index < cigar_len; index++)
+    {
+      uint8_t operation = cigar[index * 4] & 0xf;
+      if (operation == NSV_CIGAR_SOFT_CLIP || operation == NSV_CIGAR_HARD_CLIP)
+        return false;
+    }
+
+  return true;
+}
+
+bool
+nsv_bam_record_is_split (const uint8_t *record, uint32_t record_len,
+                         const char **qname_ptr, size_t *qname_len)
+{
+  *qname_ptr = (const char *)record + BAM_CORE_LEN;
+  *qname_len = 0;
+  if (record_len < BAM_CORE_LEN || record[8] == 0
+      || BAM_CORE_LEN + (uint32_t)record[8] > record_len)
+    return false;
+
+  *qname_len = record[8] - 1;
+  uint16_t flag = read_uint16 (record + 14);
+  if (flag & (0x1 | 0x100 | 0x800))
+    return true;
+
+  uint32_t cigar_len = read_uint16 (record + 12);
+  int32_t seq_len = read_int32 (record + 16);
+  if (seq_len < 0)
+    return false;
+
+  const uint8_t *end = record + record_len;
+  const uint8_t *aux = record + BAM_CORE_LEN + record[8] + cigar_len * 4
+                       + (seq_len + 1) / 2 + seq_len;
+  if (aux > end)
+    return false;
+
+  const uint8_t *tag = nsv_bam_aux_find (aux, end, "SA");
+  return (tag != NULL && tag[0] == 'Z');
+}
+
+struct nsv_segment_t *
+nsv_bam_read_segment (struct nsv_bam_t *bam, struct nsv_arena_t *arena,
+                      uint32_t columns, struct nsv_segment_filter_t *filter,
+                      const char **qname_ptr)
+{
+  if (bam == NULL || qname_ptr == NULL)
+    return NULL;
+
+  int32_t record_len;
+  bool rejected;
+  do
+    {
+      if (!nsv_bam_read_int32 (bam, &record_len))
+        return NULL;
+
+      if (record_len < BAM_CORE_LEN)
+        goto format_error;
+
+      if ((uint32_t)record_len > bam->record_capacity)
+        {
+          uint8_t *record = realloc (bam->record, record_len);
+          if (record == NULL)
+            {
+              infra_logger_error_alloc (nsv_config.logger);
+              bam->error = true;
+              return NULL;
+            }
+
+          bam->record = record;
+          bam->record_capacity = record_len;
+        }
+
+      if (nsv_bgzf_read (bam->bgzf, bam->record, record_len)
+          != (size_t)record_len)
+        goto format_error;
+
+      /* Rejected records are skipped before a segment is made. */
+      rejected = (filter != NULL
+                  && nsv_bam_filter_record (filter, bam->record, record_len));
+      if (rejected)
+        filter->rejected_count++;
+    }
+  while (rejected);
+
+  struct nsv_segment_t *segment;
+  segment = nsv_bam_decode_record (bam, bam->record, record_len, arena,
+                                   columns, qname_ptr);
+  if (segment == NULL)
+    bam->error = true;
+
+  return segment;
+
+ format_error:
+  infra_logger_log (nsv_config.logger, LOG_ERROR,
+                    "Encountered a malformed BAM record.");
+  bam->error = true;
+  return NULL;
+}
+
+struct nsv_chunk_t *
+nsv_bam_read_records (struct nsv_bam_t *bam, size_t *length_ptr)
+{
+  if (bam == NULL || length_ptr == NULL)
+    return NULL;
+
+  struct nsv_chunk_t *chunk = nsv_chunk_new (NSV_STREAM_BUFFER_SIZE);
+  if (chunk == NULL)
+    return NULL;
+
+  size_t length = 0;
+  while (true)
+    {
+      /* The length of a record that did not fit in the previous chunk has
+       * already been read. */
+      int32_t record_len = bam->pending_len;
+      bam->pending_len = 0;
+
+      if (record_len == 0 && !nsv_bam_read_int32 (bam, &record_len))
+        break;
+
+      if (record_len < BAM_CORE_LEN)
+        goto format_error;
+
+      size_t needed = sizeof (int32_t) + record_len;
+      if (length + needed > chunk->capacity)
+        {
+          if (length > 0)
+            {
+              bam->pending_len = record_len;
+              break;
+            }
+
+          /* A single record can be larger than a chunk.  Nobody else
+           * references this chunk yet, so it can be resized. */
+          struct nsv_chunk_t *larger = realloc (chunk, sizeof (*chunk)
+                                                       + needed + 1);
+          if (larger == NULL)
+            {
+              infra_logger_error_alloc (nsv_config.logger);
+              nsv_chunk_unref (chunk);
+              bam->error = true;
+              return NULL;
+            }
+
+          chunk = larger;
+          chunk->capacity = needed;
+        }
+
+      memcpy (chunk->data + length, &record_len, sizeof (int32_t));
+      if (nsv_bgzf_read (bam->bgzf, chunk->data + length + sizeof (int32_t),
+                         record_len) != (size_t)record_len)
+        goto format_error;
+
+      length += needed;
+    }
+
+  if (length == 0)
+    {
+      nsv_chunk_unref (chunk);
+      return NULL;
+    }
+
+  *length_ptr = length;
+  return chunk;
+
+ format_error:
+  infra_logger_log (nsv_config.logger, LOG_ERROR,
+                    "Encountered a malformed BAM record.");
+  nsv_chunk_unref (chunk);
+  bam->error = true;
+  return NULL;
+}
+
+uint64_t
+nsv_bam_tell (struct nsv_bam_t *bam)
+{
+  if (bam == NULL)
+    return 0;
+
+  return nsv_bgzf_tell (bam->bgzf);
+}
+
+bool
+nsv_bam_seek (struct nsv_bam_t *bam, uint64_t offset)
+{
+  if (bam == NULL)
+    return false;
+
+  /* A record length that was read ahead belongs to the old position. */
+  bam->pending_len = 0;
+  bam->error = false;
+  return nsv_bgzf_seek (bam->bgzf, offset);
+}
+
+void
+nsv_bam_close (struct nsv_bam_t *bam)
+{
+  if (bam == NULL)
+    return;
+
+  nsv_bgzf_destroy (bam->bgzf);
+
+  if (bam->stream != NULL)
+    fclose (bam->stream);
+
+  free (bam->reference_ids);
+  free (bam->record);
+  free (bam);
+}
@@ -0,0 +1,451 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bgzf.h"
+#include "nanosvc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <glib.h>
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+/* The fixed part of a BGZF block header is 12 bytes, followed by XLEN bytes
+ * of extra subfields.  The block ends with a CRC32 and the inflated size. */
+#define BGZF_HEADER_LEN 12
+#define BGZF_FOOTER_LEN 8
+
+static inline uint16_t
+read_uint16 (const uint8_t *buffer)
+{
+  return buffer[0] | (buffer[1] << 8);
+}
+
+static inline uint32_t
+read_uint32 (const uint8_t *buffer)
+{
+  return (uint32_t)buffer[0]
+    | ((uint32_t)buffer[1] << 8)
+    | ((uint32_t)buffer[2] << 16)
+    | ((uint32_t)buffer[3] << 24);
+}
+
+static bool
+nsv_bgzf_inflate_block (struct nsv_bgzf_block_t *block)
+{
+  block->data_len = 0;
+  block->failed = true;
+
+  uint16_t xlen = read_uint16 (block->compressed + 10);
+  uint32_t offset = BGZF_HEADER_LEN + xlen;
+  if (block->compressed_len < offset + BGZF_FOOTER_LEN)
+    return false;
+
+  uint32_t input_len = block->compressed_len - offset - BGZF_FOOTER_LEN;
+  const uint8_t *footer = block->compressed + offset + input_len;
+
+  z_stream zs;
+  memset (&zs, 0, sizeof (z_stream));
+  zs.next_in = block->compressed + offset;
+  zs.avail_in = input_len;
+  zs.next_out = block->data;
+  zs.avail_out = NSV_BGZF_MAX_BLOCK_SIZE;
+
+  /* A negative window size means raw deflate data without a zlib header. */
+  if (inflateInit2 (&zs, -15) != Z_OK)
+    return false;
+
+  int status = inflate (&zs, Z_FINISH);
+  inflateEnd (&zs);
+
+  if (status != Z_STREAM_END)
+    return false;
+
+  block->data_len = zs.total_out;
+  if (block->data_len != read_uint32 (footer + 4)
+      || crc32 (crc32 (0L, Z_NULL, 0), block->data, block->data_len)
+         != read_uint32 (footer))
+    return false;
+
+  block->failed = false;
+  return true;
+}
+
+static void
+nsv_bgzf_inflate_job (void *block_ptr, void *bgzf_ptr)
+{
+  struct nsv_bgzf_block_t *block = block_ptr;
+  struct nsv_bgzf_t *bgzf = bgzf_ptr;
+
+  nsv_bgzf_inflate_block (block);
+
+  /* Find out which batch the block belongs to. */
+  struct nsv_bgzf_batch_t *batch = &(bgzf->batches[0]);
+  if (block < batch->blocks || block >= batch->blocks + bgzf->batch_capacity)
+    batch = &(bgzf->batches[1]);
+
+  g_mutex_lock (&(bgzf->mutex));
+  batch->pending--;
+  if (batch->pending == 0)
+    g_cond_broadcast (&(bgzf->condition));
+  g_mutex_unlock (&(bgzf->mutex));
+}
+
+static bool
+nsv_bgzf_read_block (struct nsv_bgzf_t *bgzf, struct nsv_bgzf_block_t *block)
+{
+  uint8_t *header = block->compressed;
+  block->offset = bgzf->end_offset;
+  size_t bytes = fread (header, 1, BGZF_HEADER_LEN + 6, bgzf->stream);
+  if (bytes == 0 && ferror (bgzf->stream))
+    goto format_error;
+
+  if (bytes == 0)
+    {
+      bgzf->eof = true;
+      return false;
+    }
+
+  if (bytes < BGZF_HEADER_LEN + 6
+      || header[0] != 31 || header[1] != 139 || header[2] != 8
+      || !(header[3] & 4))
+    goto format_error;
+
+  /* The extra subfields hold the total block size in the 'BC' subfield.
+   * Usually this is the only subfield, but we must not assume so. */
+  uint16_t xlen = read_uint16 (header + 10);
+  if (xlen < 6)
+    goto format_error;
+
+  if (xlen > 6
+      && fread (header + BGZF_HEADER_LEN + 6, 1, xlen - 6, bgzf->stream)
+         != (size_t)(xlen - 6))
+    goto format_error;
+
+  uint32_t block_size = 0;
+  uint16_t position = 0;
+  while (position + 4 <= xlen)
+    {
+      const uint8_t *subfield = header + BGZF_HEADER_LEN + position;
+      uint16_t subfield_len = read_uint16 (subfield + 2);
+      if (subfield[0] == 'B' && subfield[1] == 'C' && subfield_len == 2)
+        {
+          block_size = read_uint16 (subfield + 4) + 1;
+          break;
+        }
+
+      position += 4 + subfield_len;
+    }
+
+  uint32_t header_len = BGZF_HEADER_LEN + xlen;
+  if (block_size < header_len + BGZF_FOOTER_LEN
+      || block_size > NSV_BGZF_MAX_BLOCK_SIZE)
+    goto format_error;
+
+  if (fread (header + header_len, 1, block_size - header_len, bgzf->stream)
+      != block_size - header_len)
+    goto format_error;
+
+  block->compressed_len = block_size;
+  bgzf->end_offset += block_size;
+  return true;
+
+ format_error:
+  /* Blocks are read ahead of the consumer, so the error is only reported
+   * once the blocks before this one have been consumed. */
+  bgzf->read_error = true;
+  return false;
+}
+
+/* Reports the error of a block that could not be read, once the consumer
+ * has reached it. */
+static void
+nsv_bgzf_report_read_error (struct nsv_bgzf_t *bgzf)
+{
+  infra_logger_log (nsv_config.logger, LOG_ERROR,
+                    "The input is not a valid BGZF stream, or could not "
+                    "be read.");
+  bgzf->error = true;
+}
+
+static void
+nsv_bgzf_fill_batch (struct nsv_bgzf_t *bgzf, struct nsv_bgzf_batch_t *batch)
+{
+  batch->blocks_len = 0;
+  while (batch->blocks_len < bgzf->batch_capacity
+         && !bgzf->eof && !bgzf->read_error)
+    {
+      struct nsv_bgzf_block_t *block = &(batch->blocks[batch->blocks_len]);
+      if (!nsv_bgzf_read_block (bgzf, block))
+        break;
+
+      batch->blocks_len++;
+    }
+
+  if (bgzf->pool == NULL)
+    {
+      uint32_t index;
+      for (index = 0; index < batch->blocks_len; index++)
+        nsv_bgzf_inflate_block (&(batch->blocks[index]));
+
+      batch->pending = 0;
+      return;
+    }
+
+  /* The counter must be complete before the first job can finish. */
+  g_mutex_lock (&(bgzf->mutex));
+  batch->pending = batch->blocks_len;
+  g_mutex_unlock (&(bgzf->mutex));
+
+  uint32_t index;
+  for (index = 0; index < batch->blocks_len; index++)
+    g_thread_pool_push (bgzf->pool, &(batch->blocks[index]), NULL);
+}
+
+static void
+nsv_bgzf_wait_batch (struct nsv_bgzf_t *bgzf, struct nsv_bgzf_batch_t *batch)
+{
+  if (bgzf->pool == NULL)
+    return;
+
+  g_mutex_lock (&(bgzf->mutex));
+  while (batch->pending > 0)
+    g_cond_wait (&(bgzf->condition), &(bgzf->mutex));
+  g_mutex_unlock (&(bgzf->mutex));
+}
+
+struct nsv_bgzf_t *
+nsv_bgzf_new (FILE *stream, uint16_t threads)
+{
+  if (stream == NULL)
+    return NULL;
+
+  struct nsv_bgzf_t *bgzf = calloc (1, sizeof (struct nsv_bgzf_t));
+  if (bgzf == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  bgzf->stream = stream;
+  bgzf->threads = (threads > 0) ? threads : 1;
+  bgzf->batch_capacity = bgzf->threads * NSV_BGZF_BLOCKS_PER_THREAD;
+
+  g_mutex_init (&(bgzf->mutex));
+  g_cond_init (&(bgzf->condition));
+
+  uint8_t index;
+  for (index = 0; index < 2; index++)
+    {
+      bgzf->batches[index].blocks = calloc (bgzf->batch_capacity,
+                                            sizeof (struct nsv_bgzf_block_t));
+      if (bgzf->batches[index].blocks == NULL)
+        goto allocation_error_handler;
+    }
+
+  /* With a single thread, blocks are inflated on the calling thread. */
+  if (bgzf->threads > 1)
+    {
+      bgzf->pool = g_thread_pool_new (nsv_bgzf_inflate_job, bgzf,
+                                      bgzf->threads, TRUE, NULL);
+      if (bgzf->pool == NULL)
+        goto allocation_error_handler;
+    }
+
+  /* Start inflating both batches, so that the second one is being worked
+   * on while the first one is consumed. */
+  nsv_bgzf_fill_batch (bgzf, &(bgzf->batches[0]));
+  nsv_bgzf_fill_batch (bgzf, &(bgzf->batches[1]));
+  nsv_bgzf_wait_batch (bgzf, &(bgzf->batches[0]));
+
+  return bgzf;
+
+ allocation_error_handler:
+  infra_logger_error_alloc (nsv_config.logger);
+  nsv_bgzf_destroy (bgzf);
+  return NULL;
+}
+
+size_t
+nsv_bgzf_read (struct nsv_bgzf_t *bgzf, void *buffer, size_t length)
+{
+  if (bgzf == NULL || buffer == NULL)
+    return 0;
+
+  uint8_t *output = buffer;
+  size_t copied = 0;
+  while (copied < length && !bgzf->error)
+    {
+      struct nsv_bgzf_batch_t *batch = &(bgzf->batches[bgzf->current]);
+      if (bgzf->block_index >= batch->blocks_len)
+        {
+          /* An empty batch means there is nothing left to read, either
+           * because the stream has ended or because the next block is
+           * malformed. */
+          if (batch->blocks_len == 0)
+            {
+              if (bgzf->read_error)
+                nsv_bgzf_report_read_error (bgzf);
+
+              break;
+            }
+
+          /* Refill the consumed batch with the blocks that follow the other
+           * batch, and continue with the other batch. */
+          nsv_bgzf_fill_batch (bgzf, batch);
+          bgzf->current ^= 1;
+          bgzf->block_index = 0;
+          bgzf->block_pos = 0;
+          nsv_bgzf_wait_batch (bgzf, &(bgzf->batches[bgzf->current]));
+          continue;
+        }
+
+      struct nsv_bgzf_block_t *block = &(batch->blocks[bgzf->block_index]);
+      if (block->failed)
+        {
+          infra_logger_log (nsv_config.logger, LOG_ERROR,
+                            "Could not inflate a BGZF block.");
+          bgzf->error = true;
+          break;
+        }
+
+      size_t available = block->data_len - bgzf->block_pos;
+      size_t bytes = (length - copied < available)
+                     ? length - copied
+                     : available;
+
+      memcpy (output + copied, block->data + bgzf->block_pos, bytes);
+      copied += bytes;
+      bgzf->block_pos += bytes;
+
+      if (bgzf->block_pos == block->data_len)
+        {
+          bgzf->block_index++;
+          bgzf->block_pos = 0;
+        }
+    }
+
+  return copied;
+}
+
+uint64_t
+nsv_bgzf_tell (struct nsv_bgzf_t *bgzf)
+{
+  if (bgzf == NULL)
+    return 0;
+
+  /* When the current batch has been consumed, the next byte is at the
+   * start of the other batch, or at the end of the file. */
+  struct nsv_bgzf_batch_t *batch = &(bgzf->batches[bgzf->current]);
+  if (bgzf->block_index < batch->blocks_len)
+    return (batch->blocks[bgzf->block_index].offset << 16) | bgzf->block_pos;
+
+  batch = &(bgzf->batches[bgzf->current ^ 1]);
+  if (batch->blocks_len > 0)
+    return batch->blocks[0].offset << 16;
+
+  return bgzf->end_offset << 16;
+}
+
+bool
+nsv_bgzf_seek (struct nsv_bgzf_t *bgzf, uint64_t offset)
+{
+  if (bgzf == NULL)
+    return false;
+
+  uint64_t block_offset = offset >> 16;
+  uint32_t block_pos = offset & 0xffff;
+
+  /* Index chunks are often close together, so the target block may have
+   * been inflated already. */
+  struct nsv_bgzf_batch_t *batch = &(bgzf->batches[bgzf->current]);
+  uint32_t index;
+  for (index = bgzf->block_index; index < batch->blocks_len; index++)
+    if (batch->blocks[index].offset == block_offset)
+      {
+        if (batch->blocks[index].failed
+            || block_pos > batch->blocks[index].data_len)
+          break;
+
+        bgzf->block_index = index;
+        bgzf->block_pos = block_pos;
+        return true;
+      }
+
+  /* The workers must be done with both batches before they are refilled. */
+  nsv_bgzf_wait_batch (bgzf, &(bgzf->batches[0]));
+  nsv_bgzf_wait_batch (bgzf, &(bgzf->batches[1]));
+
+  if (fseeko (bgzf->stream, block_offset, SEEK_SET) != 0)
+    {
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "Could not seek in the BGZF stream.");
+      return false;
+    }
+
+  bgzf->end_offset = block_offset;
+  bgzf->eof = false;
+  bgzf->read_error = false;
+  bgzf->error = false;
+
+  nsv_bgzf_fill_batch (bgzf, &(bgzf->batches[0]));
+  nsv_bgzf_fill_batch (bgzf, &(bgzf->batches[1]));
+  nsv_bgzf_wait_batch (bgzf, &(bgzf->batches[0]));
+
+  bgzf->current = 0;
+  bgzf->block_index = 0;
+  bgzf->block_pos = block_pos;
+
+  batch = &(bgzf->batches[0]);
+  if (batch->blocks_len == 0 && bgzf->read_error)
+    {
+      nsv_bgzf_report_read_error (bgzf);
+      return false;
+    }
+
+  if (block_pos > 0
+      && (batch->blocks_len == 0 || block_pos > batch->blocks[0].data_len))
+    {
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "Invalid virtual file offset.");
+      return false;
+    }
+
+  return !bgzf->error;
+}
+
+void
+nsv_bgzf_destroy (struct nsv_bgzf_t *bgzf)
+{
+  if (bgzf == NULL)
+    return;
+
+  /* Let the workers finish the blocks they are working on, because they
+   * write into the batches we are about to free. */
+  if (bgzf->pool != NULL)
+    g_thread_pool_free (bgzf->pool, FALSE, TRUE);
+
+  free (bgzf->batches[0].blocks);
+  free (bgzf->batches[1].blocks);
+
+  g_mutex_clear (&(bgzf->mutex));
+  g_cond_clear (&(bgzf->condition));
+
+  free (bgzf);
+}
@@ -27,9 +27,15 @@ extern struct nsv_config_t nsv_config;
 
 struct nsv_breakpoint_t *
 nsv_breakpoint_new (void)
+{
+  return nsv_breakpoint_new_in_arena (NULL);
+}
+
+struct nsv_breakpoint_t *
+nsv_breakpoint_new_in_arena (struct nsv_arena_t *arena)
 {
   struct nsv_breakpoint_t *breakpoint;
-  breakpoint = calloc (1, sizeof (struct nsv_breakpoint_t));
+  breakpoint = nsv_arena_alloc0 (arena, sizeof (struct nsv_breakpoint_t));
   if (breakpoint == NULL)
     {
       infra_logger_error_alloc (nsv_config.logger);
@@ -37,27 +43,43 @@ nsv_breakpoint_new (void)
     }
 
   breakpoint->type = NSVC_OBJ_BREAKPOINT;
+  breakpoint->in_arena = (arena != NULL);
   return breakpoint;
 }
 
 struct nsv_breakpoint_t *
 nsv_breakpoint_new_with_segments (struct nsv_segment_t *first,
-                                  struct nsv_segment_t *second)
+                                  struct nsv_segment_t *second,
+                                  struct nsv_arena_t *arena)
 {
-  struct nsv_breakpoint_t *breakpoint = nsv_breakpoint_new ();
+  struct nsv_breakpoint_t *breakpoint = nsv_breakpoint_new_in_arena (arena);
   if (breakpoint == NULL)
     return NULL;
 
+  nsv_breakpoint_init (breakpoint, first, second);
+  return breakpoint;
+}
+
+void
+nsv_breakpoint_init (struct nsv_breakpoint_t *breakpoint,
+                     struct nsv_segment_t *first,
+                     struct nsv_segment_t *second)
+{
+  breakpoint->type = NSVC_OBJ_BREAKPOINT;
+  breakpoint->gap = 0;
+
   /* We don't check the validity of the arguments.  It is considered the
    * responsibility of the user to provide proper segment structs. */
   breakpoint->segments[0] = first;
   breakpoint->segments[1] = second;
+  breakpoint->orientation = ((first->flag & 0x10)
+                             ? NSV_BREAKPOINT_REVERSE_FIRST : 0)
+                            | ((second->flag & 0x10)
+                               ? NSV_BREAKPOINT_REVERSE_SECOND : 0);
 
   /* TODO: Not sure whether it's the right place to set the breakpoint
    * positions yet. */
   nsv_breakpoint_set_breakpoint (breakpoint);
-
-  return breakpoint;
 }
 
 void
@@ -72,56 +94,240 @@ nsv_breakpoint_destroy (void *breakpoint_obj)
       return;
     }
 
+  if (breakpoint->in_arena)
+    return;
+
   free (breakpoint);
 }
 
+/* The number of segments of a read that are ordered without allocating
+ * memory.  Reads with more segments than this are rare. */
+#define NSV_BREAKPOINT_INLINE_SEGMENTS 32
+
+/* Adds 'count' uninitialized breakpoints to the end of 'breakpoints', and
+ * returns the first of them.  The array owns them, so their 'in_arena'
+ * field is set, which makes nsv_breakpoint_destroy leave them alone. */
+static struct nsv_breakpoint_t *
+nsv_breakpoints_grow (GArray *breakpoints, uint32_t count)
+{
+  guint offset = breakpoints->len;
+  g_array_set_size (breakpoints, offset + count);
+
+  struct nsv_breakpoint_t *first;
+  first = &g_array_index (breakpoints, struct nsv_breakpoint_t, offset);
+
+  uint32_t index;
+  for (index = 0; index < count; index++)
+    first[index].in_arena = TRUE;
+
+  return first;
+}
+
 bool
-nsv_breakpoints_from_read (void *read_ptr, void **list_ptr)
+nsv_breakpoints_from_read (struct nsv_read_t *read_obj, GArray *breakpoints)
 {
-  if (read_ptr == NULL || list_ptr == NULL)
+  if (read_obj == NULL || breakpoints == NULL)
     return FALSE;
 
-  struct nsv_read_t *read_obj = read_ptr;
-  GList *list = *list_ptr;
+  uint32_t segments_len = 0;
+  GList *iterator;
+  for (iterator = read_obj->segments; iterator != NULL;
+       iterator = iterator->next)
+    segments_len++;
+
+  if (segments_len < 2 || segments_len >= nsv_config.max_split)
+    return TRUE;
 
-  uint32_t segments_len = g_list_length (read_obj->segments);
-  if (segments_len > 1 && segments_len < nsv_config.max_split)
+  struct nsv_segment_t *inline_segments[NSV_BREAKPOINT_INLINE_SEGMENTS];
+  struct nsv_segment_t **sorted = inline_segments;
+  if (segments_len > NSV_BREAKPOINT_INLINE_SEGMENTS)
     {
-      /* The segments must be sorted on their clip value for the next
-       * step to be meaningful. */
-      GList *segments = g_list_sort(read_obj->segments,
-                                    &nsv_segment_clip_compare);
+      sorted = malloc (segments_len * sizeof (struct nsv_segment_t *));
+      if (sorted == NULL)
+        {
+          infra_logger_error_alloc (nsv_config.logger);
+          return FALSE;
+        }
+    }
 
-      while (segments->next != NULL)
+  /* The segments must be sorted on their clip value for the next step to
+   * be meaningful.  A read has only a handful of segments, so an insertion
+   * sort on the cached clips is both the fastest and a stable choice.  The
+   * list of the read is left alone. */
+  uint32_t index = 0;
+  for (iterator = read_obj->segments; iterator != NULL;
+       iterator = iterator->next, index++)
+    {
+      struct nsv_segment_t *segment = iterator->data;
+      uint32_t position = index;
+      while (position > 0 && sorted[position - 1]->clip > segment->clip)
         {
-          struct nsv_segment_t *first = segments->data;
-          struct nsv_segment_t *second = segments->next->data;
-
-          int32_t clip_first = nsv_segment_cigar_first_clip (first);
-          int32_t clip_second = nsv_segment_cigar_first_clip (second);
-
-          /* When properly filtered in the BAM parsing step, we don't
-           * need to check this here anymore. */
-          /* if (clip_first == -1 || clip_second == -1) */
-          /*   { */
-          /*     segments = segments->next; */
-          /*     continue; */
-          /*   } */
-
-          struct nsv_breakpoint_t *breakpoint;
-          breakpoint = nsv_breakpoint_new_with_segments (first, second);
-          breakpoint->gap = clip_first - clip_second + first->seq_len;
-
-          /* Add the breakpoint to the lsit. */
-          list = g_list_prepend (list, breakpoint);
-          segments = segments->next;
+          sorted[position] = sorted[position - 1];
+          position--;
         }
+
+      sorted[position] = segment;
     }
 
-  *list_ptr = list;
+  struct nsv_breakpoint_t *breakpoint;
+  breakpoint = nsv_breakpoints_grow (breakpoints, segments_len - 1);
+  for (index = 0; index + 1 < segments_len; index++, breakpoint++)
+    {
+      struct nsv_segment_t *first = sorted[index];
+      struct nsv_segment_t *second = sorted[index + 1];
+
+      nsv_breakpoint_init (breakpoint, first, second);
+      breakpoint->gap = first->clip - second->clip + first->seq_len;
+    }
+
+  if (sorted != inline_segments)
+    free (sorted);
+
   return TRUE;
 }
 
+/* A slice is a range of reads in a segment table whose breakpoints are
+ * found by a single worker.  While the workers run, the segments are only
+ * read, so that they can be shared without locks. */
+struct nsv_breakpoints_slice_t
+{
+  struct nsv_segments_t *segments;
+  uint32_t first_read;          /* The first read of the slice. */
+  uint32_t last_read;           /* The read after the slice. */
+  GArray *breakpoints;          /* The breakpoints, in the order found. */
+};
+
+/* Does what nsv_breakpoint_init does for the segments in rows 'row' and
+ * 'row + 1' of a segment table, and sets the gap between them.  All values
+ * come from the columns of the table, so the segments are not read. */
+static void
+nsv_breakpoint_init_from_rows (struct nsv_breakpoint_t *breakpoint,
+                               struct nsv_segments_t *segments, uint32_t row)
+{
+  uint32_t next = row + 1;
+  bool reverse_first = (segments->flag[row] & 0x10);
+  bool reverse_second = (segments->flag[next] & 0x10);
+
+  breakpoint->type = NSVC_OBJ_BREAKPOINT;
+  breakpoint->segments[0] = segments->segments[row];
+  breakpoint->segments[1] = segments->segments[next];
+  breakpoint->orientation = ((reverse_first)
+                             ? NSV_BREAKPOINT_REVERSE_FIRST : 0)
+                            | ((reverse_second)
+                               ? NSV_BREAKPOINT_REVERSE_SECOND : 0);
+
+  /* On the reverse strand, the breakpoint is at the start. */
+  breakpoint->breakpoints[0] = (reverse_first)
+                               ? segments->pos[row]
+                               : segments->end[row];
+  breakpoint->breakpoints[1] = (reverse_second)
+                               ? segments->pos[next]
+                               : segments->end[next];
+
+  breakpoint->gap = segments->clip[row] - segments->clip[next]
+                    + segments->seq_len[row];
+}
+
+/* This function runs on a worker thread. */
+static void
+nsv_breakpoints_slice_job (gpointer data, gpointer user_data)
+{
+  (void) user_data;
+  struct nsv_breakpoints_slice_t *slice = data;
+  struct nsv_segments_t *segments = slice->segments;
+
+  uint32_t read_index;
+  for (read_index = slice->first_read; read_index < slice->last_read;
+       read_index++)
+    {
+      uint32_t first = segments->read_offsets[read_index];
+      uint32_t last = segments->read_offsets[read_index + 1];
+      if (last - first < 2 || last - first >= nsv_config.max_split)
+        continue;
+
+      struct nsv_breakpoint_t *breakpoint;
+      breakpoint = nsv_breakpoints_grow (slice->breakpoints, last - first - 1);
+
+      uint32_t row;
+      for (row = first; row + 1 < last; row++, breakpoint++)
+        nsv_breakpoint_init_from_rows (breakpoint, segments, row);
+    }
+}
+
+bool
+nsv_breakpoints_from_segments (struct nsv_segments_t *segments,
+                               GArray *breakpoints)
+{
+  if (segments == NULL || breakpoints == NULL)
+    return FALSE;
+
+  /* A few slices per thread even out reads with many segments. */
+  uint32_t slices_len = 1;
+  if (nsv_config.max_threads > 1 && segments->reads_len > 1)
+    slices_len = nsv_config.max_threads * 4;
+
+  if (slices_len > segments->reads_len)
+    slices_len = (segments->reads_len > 0) ? segments->reads_len : 1;
+
+  struct nsv_breakpoints_slice_t *slices;
+  slices = calloc (slices_len, sizeof (struct nsv_breakpoints_slice_t));
+  if (slices == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return FALSE;
+    }
+
+  uint32_t index;
+  for (index = 0; index < slices_len; index++)
+    {
+      struct nsv_breakpoints_slice_t *slice = &(slices[index]);
+      slice->segments = segments;
+      slice->first_read = (uint64_t)segments->reads_len * index / slices_len;
+      slice->last_read = (uint64_t)segments->reads_len * (index + 1)
+                         / slices_len;
+
+      /* A single slice fills the caller's array directly. */
+      slice->breakpoints = (slices_len == 1)
+        ? breakpoints
+        : g_array_new (FALSE, FALSE, sizeof (struct nsv_breakpoint_t));
+    }
+
+  bool success = TRUE;
+  if (slices_len == 1)
+    nsv_breakpoints_slice_job (&(slices[0]), NULL);
+  else
+    {
+      GThreadPool *pool;
+      pool = g_thread_pool_new (nsv_breakpoints_slice_job, NULL,
+                                nsv_config.max_threads, TRUE, NULL);
+      if (pool == NULL)
+        success = FALSE;
+      else
+        {
+          for (index = 0; index < slices_len; index++)
+            g_thread_pool_push (pool, &(slices[index]), NULL);
+
+          /* This waits for all slices to be done. */
+          g_thread_pool_free (pool, FALSE, TRUE);
+        }
+
+      /* The breakpoints are joined in the order of the slices, so that
+       * the array is the same for any number of threads. */
+      for (index = 0; index < slices_len; index++)
+        {
+          GArray *slice_breakpoints = slices[index].breakpoints;
+          if (success)
+            g_array_append_vals (breakpoints, slice_breakpoints->data,
+                                 slice_breakpoints->len);
+
+          g_array_free (slice_breakpoints, TRUE);
+        }
+    }
+
+  free (slices);
+  return success;
+}
+
 bool
 nsv_breakpoint_set_breakpoint (struct nsv_breakpoint_t *breakpoint)
 {
@@ -136,9 +342,15 @@ nsv_breakpoint_set_breakpoint (struct nsv_breakpoint_t *breakpoint)
   struct nsv_segment_t *first = breakpoint->segments[0];
   struct nsv_segment_t *second = breakpoint->segments[1];
 
-  /* When the 0x10 flag is set, it's a reverse complement. */
-  breakpoint->breakpoints[0] = (first->flag & 0x10) ? first->pos : first->end;
-  breakpoint->breakpoints[1] = (second->flag & 0x10) ? second->pos : second->end;
+  /* On the reverse strand, the breakpoint is at the start. */
+  breakpoint->breakpoints[0] =
+    (breakpoint->orientation & NSV_BREAKPOINT_REVERSE_FIRST)
+    ? first->pos
+    : first->end;
+  breakpoint->breakpoints[1] =
+    (breakpoint->orientation & NSV_BREAKPOINT_REVERSE_SECOND)
+    ? second->pos
+    : second->end;
 
   return TRUE;
 }
@@ -159,12 +371,17 @@ nsv_breakpoint_switch_segments (struct nsv_breakpoint_t *breakpoint)
   breakpoint->segments[0] = second;
   breakpoint->segments[1] = first;
 
-  /* Toggle the 0x10 flag.
-   * TODO: Figure out why. */
-  first->flag &= (first->flag & 0x10) ? 0x0 : 0x10;
-  second->flag &= (second->flag & 0x10) ? 0x0 : 0x10;
-
-  return TRUE;
+  /* Read from the other end, both segments are on the other strand.  This
+   * used to toggle the 0x10 flags of the segments, which other threads and
+   * other breakpoints of the same read may be looking at. */
+  uint8_t orientation = breakpoint->orientation;
+  breakpoint->orientation =
+    ((orientation & NSV_BREAKPOINT_REVERSE_SECOND)
+     ? 0 : NSV_BREAKPOINT_REVERSE_FIRST)
+    | ((orientation & NSV_BREAKPOINT_REVERSE_FIRST)
+       ? 0 : NSV_BREAKPOINT_REVERSE_SECOND);
+
+  return nsv_breakpoint_set_breakpoint (breakpoint);
 }
 
 void
@@ -179,9 +396,15 @@ nsv_breakpoint_destroy_full (void *breakpoint_obj)
       return;
     }
 
-  nsv_segment_destroy (breakpoint->segments[0]);
-  nsv_segment_destroy (breakpoint->segments[1]);
+  /* The segments are destroyed like the breakpoint itself: those in an
+   * arena are left to it. */
+  uint8_t index;
+  for (index = 0; index < 2; index++)
+    if (breakpoint->segments[index] != NULL)
+      nsv_segment_destroy (breakpoint->segments[index]);
+
+  if (breakpoint->in_arena)
+    return;
 
-  free (breakpoint->segments);
   free (breakpoint);
 }
@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "cigar.h"
+
+/* The vector kernels are compiled with function attributes, so that the
+ * rest of the program does not need any instruction set flags, and are
+ * only run after cpuid has told they are supported. */
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define NSV_CIGAR_X86 1
+#include <immintrin.h>
+#endif
+
+/* The number of operations in nsv_cigar_operation_e. */
+#define NSV_CIGAR_OPERATIONS 9
+
+static enum nsv_cigar_kernel_e nsv_cigar_selected = NSV_CIGAR_KERNEL_SCALAR;
+
+/* This is the reference implementation, which the other kernels must
+ * match bit for bit. */
+static void
+nsv_cigar_overview_scalar (const uint32_t *cigar, uint32_t cigar_len,
+                           struct nsv_segment_cigar_overview_t *overview)
+{
+  nsv_segment_cigar_init (overview);
+
+  uint32_t index;
+  for (index = 0; index < cigar_len; index++)
+    nsv_segment_cigar_add (overview, cigar[index]);
+}
+
+/* Adds the operations from 'index' up to 'cigar_len' to 'sums', and
+ * updates the index of the first and last clip.  The vector kernels use
+ * it for the elements that do not fill a vector. */
+static inline void
+nsv_cigar_sum_tail (const uint32_t *cigar, uint32_t index, uint32_t cigar_len,
+                    uint32_t *sums, int64_t *first, int64_t *last)
+{
+  for (; index < cigar_len; index++)
+    {
+      uint8_t operation = nsv_cigar_operation (cigar[index]);
+      sums[operation] += nsv_cigar_length (cigar[index]);
+      if (operation == NSV_CIGAR_SOFT_CLIP
+          || operation == NSV_CIGAR_HARD_CLIP)
+        {
+          if (*first == -1)
+            *first = index;
+
+          *last = index;
+        }
+    }
+}
+
+/* Fills 'overview' from the sums per operation and the index of the first
+ * and last clip, or -1.  Sums wrap around like the scalar counters do, so
+ * the order in which they were added up does not matter. */
+static void
+nsv_cigar_finish (const uint32_t *cigar, const uint32_t *sums, int64_t first,
+                  int64_t last, struct nsv_segment_cigar_overview_t *overview)
+{
+  overview->alignment_matches = sums[NSV_CIGAR_MATCH];
+  overview->insertions = sums[NSV_CIGAR_INSERTION];
+  overview->deletions = sums[NSV_CIGAR_DELETION];
+  overview->skipped = sums[NSV_CIGAR_SKIP];
+  overview->soft_clip = sums[NSV_CIGAR_SOFT_CLIP];
+  overview->hard_clip = sums[NSV_CIGAR_HARD_CLIP];
+  overview->padding = sums[NSV_CIGAR_PADDING];
+  overview->matches = sums[NSV_CIGAR_EQUAL];
+  overview->mismatches = sums[NSV_CIGAR_DIFF];
+
+  overview->query_length = sums[NSV_CIGAR_MATCH]
+                           + sums[NSV_CIGAR_INSERTION]
+                           + sums[NSV_CIGAR_SOFT_CLIP]
+                           + sums[NSV_CIGAR_EQUAL]
+                           + sums[NSV_CIGAR_DIFF];
+  overview->reference_length = sums[NSV_CIGAR_MATCH]
+                               + sums[NSV_CIGAR_DELETION]
+                               + sums[NSV_CIGAR_SKIP]
+                               + sums[NSV_CIGAR_EQUAL]
+                               + sums[NSV_CIGAR_DIFF];
+
+  overview->first_clip = (first == -1) ? -1
+                         : (int32_t)nsv_cigar_length (cigar[first]);
+  overview->last_clip = (last == -1) ? -1
+                        : (int32_t)nsv_cigar_length (cigar[last]);
+}
+
+#ifdef NSV_CIGAR_X86
+
+/* Each lane of sums[k] adds up the lengths of the operations of kind 'k'
+ * it has seen.  An operation is compared with every kind, which takes
+ * nine compares per vector, but no gathers or scatters.  Clips are found
+ * with a mask of the lanes that hold an S or H. */
+
+__attribute__ ((target ("sse4.1")))
+static void
+nsv_cigar_overview_sse41 (const uint32_t *cigar, uint32_t cigar_len,
+                          struct nsv_segment_cigar_overview_t *overview)
+{
+  const __m128i low = _mm_set1_epi32 (0xf);
+  const __m128i soft_clip = _mm_set1_epi32 (NSV_CIGAR_SOFT_CLIP);
+  const __m128i hard_clip = _mm_set1_epi32 (NSV_CIGAR_HARD_CLIP);
+
+  __m128i vector_sums[NSV_CIGAR_OPERATIONS];
+  uint8_t kind;
+  for (kind = 0; kind < NSV_CIGAR_OPERATIONS; kind++)
+    vector_sums[kind] = _mm_setzero_si128 ();
+
+  int64_t first = -1;
+  int64_t last = -1;
+  uint32_t index = 0;
+  for (; index + 4 <= cigar_len; index += 4)
+    {
+      __m128i elements = _mm_loadu_si128 ((const __m128i *)(cigar + index));
+      __m128i operations = _mm_and_si128 (elements, low);
+      __m128i lengths = _mm_srli_epi32 (elements, 4);
+
+      for (kind = 0; kind < NSV_CIGAR_OPERATIONS; kind++)
+        {
+          __m128i same = _mm_cmpeq_epi32 (operations, _mm_set1_epi32 (kind));
+          vector_sums[kind] = _mm_add_epi32 (vector_sums[kind],
+                                             _mm_and_si128 (same, lengths));
+        }
+
+      __m128i clips = _mm_or_si128 (_mm_cmpeq_epi32 (operations, soft_clip),
+                                    _mm_cmpeq_epi32 (operations, hard_clip));
+      int mask = _mm_movemask_ps (_mm_castsi128_ps (clips));
+      if (mask != 0)
+        {
+          if (first == -1)
+            first = index + __builtin_ctz (mask);
+
+          last = index + 31 - __builtin_clz (mask);
+        }
+    }
+
+  uint32_t sums[NSV_CIGAR_OPERATIONS];
+  for (kind = 0; kind < NSV_CIGAR_OPERATIONS; kind++)
+    sums[kind] = (uint32_t)_mm_extract_epi32 (vector_sums[kind], 0)
+                 + (uint32_t)_mm_extract_epi32 (vector_sums[kind], 1)
+                 + (uint32_t)_mm_extract_epi32 (vector_sums[kind], 2)
+                 + (uint32_t)_mm_extract_epi32 (vector_sums[kind], 3);
+
+  nsv_cigar_sum_tail (cigar, index, cigar_len, sums, &first, &last);
+  nsv_cigar_finish (cigar, sums, first, last, overview);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+nsv_cigar_overview_avx2 (const uint32_t *cigar, uint32_t cigar_len,
+                         struct nsv_segment_cigar_overview_t *overview)
+{
+  const __m256i low = _mm256_set1_epi32 (0xf);
+  const __m256i soft_clip = _mm256_set1_epi32 (NSV_CIGAR_SOFT_CLIP);
+  const __m256i hard_clip = _mm256_set1_epi32 (NSV_CIGAR_HARD_CLIP);
+
+  __m256i vector_sums[NSV_CIGAR_OPERATIONS];
+  uint8_t kind;
+  for (kind = 0; kind < NSV_CIGAR_OPERATIONS; kind++)
+    vector_sums[kind] = _mm256_setzero_si256 ();
+
+  int64_t first = -1;
+  int64_t last = -1;
+  uint32_t index = 0;
+  for (; index + 8 <= cigar_len; index += 8)
+    {
+      __m256i elements = _mm256_loadu_si256 ((const __m256i *)(cigar + index));
+      __m256i operations = _mm256_and_si256 (elements, low);
+      __m256i lengths = _mm256_srli_epi32 (elements, 4);
+
+      for (kind = 0; kind < NSV_CIGAR_OPERATIONS; kind++)
+        {
+          __m256i same = _mm256_cmpeq_epi32 (operations,
+                                             _mm256_set1_epi32 (kind));
+          vector_sums[kind] = _mm256_add_epi32 (vector_sums[kind],
+                                                _mm256_and_si256 (same,
+                                                                  lengths));
+        }
+
+      __m256i clips = _mm256_or_si256 (_mm256_cmpeq_epi32 (operations,
+                                                           soft_clip),
+                                       _mm256_cmpeq_epi32 (operations,
+                                                           hard_clip));
+      int mask = _mm256_movemask_ps (_mm256_castsi256_ps (clips));
+      if (mask != 0)
+        {
+          if (first == -1)
+            first = index + __builtin_ctz (mask);
+
+          last = index + 31 - __builtin_clz (mask);
+        }
+    }
+
+  uint32_t sums[NSV_CIGAR_OPERATIONS];
+  for (kind = 0; kind < NSV_CIGAR_OPERATIONS; kind++)
+    {
+      __m128i half = _mm_add_epi32 (_mm256_castsi256_si128 (vector_sums[kind]),
+                                    _mm256_extracti128_si256 (vector_sums[kind],
+                                                              1));
+      sums[kind] = (uint32_t)_mm_extract_epi32 (half, 0)
+                   + (uint32_t)_mm_extract_epi32 (half, 1)
+                   + (uint32_t)_mm_extract_epi32 (half, 2)
+                   + (uint32_t)_mm_extract_epi32 (half, 3);
+    }
+
+  nsv_cigar_sum_tail (cigar, index, cigar_len, sums, &first, &last);
+  nsv_cigar_finish (cigar, sums, first, last, overview);
+}
+
+#endif
+
+/* Asks cpuid whether the processor, and the operating system, support
+ * the instructions of 'kernel'. */
+static bool
+nsv_cigar_supported (enum nsv_cigar_kernel_e kernel)
+{
+  switch (kernel)
+    {
+    case NSV_CIGAR_KERNEL_SCALAR:
+      return true;
+#ifdef NSV_CIGAR_X86
+    case NSV_CIGAR_KERNEL_SSE41:
+      __builtin_cpu_init ();
+      return __builtin_cpu_supports ("sse4.1");
+    case NSV_CIGAR_KERNEL_AVX2:
+      __builtin_cpu_init ();
+      return __builtin_cpu_supports ("avx2");
+#endif
+    default:
+      return false;
+    }
+}
+
+void
+nsv_cigar_init (void)
+{
+  if (!nsv_cigar_set_kernel (NSV_CIGAR_KERNEL_AVX2)
+      && !nsv_cigar_set_kernel (NSV_CIGAR_KERNEL_SSE41))
+    nsv_cigar_set_kernel (NSV_CIGAR_KERNEL_SCALAR);
+}
+
+bool
+nsv_cigar_set_kernel (enum nsv_cigar_kernel_e kernel)
+{
+  if (!nsv_cigar_supported (kernel))
+    return false;
+
+  nsv_cigar_selected = kernel;
+  return true;
+}
+
+enum nsv_cigar_kernel_e
+nsv_cigar_kernel (void)
+{
+  return nsv_cigar_selected;
+}
+
+const char *
+nsv_cigar_kernel_name (enum nsv_cigar_kernel_e kernel)
+{
+  switch (kernel)
+    {
+    case NSV_CIGAR_KERNEL_SCALAR: return "scalar";
+    case NSV_CIGAR_KERNEL_SSE41:  return "SSE4.1";
+    case NSV_CIGAR_KERNEL_AVX2:   return "AVX2";
+    default:                      return "unknown";
+    }
+}
+
+void
+nsv_cigar_overview (const uint32_t *cigar, uint32_t cigar_len,
+                    struct nsv_segment_cigar_overview_t *overview)
+{
+  /* Most segments have a handful of operations, for which the set-up of
+   * the vector kernels doesn't pay off. */
+  if (cigar_len < 16)
+    {
+      nsv_cigar_overview_scalar (cigar, cigar_len, overview);
+      return;
+    }
+
+  switch (nsv_cigar_selected)
+    {
+#ifdef NSV_CIGAR_X86
+    case NSV_CIGAR_KERNEL_AVX2:
+      nsv_cigar_overview_avx2 (cigar, cigar_len, overview);
+      break;
+    case NSV_CIGAR_KERNEL_SSE41:
+      nsv_cigar_overview_sse41 (cigar, cigar_len, overview);
+      break;
+#endif
+    default:
+      nsv_cigar_overview_scalar (cigar, cigar_len, overview);
+      break;
+    }
+}
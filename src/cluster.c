@@ -0,0 +1,476 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cluster.h"
+#include "breakpoint.h"
+#include "nanosvc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+/* A group is the range of breakpoints of a single pair of reference
+ * sequences and orientation.  Breakpoints of different groups never end
+ * up in the same cluster, so each group is clustered by a single worker
+ * without locks. */
+struct nsv_clusters_group_t
+{
+  struct nsv_breakpoint_t **breakpoints;
+  uint32_t breakpoints_len;
+  GArray *clusters;             /* The nsv_cluster_t of the group. */
+  bool success;
+};
+
+/* The position of the second end of a breakpoint, with its index in the
+ * group to tell equal positions apart. */
+struct nsv_clusters_rank_t
+{
+  int32_t position;
+  uint32_t index;
+};
+
+/* Orders breakpoints on their pair of reference sequences and their
+ * orientation.  Ties are broken on the address, which follows the order
+ * of the input array, so that the result does not depend on qsort. */
+static int
+nsv_clusters_group_compare (const void *first, const void *second)
+{
+  const struct nsv_breakpoint_t *a = *(struct nsv_breakpoint_t **)first;
+  const struct nsv_breakpoint_t *b = *(struct nsv_breakpoint_t **)second;
+
+  if (a->segments[0]->rname_id != b->segments[0]->rname_id)
+    return (a->segments[0]->rname_id < b->segments[0]->rname_id) ? -1 : 1;
+
+  if (a->segments[1]->rname_id != b->segments[1]->rname_id)
+    return (a->segments[1]->rname_id < b->segments[1]->rname_id) ? -1 : 1;
+
+  if (a->orientation != b->orientation)
+    return (a->orientation < b->orientation) ? -1 : 1;
+
+  return (a < b) ? -1 : (a == b) ? 0 : 1;
+}
+
+/* Orders the breakpoints of a group on the position of their first end,
+ * and then of their second end. */
+static int
+nsv_clusters_position_compare (const void *first, const void *second)
+{
+  const struct nsv_breakpoint_t *a = *(struct nsv_breakpoint_t **)first;
+  const struct nsv_breakpoint_t *b = *(struct nsv_breakpoint_t **)second;
+
+  if (a->breakpoints[0] != b->breakpoints[0])
+    return (a->breakpoints[0] < b->breakpoints[0]) ? -1 : 1;
+
+  if (a->breakpoints[1] != b->breakpoints[1])
+    return (a->breakpoints[1] < b->breakpoints[1]) ? -1 : 1;
+
+  return (a < b) ? -1 : (a == b) ? 0 : 1;
+}
+
+static int
+nsv_clusters_rank_compare (const void *first, const void *second)
+{
+  const struct nsv_clusters_rank_t *a = first;
+  const struct nsv_clusters_rank_t *b = second;
+
+  if (a->position != b->position)
+    return (a->position < b->position) ? -1 : 1;
+
+  return (a->index < b->index) ? -1 : (a->index == b->index) ? 0 : 1;
+}
+
+/* The window of the sweep is kept in a Fenwick tree over the ranks of the
+ * second ends, so that the neighbours of a breakpoint in the window are
+ * found in logarithmic time.  'tree' has 'length' + 1 counters. */
+static void
+nsv_clusters_window_update (uint32_t *tree, uint32_t length, uint32_t rank,
+                            int32_t delta)
+{
+  for (rank++; rank <= length; rank += rank & -rank)
+    tree[rank] += delta;
+}
+
+/* Returns the number of breakpoints in the window with a rank below
+ * 'rank'. */
+static uint32_t
+nsv_clusters_window_count (const uint32_t *tree, uint32_t rank)
+{
+  uint32_t count = 0;
+  for (; rank > 0; rank -= rank & -rank)
+    count += tree[rank];
+
+  return count;
+}
+
+/* Returns the rank of the 'nth' breakpoint in the window, counting from
+ * one. */
+static uint32_t
+nsv_clusters_window_find (const uint32_t *tree, uint32_t length,
+                          uint32_t nth)
+{
+  uint32_t step = 1;
+  while (step * 2 <= length)
+    step *= 2;
+
+  uint32_t position = 0;
+  for (; step > 0; step /= 2)
+    if (position + step <= length && tree[position + step] < nth)
+      {
+        position += step;
+        nth -= tree[position];
+      }
+
+  return position;
+}
+
+/* The breakpoints of a cluster are kept as a disjoint set, whose root is
+ * the breakpoint of the cluster that comes first. */
+static uint32_t
+nsv_clusters_find_root (uint32_t *parents, uint32_t index)
+{
+  while (parents[index] != index)
+    {
+      parents[index] = parents[parents[index]];
+      index = parents[index];
+    }
+
+  return index;
+}
+
+static void
+nsv_clusters_join (uint32_t *parents, uint32_t first, uint32_t second)
+{
+  first = nsv_clusters_find_root (parents, first);
+  second = nsv_clusters_find_root (parents, second);
+
+  if (first < second)
+    parents[second] = first;
+  else
+    parents[first] = second;
+}
+
+/* Adds the clusters with enough breakpoints to the group.  The breakpoints
+ * of the group are ordered cluster by cluster. */
+static void
+nsv_clusters_collect (struct nsv_clusters_group_t *group, uint32_t *parents,
+                      uint32_t *counts, uint32_t *offsets,
+                      struct nsv_breakpoint_t **ordered)
+{
+  struct nsv_breakpoint_t **breakpoints = group->breakpoints;
+  uint32_t length = group->breakpoints_len;
+
+  /* Every breakpoint is pointed straight at its root. */
+  uint32_t index;
+  memset (counts, 0, length * sizeof (uint32_t));
+  for (index = 0; index < length; index++)
+    {
+      parents[index] = nsv_clusters_find_root (parents, index);
+      counts[parents[index]]++;
+    }
+
+  /* A root comes first in its cluster, so the clusters are laid out in
+   * the order of their first breakpoint. */
+  uint32_t offset = 0;
+  for (index = 0; index < length; index++)
+    if (parents[index] == index)
+      {
+        offsets[index] = offset;
+        offset += counts[index];
+      }
+
+  for (index = 0; index < length; index++)
+    ordered[offsets[parents[index]]++] = breakpoints[index];
+
+  memcpy (breakpoints, ordered, length * sizeof (struct nsv_breakpoint_t *));
+
+  for (index = 0; index < length; index++)
+    {
+      if (parents[index] != index || counts[index] < nsv_config.cluster_count)
+        continue;
+
+      struct nsv_cluster_t cluster;
+      cluster.breakpoints_len = counts[index];
+      cluster.breakpoints = breakpoints + offsets[index] - counts[index];
+
+      struct nsv_breakpoint_t *first = cluster.breakpoints[0];
+      cluster.rname_ids[0] = first->segments[0]->rname_id;
+      cluster.rname_ids[1] = first->segments[1]->rname_id;
+      cluster.orientation = first->orientation;
+
+      uint32_t end;
+      for (end = 0; end < 2; end++)
+        {
+          cluster.starts[end] = first->breakpoints[end];
+          cluster.ends[end] = first->breakpoints[end];
+        }
+
+      uint32_t member;
+      for (member = 1; member < cluster.breakpoints_len; member++)
+        for (end = 0; end < 2; end++)
+          {
+            int32_t position = cluster.breakpoints[member]->breakpoints[end];
+            if (position < cluster.starts[end])
+              cluster.starts[end] = position;
+            if (position > cluster.ends[end])
+              cluster.ends[end] = position;
+          }
+
+      g_array_append_val (group->clusters, cluster);
+    }
+}
+
+/* Clusters the breakpoints of a group by sweeping over them in the order
+ * of their first end.  The window holds the breakpoints whose first end is
+ * at most 'cluster_distance' behind.  These are all linked to each other
+ * on their first end, so the ones that are also close on their second end
+ * are already in the same cluster when they are next to each other in the
+ * order of the second end.  A breakpoint therefore only has to be joined
+ * with its two neighbours in that order, which keeps the sweep at
+ * O(n log n) instead of comparing every pair. */
+static bool
+nsv_clusters_from_group (struct nsv_clusters_group_t *group)
+{
+  struct nsv_breakpoint_t **breakpoints = group->breakpoints;
+  uint32_t length = group->breakpoints_len;
+  int64_t distance = nsv_config.cluster_distance;
+
+  if (length < nsv_config.cluster_count)
+    return TRUE;
+
+  qsort (breakpoints, length, sizeof (struct nsv_breakpoint_t *),
+         nsv_clusters_position_compare);
+
+  struct nsv_clusters_rank_t *sorted;
+  sorted = malloc (length * sizeof (struct nsv_clusters_rank_t));
+  uint32_t *ranks = malloc (length * sizeof (uint32_t));
+  uint32_t *parents = malloc (length * sizeof (uint32_t));
+  uint32_t *tree = calloc (length + 1, sizeof (uint32_t));
+  struct nsv_breakpoint_t **ordered;
+  ordered = malloc (length * sizeof (struct nsv_breakpoint_t *));
+
+  bool success = (sorted != NULL && ranks != NULL && parents != NULL
+                  && tree != NULL && ordered != NULL);
+  if (!success)
+    infra_logger_error_alloc (nsv_config.logger);
+  else
+    {
+      uint32_t index;
+      for (index = 0; index < length; index++)
+        {
+          sorted[index].position = breakpoints[index]->breakpoints[1];
+          sorted[index].index = index;
+        }
+
+      qsort (sorted, length, sizeof (struct nsv_clusters_rank_t),
+             nsv_clusters_rank_compare);
+
+      for (index = 0; index < length; index++)
+        ranks[sorted[index].index] = index;
+
+      uint32_t window = 0;
+      uint32_t active = 0;
+      for (index = 0; index < length; index++)
+        {
+          struct nsv_breakpoint_t *breakpoint = breakpoints[index];
+          parents[index] = index;
+
+          while ((int64_t)breakpoint->breakpoints[0]
+                 - breakpoints[window]->breakpoints[0] > distance)
+            {
+              nsv_clusters_window_update (tree, length, ranks[window], -1);
+              active--;
+              window++;
+            }
+
+          uint32_t below = nsv_clusters_window_count (tree, ranks[index]);
+          if (below > 0)
+            {
+              uint32_t rank = nsv_clusters_window_find (tree, length, below);
+              uint32_t other = sorted[rank].index;
+              if ((int64_t)breakpoint->breakpoints[1]
+                  - breakpoints[other]->breakpoints[1] <= distance)
+                nsv_clusters_join (parents, index, other);
+            }
+
+          if (below < active)
+            {
+              uint32_t rank = nsv_clusters_window_find (tree, length,
+                                                        below + 1);
+              uint32_t other = sorted[rank].index;
+              if ((int64_t)breakpoints[other]->breakpoints[1]
+                  - breakpoint->breakpoints[1] <= distance)
+                nsv_clusters_join (parents, index, other);
+            }
+
+          nsv_clusters_window_update (tree, length, ranks[index], 1);
+          active++;
+        }
+
+      /* The tree and the ranks are no longer needed, so their memory is
+       * reused for the sizes and offsets of the clusters. */
+      nsv_clusters_collect (group, parents, tree, ranks, ordered);
+    }
+
+  free (sorted);
+  free (ranks);
+  free (parents);
+  free (tree);
+  free (ordered);
+  return success;
+}
+
+/* This function runs on a worker thread. */
+static void
+nsv_clusters_group_job (gpointer data, gpointer user_data)
+{
+  (void) user_data;
+  struct nsv_clusters_group_t *group = data;
+  group->success = nsv_clusters_from_group (group);
+}
+
+struct nsv_clusters_t *
+nsv_clusters_from_breakpoints (GArray *breakpoints)
+{
+  if (breakpoints == NULL)
+    return NULL;
+
+  struct nsv_clusters_t *clusters = calloc (1, sizeof (struct nsv_clusters_t));
+  if (clusters == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  uint32_t length = breakpoints->len;
+  clusters->breakpoints_len = length;
+  clusters->breakpoints = malloc ((length + 1)
+                                  * sizeof (struct nsv_breakpoint_t *));
+  if (clusters->breakpoints == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      nsv_clusters_destroy (clusters);
+      return NULL;
+    }
+
+  uint32_t index;
+  for (index = 0; index < length; index++)
+    clusters->breakpoints[index] = &g_array_index (breakpoints,
+                                                   struct nsv_breakpoint_t,
+                                                   index);
+
+  qsort (clusters->breakpoints, length, sizeof (struct nsv_breakpoint_t *),
+         nsv_clusters_group_compare);
+
+  GArray *groups = g_array_new (FALSE, FALSE,
+                                sizeof (struct nsv_clusters_group_t));
+  uint32_t last;
+  for (index = 0; index < length; index = last)
+    {
+      for (last = index + 1; last < length; last++)
+        {
+          struct nsv_breakpoint_t *a = clusters->breakpoints[index];
+          struct nsv_breakpoint_t *b = clusters->breakpoints[last];
+          if (a->segments[0]->rname_id != b->segments[0]->rname_id
+              || a->segments[1]->rname_id != b->segments[1]->rname_id
+              || a->orientation != b->orientation)
+            break;
+        }
+
+      struct nsv_clusters_group_t group;
+      group.breakpoints = clusters->breakpoints + index;
+      group.breakpoints_len = last - index;
+      group.clusters = g_array_new (FALSE, FALSE,
+                                    sizeof (struct nsv_cluster_t));
+      group.success = TRUE;
+      g_array_append_val (groups, group);
+    }
+
+  struct nsv_clusters_group_t *group_list;
+  group_list = (struct nsv_clusters_group_t *)groups->data;
+
+  bool success = TRUE;
+  if (nsv_config.max_threads <= 1 || groups->len <= 1)
+    for (index = 0; index < groups->len; index++)
+      nsv_clusters_group_job (&(group_list[index]), NULL);
+  else
+    {
+      GThreadPool *pool;
+      pool = g_thread_pool_new (nsv_clusters_group_job, NULL,
+                                nsv_config.max_threads, TRUE, NULL);
+      if (pool == NULL)
+        success = FALSE;
+      else
+        {
+          for (index = 0; index < groups->len; index++)
+            g_thread_pool_push (pool, &(group_list[index]), NULL);
+
+          /* This waits for all groups to be done. */
+          g_thread_pool_free (pool, FALSE, TRUE);
+        }
+    }
+
+  for (index = 0; index < groups->len; index++)
+    {
+      success = success && group_list[index].success;
+      clusters->length += group_list[index].clusters->len;
+    }
+
+  clusters->clusters = malloc ((clusters->length + 1)
+                               * sizeof (struct nsv_cluster_t));
+  if (clusters->clusters == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      success = FALSE;
+    }
+
+  /* The clusters are joined in the order of the groups, so that the table
+   * is the same for any number of threads. */
+  uint32_t offset = 0;
+  for (index = 0; index < groups->len; index++)
+    {
+      GArray *group_clusters = group_list[index].clusters;
+      if (success)
+        memcpy (clusters->clusters + offset, group_clusters->data,
+                group_clusters->len * sizeof (struct nsv_cluster_t));
+
+      offset += group_clusters->len;
+      g_array_free (group_clusters, TRUE);
+    }
+
+  g_array_free (groups, TRUE);
+
+  if (!success)
+    {
+      nsv_clusters_destroy (clusters);
+      return NULL;
+    }
+
+  return clusters;
+}
+
+void
+nsv_clusters_destroy (struct nsv_clusters_t *clusters)
+{
+  if (clusters == NULL)
+    return;
+
+  free (clusters->clusters);
+  free (clusters->breakpoints);
+  free (clusters);
+}
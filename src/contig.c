@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "contig.h"
+#include "nanosvc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+/* Alignments are usually sorted by position, so consecutive lookups on a
+ * thread are likely to be for the same contig.  Each thread remembers the
+ * last contig it found, along with the dictionary it came from. */
+struct nsv_contigs_cache_t
+{
+  uint32_t serial;
+  struct nsv_contig_t *contig;
+};
+
+static GPrivate nsv_contigs_cache = G_PRIVATE_INIT (free);
+static gint nsv_contigs_serial = 0;
+
+static void
+nsv_contig_destroy (void *contig_obj)
+{
+  struct nsv_contig_t *contig = contig_obj;
+  free (contig->name);
+  free (contig);
+}
+
+struct nsv_contigs_t *
+nsv_contigs_new (void)
+{
+  struct nsv_contigs_t *contigs = calloc (1, sizeof (struct nsv_contigs_t));
+  if (contigs == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  /* The hash table shares its keys with the contigs, which are owned by
+   * the array. */
+  contigs->contigs = g_ptr_array_new ();
+  contigs->names = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
+  contigs->unlisted = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             NULL, NULL);
+  contigs->serial = g_atomic_int_add (&nsv_contigs_serial, 1) + 1;
+  g_mutex_init (&(contigs->mutex));
+  return contigs;
+}
+
+void
+nsv_contigs_seal (struct nsv_contigs_t *contigs)
+{
+  if (contigs == NULL)
+    return;
+
+  g_mutex_lock (&(contigs->mutex));
+  contigs->sealed = true;
+  g_mutex_unlock (&(contigs->mutex));
+}
+
+static void
+nsv_contigs_remember (struct nsv_contigs_t *contigs,
+                      struct nsv_contig_t *contig)
+{
+  struct nsv_contigs_cache_t *cache = g_private_get (&nsv_contigs_cache);
+  if (cache == NULL)
+    {
+      cache = malloc (sizeof (struct nsv_contigs_cache_t));
+      if (cache == NULL)
+        return;
+
+      g_private_set (&nsv_contigs_cache, cache);
+    }
+
+  cache->serial = contigs->serial;
+  cache->contig = contig;
+}
+
+/* Looks up 'name' without locking 'contigs'.  This finds the contig of the
+ * previous lookup on this thread, and the contigs of the header once the
+ * dictionary is sealed. */
+static struct nsv_contig_t *
+nsv_contigs_find_unlocked (struct nsv_contigs_t *contigs, const char *name)
+{
+  /* Contigs are never removed, so a cached contig of this dictionary is
+   * still valid. */
+  struct nsv_contigs_cache_t *cache = g_private_get (&nsv_contigs_cache);
+  if (cache != NULL && cache->serial == contigs->serial
+      && !strcmp (cache->contig->name, name))
+    return cache->contig;
+
+  if (!contigs->sealed)
+    return NULL;
+
+  struct nsv_contig_t *contig = g_hash_table_lookup (contigs->names, name);
+  if (contig != NULL)
+    nsv_contigs_remember (contigs, contig);
+
+  return contig;
+}
+
+/* Looks up 'name' in 'contigs', which must be locked by the caller. */
+static struct nsv_contig_t *
+nsv_contigs_find (struct nsv_contigs_t *contigs, const char *name)
+{
+  struct nsv_contig_t *contig = g_hash_table_lookup (contigs->names, name);
+  if (contig == NULL && contigs->sealed)
+    contig = g_hash_table_lookup (contigs->unlisted, name);
+
+  if (contig != NULL)
+    nsv_contigs_remember (contigs, contig);
+
+  return contig;
+}
+
+int32_t
+nsv_contigs_lookup (struct nsv_contigs_t *contigs, const char *name)
+{
+  if (contigs == NULL || name == NULL)
+    return -1;
+
+  struct nsv_contig_t *contig = nsv_contigs_find_unlocked (contigs, name);
+  if (contig != NULL)
+    return contig->index;
+
+  g_mutex_lock (&(contigs->mutex));
+  contig = nsv_contigs_find (contigs, name);
+  int32_t index = (contig == NULL) ? -1 : contig->index;
+  g_mutex_unlock (&(contigs->mutex));
+
+  return index;
+}
+
+int32_t
+nsv_contigs_add (struct nsv_contigs_t *contigs, const char *name,
+                 uint32_t length)
+{
+  if (contigs == NULL || name == NULL)
+    return -1;
+
+  /* Records add the names they refer to without a length, which leaves
+   * known contigs untouched, so only unseen names take the lock. */
+  struct nsv_contig_t *contig;
+  if (length == 0
+      && (contig = nsv_contigs_find_unlocked (contigs, name)) != NULL)
+    return contig->index;
+
+  g_mutex_lock (&(contigs->mutex));
+
+  contig = nsv_contigs_find (contigs, name);
+  if (contig != NULL)
+    {
+      if (length > 0)
+        contig->length = length;
+
+      g_mutex_unlock (&(contigs->mutex));
+      return contig->index;
+    }
+
+  contig = malloc (sizeof (struct nsv_contig_t));
+  if (contig != NULL)
+    contig->name = strdup (name);
+
+  if (contig == NULL || contig->name == NULL)
+    {
+      g_mutex_unlock (&(contigs->mutex));
+      infra_logger_error_alloc (nsv_config.logger);
+      free (contig);
+      return -1;
+    }
+
+  contig->length = length;
+  contig->index = contigs->contigs->len;
+
+  g_ptr_array_add (contigs->contigs, contig);
+  g_hash_table_insert ((contigs->sealed) ? contigs->unlisted : contigs->names,
+                       contig->name, contig);
+  nsv_contigs_remember (contigs, contig);
+
+  g_mutex_unlock (&(contigs->mutex));
+  return contig->index;
+}
+
+const char *
+nsv_contigs_name (struct nsv_contigs_t *contigs, int32_t index)
+{
+  if (contigs == NULL || index < 0)
+    return "*";
+
+  /* The name itself is never moved, so it stays valid after unlocking. */
+  const char *name = "*";
+  g_mutex_lock (&(contigs->mutex));
+  if ((uint32_t)index < contigs->contigs->len)
+    {
+      struct nsv_contig_t *contig = g_ptr_array_index (contigs->contigs,
+                                                       index);
+      name = contig->name;
+    }
+  g_mutex_unlock (&(contigs->mutex));
+
+  return name;
+}
+
+uint32_t
+nsv_contigs_length (struct nsv_contigs_t *contigs, int32_t index)
+{
+  if (contigs == NULL || index < 0)
+    return 0;
+
+  uint32_t length = 0;
+  g_mutex_lock (&(contigs->mutex));
+  if ((uint32_t)index < contigs->contigs->len)
+    {
+      struct nsv_contig_t *contig = g_ptr_array_index (contigs->contigs,
+                                                       index);
+      length = contig->length;
+    }
+  g_mutex_unlock (&(contigs->mutex));
+
+  return length;
+}
+
+/* Parses a 1-based coordinate, skipping thousands separators. */
+static bool
+nsv_contigs_parse_position (const char *text, const char *end,
+                            int64_t *position)
+{
+  *position = 0;
+  bool digits = false;
+  for (; text < end; text++)
+    {
+      if (*text == ',')
+        continue;
+
+      if ((uint8_t)(*text - '0') >= 10 || *position > INT32_MAX)
+        return false;
+
+      *position = *position * 10 + (*text - '0');
+      digits = true;
+    }
+
+  return digits;
+}
+
+bool
+nsv_contigs_parse_region (struct nsv_contigs_t *contigs, const char *text,
+                          struct nsv_region_t *region)
+{
+  if (contigs == NULL || text == NULL || region == NULL)
+    return false;
+
+  /* Contig names may contain colons themselves, so a name that matches as
+   * a whole takes precedence. */
+  const char *colon = strrchr (text, ':');
+  region->rname_id = nsv_contigs_lookup (contigs, text);
+  if (region->rname_id >= 0 || colon == NULL)
+    colon = text + strlen (text);
+  else
+    {
+      char *name = strndup (text, colon - text);
+      if (name == NULL)
+        {
+          infra_logger_error_alloc (nsv_config.logger);
+          return false;
+        }
+
+      region->rname_id = nsv_contigs_lookup (contigs, name);
+      free (name);
+    }
+
+  if (region->rname_id < 0)
+    return false;
+
+  uint32_t length = nsv_contigs_length (contigs, region->rname_id);
+  region->begin = 0;
+  region->end = (length > 0) ? length : INT32_MAX;
+
+  if (*colon == '\0')
+    return true;
+
+  const char *begin_text = colon + 1;
+  const char *dash = strchr (begin_text, '-');
+  const char *begin_end = (dash != NULL)
+                          ? dash
+                          : begin_text + strlen (begin_text);
+
+  int64_t begin;
+  if (!nsv_contigs_parse_position (begin_text, begin_end, &begin)
+      || begin < 1)
+    return false;
+
+  region->begin = begin - 1;
+  if (dash != NULL
+      && !nsv_contigs_parse_position (dash + 1, dash + strlen (dash),
+                                      &(region->end)))
+    return false;
+
+  return (region->begin < region->end);
+}
+
+uint32_t
+nsv_contigs_count (struct nsv_contigs_t *contigs)
+{
+  if (contigs == NULL)
+    return 0;
+
+  g_mutex_lock (&(contigs->mutex));
+  uint32_t count = contigs->contigs->len;
+  g_mutex_unlock (&(contigs->mutex));
+
+  return count;
+}
+
+bool
+nsv_contigs_add_header_line (struct nsv_contigs_t *contigs,
+                             const char *line, size_t length)
+{
+  if (contigs == NULL || line == NULL)
+    return false;
+
+  if (length < 3 || memcmp (line, "@SQ", 3))
+    return true;
+
+  /* The fields of a header line are TAG:VALUE pairs separated by tabs. */
+  const char *end = line + length;
+  const char *name = NULL;
+  size_t name_len = 0;
+  uint32_t reference_len = 0;
+
+  const char *field = line;
+  while (field < end)
+    {
+      const char *delimiter = memchr (field, '\t', end - field);
+      if (delimiter == NULL)
+        delimiter = end;
+
+      if (delimiter - field > 3 && !memcmp (field, "SN:", 3))
+        {
+          name = field + 3;
+          name_len = delimiter - name;
+        }
+      else if (delimiter - field > 3 && !memcmp (field, "LN:", 3))
+        {
+          const char *digit;
+          for (digit = field + 3; digit < delimiter; digit++)
+            reference_len = reference_len * 10 + (*digit - '0');
+        }
+
+      field = delimiter + 1;
+    }
+
+  /* An @SQ line without a name is malformed, but harmless. */
+  if (name == NULL)
+    return true;
+
+  char *name_copy = strndup (name, name_len);
+  if (name_copy == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return false;
+    }
+
+  int32_t index = nsv_contigs_add (contigs, name_copy, reference_len);
+  free (name_copy);
+
+  return (index >= 0);
+}
+
+void
+nsv_contigs_destroy (struct nsv_contigs_t *contigs)
+{
+  if (contigs == NULL)
+    return;
+
+  g_hash_table_destroy (contigs->names);
+  g_hash_table_destroy (contigs->unlisted);
+
+  guint index;
+  for (index = 0; index < contigs->contigs->len; index++)
+    nsv_contig_destroy (g_ptr_array_index (contigs->contigs, index));
+
+  g_ptr_array_free (contigs->contigs, TRUE);
+  g_mutex_clear (&(contigs->mutex));
+  free (contigs);
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "filter.h"
+#include "segment.h"
+#include "nanosvc.h"
+
+#include <math.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+static const char *nsv_filter_fields[] = {
+  "flag", "mapq", "length", "identity", "[NM]", "[MD]"
+};
+
+static const char *
+nsv_filter_skip_spaces (const char *text)
+{
+  while (isspace ((unsigned char)*text))
+    text++;
+
+  return text;
+}
+
+/* Matches the name of a field at the start of 'text'.  A name must not be
+ * followed by more letters, so that "mapquality" is not taken for "mapq". */
+static const char *
+nsv_filter_parse_field (const char *text, uint8_t *field)
+{
+  uint8_t index;
+  for (index = 0; index <= NSV_FILTER_TAG_MD; index++)
+    {
+      size_t length = strlen (nsv_filter_fields[index]);
+      if (!strncmp (text, nsv_filter_fields[index], length)
+          && !isalnum ((unsigned char)text[length]))
+        {
+          *field = index;
+          return text + length;
+        }
+    }
+
+  return NULL;
+}
+
+/* Turns the comparison at the start of 'text' into the range of values
+ * that 'clause' keeps. */
+static const char *
+nsv_filter_parse_comparison (const char *text,
+                             struct nsv_filter_clause_t *clause)
+{
+  const char *operator = text;
+  if ((text[0] == '=' || text[0] == '!' || text[0] == '<' || text[0] == '>')
+      && text[1] == '=')
+    text += 2;
+  else if (text[0] == '<' || text[0] == '>')
+    text += 1;
+  else
+    return NULL;
+
+  text = nsv_filter_skip_spaces (text);
+  char *end;
+  double value = strtod (text, &end);
+  if (end == text || isnan (value))
+    return NULL;
+
+  clause->low = -INFINITY;
+  clause->high = INFINITY;
+  clause->negate = false;
+  switch (operator[0])
+    {
+    case '=':
+      clause->low = value;
+      clause->high = value;
+      break;
+    case '!':
+      clause->low = value;
+      clause->high = value;
+      clause->negate = true;
+      break;
+    case '<':
+      clause->high = (operator[1] == '=')
+                     ? value
+                     : nextafter (value, -INFINITY);
+      break;
+    case '>':
+      clause->low = (operator[1] == '=')
+                    ? value
+                    : nextafter (value, INFINITY);
+      break;
+    }
+
+  return end;
+}
+
+/* Compiles a single clause, and returns the text after it, or NULL when
+ * the clause is not valid. */
+static const char *
+nsv_filter_parse_clause (const char *text, struct nsv_filter_clause_t *clause)
+{
+  const char *start = nsv_filter_skip_spaces (text);
+  text = nsv_filter_parse_field (start, &(clause->field));
+  if (text == NULL)
+    return NULL;
+
+  /* A mask is only allowed on integer values. */
+  clause->mask = UINT32_MAX;
+  text = nsv_filter_skip_spaces (text);
+  if (text[0] == '&' && text[1] != '&')
+    {
+      if (clause->field == NSV_FILTER_IDENTITY)
+        return NULL;
+
+      char *end;
+      text = nsv_filter_skip_spaces (text + 1);
+      clause->mask = strtoul (text, &end, 0);
+      if (end == text)
+        return NULL;
+
+      text = nsv_filter_skip_spaces (end);
+    }
+
+  text = nsv_filter_parse_comparison (text, clause);
+  if (text == NULL)
+    return NULL;
+
+  clause->text = strndup (start, text - start);
+  if (clause->text == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  return nsv_filter_skip_spaces (text);
+}
+
+struct nsv_filter_t *
+nsv_filter_compile (const char *expression)
+{
+  if (expression == NULL)
+    return NULL;
+
+  struct nsv_filter_t *filter = calloc (1, sizeof (struct nsv_filter_t));
+  if (filter == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  const char *text = expression;
+  while (true)
+    {
+      if (filter->clauses_len == NSV_FILTER_MAX_CLAUSES)
+        {
+          infra_logger_log (nsv_config.logger, LOG_ERROR,
+                            "A filter can have at most %d clauses.",
+                            NSV_FILTER_MAX_CLAUSES);
+          break;
+        }
+
+      const char *clause_text = text;
+      text = nsv_filter_parse_clause (text,
+                                      &(filter->clauses[filter->clauses_len]));
+      if (text == NULL)
+        {
+          infra_logger_log (nsv_config.logger, LOG_ERROR,
+                            "Invalid filter clause at '%s'.", clause_text);
+          break;
+        }
+
+      filter->clauses_len++;
+      if (*text == '\0')
+        return filter;
+
+      if (text[0] != '&' || text[1] != '&')
+        {
+          infra_logger_log (nsv_config.logger, LOG_ERROR,
+                            "Expected '&&' in the filter at '%s'.", text);
+          break;
+        }
+
+      text += 2;
+    }
+
+  nsv_filter_destroy (filter);
+  return NULL;
+}
+
+void
+nsv_filter_destroy (struct nsv_filter_t *filter)
+{
+  if (filter == NULL)
+    return;
+
+  uint32_t index;
+  for (index = 0; index < filter->clauses_len; index++)
+    free (filter->clauses[index].text);
+
+  free (filter);
+}
+
+/* Returns the value a clause looks at, or NAN when the segment does not
+ * have it. */
+static inline double
+nsv_filter_value (const struct nsv_filter_clause_t *clause,
+                  struct nsv_segment_t *segment)
+{
+  int64_t value;
+  switch (clause->field)
+    {
+    case NSV_FILTER_FLAG:   value = segment->flag; break;
+    case NSV_FILTER_MAPQ:   value = segment->mapq; break;
+    case NSV_FILTER_LENGTH: value = segment->end - segment->pos; break;
+    case NSV_FILTER_IDENTITY:
+      return (segment->pid < 0) ? NAN : segment->pid;
+    case NSV_FILTER_TAG_NM:
+      value = nsv_segment_cold (segment)->nm;
+      break;
+    case NSV_FILTER_TAG_MD:
+      value = nsv_segment_cold (segment)->md_mismatches;
+      break;
+    default:
+      return NAN;
+    }
+
+  return (value < 0) ? NAN : (double)((uint32_t)value & clause->mask);
+}
+
+bool
+nsv_filter_keep (const struct nsv_filter_t *filter,
+                 struct nsv_segment_t *segment, uint32_t *rejected_counts)
+{
+  if (filter == NULL)
+    return true;
+
+  uint32_t index;
+  for (index = 0; index < filter->clauses_len; index++)
+    {
+      const struct nsv_filter_clause_t *clause = &(filter->clauses[index]);
+      double value = nsv_filter_value (clause, segment);
+
+      /* A missing value fails every comparison. */
+      bool inside = (value >= clause->low && value <= clause->high);
+      if (isnan (value) || inside == clause->negate)
+        {
+          rejected_counts[index]++;
+          return false;
+        }
+    }
+
+  return true;
+}
+
+void
+nsv_filter_log_counts (const struct nsv_filter_t *filter,
+                       const uint32_t *rejected_counts)
+{
+  if (filter == NULL)
+    return;
+
+  uint32_t index;
+  for (index = 0; index < filter->clauses_len; index++)
+    infra_logger_log (nsv_config.logger, LOG_INFO,
+                      "Filtered %u segments with '%s'.",
+                      rejected_counts[index], filter->clauses[index].text);
+}
@@ -0,0 +1,490 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "index.h"
+#include "bgzf.h"
+#include "nanosvc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+/* The parameters of BAI indexes, see section 5.3 of the SAMv1
+ * specification. */
+#define BAI_MIN_SHIFT 14
+#define BAI_DEPTH 5
+
+/* The deepest CSI index whose bin numbers, including the pseudo-bin, fit
+ * in 32 bits. */
+#define CSI_MAX_DEPTH 9
+
+/* This data structure is a cursor over an index that has been read into
+ * memory.  Reading past the end sets 'error' and yields zeroes. */
+struct nsv_index_reader_t
+{
+  uint8_t *data;
+  size_t length;
+  size_t position;
+  bool error;
+};
+
+static bool
+nsv_index_reader_has (struct nsv_index_reader_t *reader, uint64_t bytes)
+{
+  if (reader->error || reader->length - reader->position < bytes)
+    {
+      reader->error = true;
+      return false;
+    }
+
+  return true;
+}
+
+static uint32_t
+nsv_index_read_uint32 (struct nsv_index_reader_t *reader)
+{
+  if (!nsv_index_reader_has (reader, 4))
+    return 0;
+
+  const uint8_t *buffer = reader->data + reader->position;
+  reader->position += 4;
+  return (uint32_t)buffer[0]
+    | ((uint32_t)buffer[1] << 8)
+    | ((uint32_t)buffer[2] << 16)
+    | ((uint32_t)buffer[3] << 24);
+}
+
+static uint64_t
+nsv_index_read_uint64 (struct nsv_index_reader_t *reader)
+{
+  uint64_t low = nsv_index_read_uint32 (reader);
+  uint64_t high = nsv_index_read_uint32 (reader);
+  return low | (high << 32);
+}
+
+/* Reads a whole file into memory.  CSI indexes are BGZF-compressed, while
+ * BAI indexes are not. */
+static uint8_t *
+nsv_index_read_file (FILE *stream, bool compressed, size_t *length_ptr)
+{
+  struct nsv_bgzf_t *bgzf = NULL;
+  if (compressed && (bgzf = nsv_bgzf_new (stream, 1)) == NULL)
+    return NULL;
+
+  size_t capacity = NSV_BGZF_MAX_BLOCK_SIZE;
+  size_t length = 0;
+  uint8_t *data = malloc (capacity);
+
+  while (data != NULL)
+    {
+      if (capacity - length < NSV_BGZF_MAX_BLOCK_SIZE)
+        {
+          uint8_t *larger = realloc (data, capacity * 2);
+          if (larger == NULL)
+            {
+              free (data);
+              data = NULL;
+              break;
+            }
+
+          data = larger;
+          capacity *= 2;
+        }
+
+      size_t bytes = (compressed)
+        ? nsv_bgzf_read (bgzf, data + length, NSV_BGZF_MAX_BLOCK_SIZE)
+        : fread (data + length, 1, NSV_BGZF_MAX_BLOCK_SIZE, stream);
+
+      length += bytes;
+      if (bytes == 0)
+        break;
+    }
+
+  if (data == NULL)
+    infra_logger_error_alloc (nsv_config.logger);
+
+  nsv_bgzf_destroy (bgzf);
+  *length_ptr = length;
+  return data;
+}
+
+static int
+nsv_index_bin_compare (const void *first, const void *second)
+{
+  const struct nsv_index_bin_t *a = first;
+  const struct nsv_index_bin_t *b = second;
+  return (a->bin < b->bin) ? -1 : (a->bin > b->bin);
+}
+
+static bool
+nsv_index_parse_reference (struct nsv_index_t *index,
+                           struct nsv_index_reader_t *reader,
+                           struct nsv_index_reference_t *reference)
+{
+  uint32_t bins_len = nsv_index_read_uint32 (reader);
+  if (!nsv_index_reader_has (reader, (uint64_t)bins_len * 8))
+    return false;
+
+  reference->bins = calloc (bins_len + 1, sizeof (struct nsv_index_bin_t));
+  if (reference->bins == NULL)
+    return false;
+
+  /* The pseudo-bin after the last real bin holds metadata, which we do
+   * not need. */
+  uint32_t pseudo_bin = ((1ULL << ((index->depth + 1) * 3)) - 1) / 7 + 1;
+
+  uint32_t bin_index;
+  for (bin_index = 0; bin_index < bins_len; bin_index++)
+    {
+      struct nsv_index_bin_t *bin = &(reference->bins[reference->bins_len]);
+      bin->bin = nsv_index_read_uint32 (reader);
+      if (index->is_csi)
+        bin->loffset = nsv_index_read_uint64 (reader);
+
+      uint32_t chunks_len = nsv_index_read_uint32 (reader);
+      if (!nsv_index_reader_has (reader, (uint64_t)chunks_len * 16))
+        return false;
+
+      if (bin->bin == pseudo_bin)
+        {
+          reader->position += (size_t)chunks_len * 16;
+          continue;
+        }
+
+      bin->chunks = malloc ((chunks_len + 1)
+                            * sizeof (struct nsv_index_chunk_t));
+      if (bin->chunks == NULL)
+        return false;
+
+      reference->bins_len++;
+      for (bin->chunks_len = 0;
+           bin->chunks_len < chunks_len;
+           bin->chunks_len++)
+        {
+          bin->chunks[bin->chunks_len].begin = nsv_index_read_uint64 (reader);
+          bin->chunks[bin->chunks_len].end = nsv_index_read_uint64 (reader);
+        }
+    }
+
+  qsort (reference->bins, reference->bins_len,
+         sizeof (struct nsv_index_bin_t), nsv_index_bin_compare);
+
+  if (index->is_csi)
+    return !reader->error;
+
+  /* BAI indexes have a linear index with the smallest virtual offset of
+   * the records in each 16 kbp window. */
+  uint32_t intervals_len = nsv_index_read_uint32 (reader);
+  if (!nsv_index_reader_has (reader, (uint64_t)intervals_len * 8))
+    return false;
+
+  reference->intervals = malloc ((intervals_len + 1) * sizeof (uint64_t));
+  if (reference->intervals == NULL)
+    return false;
+
+  for (reference->intervals_len = 0;
+       reference->intervals_len < intervals_len;
+       reference->intervals_len++)
+    reference->intervals[reference->intervals_len]
+      = nsv_index_read_uint64 (reader);
+
+  return !reader->error;
+}
+
+static bool
+nsv_index_parse (struct nsv_index_t *index, struct nsv_index_reader_t *reader)
+{
+  if (!nsv_index_reader_has (reader, 4))
+    return false;
+
+  const uint8_t *magic = reader->data;
+  reader->position += 4;
+
+  if (!memcmp (magic, "BAI\1", 4))
+    {
+      index->min_shift = BAI_MIN_SHIFT;
+      index->depth = BAI_DEPTH;
+    }
+  else if (!memcmp (magic, "CSI\1", 4))
+    {
+      index->is_csi = true;
+      index->min_shift = nsv_index_read_uint32 (reader);
+      index->depth = nsv_index_read_uint32 (reader);
+
+      /* Skip the auxiliary data. */
+      uint32_t aux_len = nsv_index_read_uint32 (reader);
+      if (!nsv_index_reader_has (reader, aux_len))
+        return false;
+
+      reader->position += aux_len;
+    }
+  else
+    return false;
+
+  if (index->min_shift < 1 || index->depth < 0
+      || index->depth > CSI_MAX_DEPTH
+      || index->min_shift > 62 - index->depth * 3)
+    return false;
+
+  int32_t references_len = nsv_index_read_uint32 (reader);
+  if (references_len < 0 || reader->error)
+    return false;
+
+  index->references = calloc (references_len + 1,
+                              sizeof (struct nsv_index_reference_t));
+  if (index->references == NULL)
+    return false;
+
+  for (index->references_len = 0;
+       index->references_len < references_len;
+       index->references_len++)
+    {
+      struct nsv_index_reference_t *reference;
+      reference = &(index->references[index->references_len]);
+      if (!nsv_index_parse_reference (index, reader, reference))
+        {
+          /* Make sure the partial reference is freed too. */
+          index->references_len++;
+          return false;
+        }
+    }
+
+  return true;
+}
+
+struct nsv_index_t *
+nsv_index_open (const char *filename)
+{
+  if (filename == NULL)
+    return NULL;
+
+  size_t name_len = strlen (filename);
+  char *index_name = malloc (name_len + 5);
+  if (index_name == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  bool is_csi = false;
+  sprintf (index_name, "%s.bai", filename);
+  FILE *stream = fopen (index_name, "rb");
+  if (stream == NULL)
+    {
+      is_csi = true;
+      sprintf (index_name, "%s.csi", filename);
+      stream = fopen (index_name, "rb");
+    }
+
+  if (stream == NULL)
+    {
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "Could not find an index for '%s'.", filename);
+      free (index_name);
+      return NULL;
+    }
+
+  struct nsv_index_reader_t reader;
+  memset (&reader, 0, sizeof (struct nsv_index_reader_t));
+  reader.data = nsv_index_read_file (stream, is_csi, &(reader.length));
+  fclose (stream);
+
+  struct nsv_index_t *index = NULL;
+  if (reader.data != NULL)
+    index = calloc (1, sizeof (struct nsv_index_t));
+
+  if (index != NULL && !nsv_index_parse (index, &reader))
+    {
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "Could not read the index '%s'.", index_name);
+      nsv_index_destroy (index);
+      index = NULL;
+    }
+
+  free (reader.data);
+  free (index_name);
+  return index;
+}
+
+int64_t
+nsv_index_max_position (struct nsv_index_t *index)
+{
+  if (index == NULL)
+    return 0;
+
+  return (int64_t)1 << (index->min_shift + index->depth * 3);
+}
+
+static struct nsv_index_bin_t *
+nsv_index_find_bin (struct nsv_index_reference_t *reference, uint32_t bin)
+{
+  struct nsv_index_bin_t key;
+  key.bin = bin;
+  return bsearch (&key, reference->bins, reference->bins_len,
+                  sizeof (struct nsv_index_bin_t), nsv_index_bin_compare);
+}
+
+static int
+nsv_index_chunk_compare (const void *first, const void *second)
+{
+  const struct nsv_index_chunk_t *a = first;
+  const struct nsv_index_chunk_t *b = second;
+  return (a->begin < b->begin) ? -1 : (a->begin > b->begin);
+}
+
+struct nsv_index_chunk_t *
+nsv_index_query (struct nsv_index_t *index, int32_t reference_id,
+                 int64_t begin, int64_t end, uint32_t *chunks_len)
+{
+  if (index == NULL || chunks_len == NULL)
+    return NULL;
+
+  *chunks_len = 0;
+  if (reference_id < 0 || reference_id >= index->references_len)
+    return NULL;
+
+  int64_t max_position = nsv_index_max_position (index);
+  if (begin < 0)
+    begin = 0;
+  if (end > max_position)
+    end = max_position;
+  if (begin >= end)
+    return NULL;
+
+  struct nsv_index_reference_t *reference;
+  reference = &(index->references[reference_id]);
+
+  /* Records that end before this virtual offset cannot overlap the region.
+   * BAI indexes keep it in the linear index.  For CSI indexes, the smallest
+   * bin that contains 'begin' provides it. */
+  uint64_t min_offset = 0;
+  int32_t level;
+  int32_t shift;
+  uint32_t first_bin;
+
+  if (!index->is_csi && reference->intervals_len > 0)
+    {
+      uint64_t interval = begin >> index->min_shift;
+      min_offset = (interval < reference->intervals_len)
+                   ? reference->intervals[interval]
+                   : reference->intervals[reference->intervals_len - 1];
+    }
+  else if (index->is_csi)
+    {
+      first_bin = ((1ULL << (index->depth * 3)) - 1) / 7;
+      for (level = index->depth, shift = index->min_shift;
+           level >= 0;
+           level--, shift += 3)
+        {
+          struct nsv_index_bin_t *bin;
+          bin = nsv_index_find_bin (reference, first_bin + (begin >> shift));
+          if (bin != NULL)
+            {
+              min_offset = bin->loffset;
+              break;
+            }
+
+          first_bin = (first_bin - 1) >> 3;
+        }
+    }
+
+  /* Collect the chunks of every bin that overlaps the region, one level
+   * at a time, starting at the root. */
+  GArray *chunks = g_array_new (FALSE, FALSE,
+                                sizeof (struct nsv_index_chunk_t));
+  first_bin = 0;
+  shift = index->min_shift + index->depth * 3;
+  for (level = 0; level <= index->depth; level++, shift -= 3)
+    {
+      uint32_t bin_number;
+      for (bin_number = first_bin + (begin >> shift);
+           bin_number <= first_bin + ((end - 1) >> shift);
+           bin_number++)
+        {
+          struct nsv_index_bin_t *bin;
+          bin = nsv_index_find_bin (reference, bin_number);
+          if (bin == NULL)
+            continue;
+
+          uint32_t chunk_index;
+          for (chunk_index = 0; chunk_index < bin->chunks_len; chunk_index++)
+            if (bin->chunks[chunk_index].end > min_offset)
+              g_array_append_val (chunks, bin->chunks[chunk_index]);
+        }
+
+      first_bin += 1ULL << (level * 3);
+    }
+
+  if (chunks->len == 0)
+    {
+      g_array_free (chunks, TRUE);
+      return NULL;
+    }
+
+  /* Merge overlapping and adjacent chunks. */
+  g_array_sort (chunks, nsv_index_chunk_compare);
+  uint32_t chunks_total = chunks->len;
+  struct nsv_index_chunk_t *output;
+  output = (struct nsv_index_chunk_t *)g_array_free (chunks, FALSE);
+
+  uint32_t merged = 0;
+  uint32_t chunk_index;
+  for (chunk_index = 1; chunk_index < chunks_total; chunk_index++)
+    {
+      if (output[chunk_index].begin <= output[merged].end)
+        {
+          if (output[chunk_index].end > output[merged].end)
+            output[merged].end = output[chunk_index].end;
+        }
+      else
+        output[++merged] = output[chunk_index];
+    }
+
+  *chunks_len = merged + 1;
+  return output;
+}
+
+void
+nsv_index_destroy (struct nsv_index_t *index)
+{
+  if (index == NULL)
+    return;
+
+  int32_t reference_index;
+  for (reference_index = 0;
+       reference_index < index->references_len;
+       reference_index++)
+    {
+      struct nsv_index_reference_t *reference;
+      reference = &(index->references[reference_index]);
+
+      uint32_t bin_index;
+      for (bin_index = 0; bin_index < reference->bins_len; bin_index++)
+        free (reference->bins[bin_index].chunks);
+
+      free (reference->bins);
+      free (reference->intervals);
+    }
+
+  free (index->references);
+  free (index);
+}
@@ -31,7 +31,13 @@
 #include "breakpoint.h"
 #include "segment.h"
 #include "read.h"
+#include "contig.h"
 #include "trie.h"
+#include "arena.h"
+#include "segments.h"
+#include "cigar.h"
+#include "filter.h"
+#include "cluster.h"
 
 /* Program-wide configuration variables.  Do not assign new values to these
  * variables.  These variables can be updated at run-time with command-line
@@ -48,17 +54,62 @@ static void
 show_help ()
 {
   puts ("\nAvailable options:\n"
-        " --max-threads, -m   Maximum number of threads to use.\n"
+        " --max-threads, -t   Maximum number of threads to use.\n"
         " --split,       -s   Maximum number of segments per read.\n"
         " --distance,    -d   Maximum distance to cluster SVs together.\n"
+        " --cluster,     -n   Minimum number of breakpoints in a cluster.\n"
         " --min-pid,     -p   Minimum percentage identity to reference.\n"
+        " --zero-copy,   -Z   Keep input chunks in memory instead of copying\n"
+        "                     the fields of each segment.\n"
+        " --grouped,     -g   Process each read as soon as it is complete.\n"
+        "                     The input must be grouped by read name, and\n"
+        "                     breakpoints are not clustered.\n"
+        " --sa-tag,      -a   Take the alignments of a read from the SA tag\n"
+        "                     of its primary record.  The input does not\n"
+        "                     need to be grouped, but breakpoints are not\n"
+        "                     clustered either.\n"
+        " --indexed,     -i   Read a sorted and indexed BAM file in parallel\n"
+        "                     regions.\n"
+        " --region,      -R   Only use segments in chr, chr:start or\n"
+        "                     chr:start-end.  Implies --indexed.\n"
+        " --huge-pages,  -H   Back the memory of segments, reads and\n"
+        "                     breakpoints with transparent huge pages.\n"
+        " --filter,      -F   Only use segments that pass all clauses of an\n"
+        "                     expression like 'flag & 0x500 == 0 &&\n"
+        "                     length >= 1000 && [NM] <= 100'.\n"
+        " --prefilter,   -P   Read the input twice, and skip the reads with\n"
+        "                     a single alignment the second time.\n"
         " --file,        -f   A valid path to a session file.\n"
         " --log-file     -l   A log file to store the program's output.\n"
         " --version,     -v   Show versioning information.\n"
         " --help,        -h   Show this message.\n");
 }
 
-void
+/* The state of breakpoints_from_grouped_read.  The array is emptied for
+ * each read, so that its memory is reused. */
+struct grouped_breakpoints_t
+{
+  GArray *breakpoints;
+  uint32_t count;
+};
+
+/* This function is called for each read in --grouped mode.  The read is
+ * removed from memory after this function returns, so its breakpoints are
+ * dealt with right away. */
+static bool
+breakpoints_from_grouped_read (struct nsv_read_t *read_obj, void *user_data)
+{
+  struct grouped_breakpoints_t *grouped = user_data;
+
+  g_array_set_size (grouped->breakpoints, 0);
+  if (!nsv_breakpoints_from_read (read_obj, grouped->breakpoints))
+    return false;
+
+  grouped->count += grouped->breakpoints->len;
+  return true;
+}
+
+bool
 parse_sam_output (char *filename)
 {
   infra_logger_log (nsv_config.logger, LOG_INFO, "Parsing '%s'\n", filename);
@@ -69,55 +120,138 @@ parse_sam_output (char *filename)
       infra_logger_log (nsv_config.logger, LOG_ERROR,
                         "Could not determine the file extension of '%s'\n",
                         filename);
-      return;
+      return false;
     }
 
   /* Skip the dot. */
   extension++;
 
-  GList *reads_list;
-  if (!strcmp (extension, "sam"))
-    reads_list = nsv_reads_from_sam (filename);
-  else if (!strcmp (extension, "bam"))
-    reads_list = nsv_reads_from_bam (filename);
-  else
+  bool is_bam = !strcmp (extension, "bam");
+  if (!is_bam && strcmp (extension, "sam"))
     {
       infra_logger_log (nsv_config.logger, LOG_ERROR,
                         "Unsupported file extension for '%s'\n",
                         filename);
-      return;
+      return false;
     }
 
-  if (reads_list == NULL)
-    return;
+  /* Segments refer to reference sequences by their index in this
+   * dictionary. */
+  struct nsv_contigs_t *contigs = nsv_contigs_new ();
+  if (contigs == NULL)
+    return false;
 
-  GList *breakpoints_list = NULL;
-  while (reads_list->next != NULL)
+  bool use_index = (nsv_config.indexed || nsv_config.region != NULL);
+  if (use_index && (!is_bam || nsv_config.grouped || nsv_config.sa_tag))
     {
-      struct nsv_read_t *read_obj = reads_list->data;
-      if (read_obj == NULL)
-        {
-          reads_list = reads_list->next;
-          continue;
-        }
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "--region and --indexed need a sorted and indexed "
+                        "BAM file, and cannot be combined with --grouped "
+                        "or --sa-tag.\n");
+      nsv_contigs_destroy (contigs);
+      return false;
+    }
+
+  /* When the input is grouped by qname, each read is processed as soon as
+   * it is complete, so that only one read is kept in memory.  With
+   * --sa-tag, a read is complete after its primary record, regardless of
+   * how the input is sorted. */
+  if (nsv_config.grouped || nsv_config.sa_tag)
+    {
+      struct grouped_breakpoints_t grouped;
+      grouped.breakpoints = g_array_new (FALSE, FALSE,
+                                         sizeof (struct nsv_breakpoint_t));
+      grouped.count = 0;
+
+      bool success = (is_bam)
+        ? nsv_reads_foreach_in_bam (filename, contigs,
+                                    breakpoints_from_grouped_read, &grouped)
+        : nsv_reads_foreach_in_sam (filename, contigs,
+                                    breakpoints_from_grouped_read, &grouped);
+
+      /* The breakpoints of a read are gone once the next read is
+       * processed, so they cannot be clustered. */
+      if (success)
+        infra_logger_log (nsv_config.logger, LOG_INFO,
+                          "Found %u breakpoints, which are not clustered "
+                          "with --grouped or --sa-tag.\n", grouped.count);
+
+      g_array_free (grouped.breakpoints, TRUE);
+      nsv_contigs_destroy (contigs);
+      return success;
+    }
+
+  /* The segments, reads and breakpoints all live until the end of the
+   * run, so they are allocated from an arena and freed in one go. */
+  struct nsv_arena_t *arena = nsv_arena_new ();
+  if (arena == NULL)
+    {
+      nsv_contigs_destroy (contigs);
+      return false;
+    }
 
-      /* Gather a list of breakpoints.  Unfortunately, this isn't all
-       * "functional programming perfect", so we let the callback function
-       * add to the new list.*/
-      g_list_foreach (read_obj->segments,
-                      &nsv_breakpoints_from_read,
-                      (void *)&breakpoints_list);
+  /* An empty list is a valid result when no read passes the filters. */
+  GList *reads_list;
+  bool success;
+  if (use_index)
+    reads_list = nsv_reads_from_bam_index (filename, contigs,
+                                           nsv_config.region, arena,
+                                           &success);
+  else
+    reads_list = (is_bam)
+      ? nsv_reads_from_bam (filename, contigs, arena, &success)
+      : nsv_reads_from_sam (filename, contigs, arena, &success);
 
-      reads_list = reads_list->next;
+  if (reads_list == NULL)
+    {
+      nsv_arena_destroy (arena);
+      nsv_contigs_destroy (contigs);
+      return success;
     }
 
   infra_logger_log (nsv_config.logger, LOG_INFO,
-                    "Found %d breakpoints.\n",
-                    g_list_length (breakpoints_list));
+                    "Found %u reference sequences.\n",
+                    nsv_contigs_count (contigs));
+
+  /* The breakpoints are found from a columnar copy of the segments'
+   * properties, which is scanned without following the lists of the
+   * reads. */
+  GArray *breakpoints = g_array_new (FALSE, FALSE,
+                                     sizeof (struct nsv_breakpoint_t));
+  struct nsv_segments_t *segments = nsv_segments_from_reads (reads_list);
+  success = (segments != NULL);
+  if (success)
+    {
+      nsv_segments_sort_by_clip (segments);
+      success = nsv_breakpoints_from_segments (segments, breakpoints);
+      nsv_segments_destroy (segments);
+    }
+
+  /* The clusters refer to the breakpoints, and through them to the
+   * segments, so they are removed before either of them. */
+  struct nsv_clusters_t *clusters = NULL;
+  if (success)
+    {
+      infra_logger_log (nsv_config.logger, LOG_INFO,
+                        "Found %u breakpoints.\n", breakpoints->len);
+
+      clusters = nsv_clusters_from_breakpoints (breakpoints);
+      success = (clusters != NULL);
+    }
+
+  if (success)
+    infra_logger_log (nsv_config.logger, LOG_INFO,
+                      "Found %u clusters.\n", clusters->length);
+
+  nsv_clusters_destroy (clusters);
 
-  /* TODO: Free the breakpoints and the reads.. */
-  g_list_free_full (breakpoints_list, nsv_breakpoint_destroy);
-  g_list_free_full (reads_list, nsv_read_destroy);
+  /* The reads and segments are in the arena, and the breakpoints in a
+   * single array, so only the containers are freed. */
+  g_array_free (breakpoints, TRUE);
+  g_list_free (reads_list);
+  nsv_arena_destroy (arena);
+  nsv_contigs_destroy (contigs);
+  return success;
 }
   
 int
@@ -133,9 +267,14 @@ main (int argc, char **argv)
       return 1;
     }
 
+  /* Pick the CIGAR kernel before any threads are started. */
+  nsv_cigar_init ();
+
   int32_t arg = 0;
   int32_t index = 0;
   char *z_option = NULL;
+  char *filter_option = NULL;
+  bool cluster_option = false;
 
   /*----------------------------------------------------------------------.
    | OPTIONS                                                              |
@@ -154,6 +293,14 @@ main (int argc, char **argv)
     { "min-mapq",          required_argument, 0, 'm' },
     { "file",              required_argument, 0, 'f' },
     { "log-file",          required_argument, 0, 'l' },
+    { "zero-copy",         no_argument,       0, 'Z' },
+    { "grouped",           no_argument,       0, 'g' },
+    { "sa-tag",            no_argument,       0, 'a' },
+    { "indexed",           no_argument,       0, 'i' },
+    { "region",            required_argument, 0, 'R' },
+    { "huge-pages",        no_argument,       0, 'H' },
+    { "filter",            required_argument, 0, 'F' },
+    { "prefilter",         no_argument,       0, 'P' },
     { "help",              no_argument,       0, 'h' },
     { "version",           no_argument,       0, 'v' },
     { "test",              no_argument,       0, 'z' },
@@ -163,27 +310,61 @@ main (int argc, char **argv)
   while (arg != -1)
     {
       /* Make sure to list all short options in the string below. */
-      arg = getopt_long (argc, argv, "t:s:d:p:r:w:n:m:f:l:z:vh", options, &index);
+      arg = getopt_long (argc, argv, "t:s:d:p:r:w:n:m:f:l:z:R:F:ZgaiHPvh", options, &index);
       switch (arg)
         {
         case 't': nsv_config.max_threads = atoi (optarg); break;
         case 's': nsv_config.max_split = atoi (optarg); break;
-        case 'd': break;
+        case 'd':
+          nsv_config.cluster_distance = atoi (optarg);
+          cluster_option = true;
+          break;
         case 'p': nsv_config.min_identity = atof (optarg); break;
         case 'r': break;
         case 'w': nsv_config.max_window_size = atoi (optarg); break;
-        case 'n': break;
+        case 'n':
+          nsv_config.cluster_count = atoi (optarg);
+          cluster_option = true;
+          break;
         case 'm': nsv_config.min_map_quality = atof (optarg); break;
         case 'f': break;
         case 'l': nsv_config.logger = infra_logger_new (optarg); break;
+        case 'Z': nsv_config.zero_copy = true; break;
+        case 'g': nsv_config.grouped = true; break;
+        case 'a': nsv_config.sa_tag = true; break;
+        case 'i': nsv_config.indexed = true; break;
+        case 'R': nsv_config.region = optarg; break;
+        case 'H': nsv_config.huge_pages = true; break;
+        case 'F': filter_option = optarg; break;
+        case 'P': nsv_config.prefilter = true; break;
         case 'z': z_option = optarg; break;
         case 'v': show_version (); break;
         case 'h': show_help (); break;
         }
     }
 
+  /* Reads are processed one at a time with --grouped and --sa-tag, so
+   * their breakpoints are never clustered. */
+  if (cluster_option && (nsv_config.grouped || nsv_config.sa_tag))
+    {
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "--distance and --cluster cannot be combined with "
+                        "--grouped or --sa-tag.\n");
+      return 1;
+    }
+
+  /* The filter expression is compiled once, before any input is read. */
+  if (filter_option != NULL
+      && (nsv_config.filter = nsv_filter_compile (filter_option)) == NULL)
+    return 1;
+
+  /* A malformed input file fails the run, rather than reporting the
+   * breakpoints of the part that could be read. */
+  bool success = true;
   if (z_option != NULL)
-    parse_sam_output (z_option);
+    success = parse_sam_output (z_option);
+
+  nsv_filter_destroy (nsv_config.filter);
 
   #ifdef ENABLE_MTRACE
   muntrace ();
@@ -192,5 +373,5 @@ main (int argc, char **argv)
   if (nsv_config.logger)
     infra_logger_destroy (nsv_config.logger);
 
-  return 0;
+  return (success) ? 0 : 1;
 }
@@ -25,5 +25,15 @@ struct nsv_config_t nsv_config = {
   .max_window_size = 1000,
   .min_map_quality = 80,
   .min_identity = 0.80,
+  .cluster_distance = 10,
+  .cluster_count = 2,
+  .zero_copy = false,
+  .grouped = false,
+  .indexed = false,
+  .sa_tag = false,
+  .huge_pages = false,
+  .prefilter = false,
+  .region = NULL,
+  .filter = NULL,
   .logger = NULL
 };
@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "qnames.h"
+#include "nanosvc.h"
+
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+/* The smallest number of slots.  The table doubles in size when more than
+ * 7 out of 8 slots would be in use. */
+#define NSV_QNAMES_MIN_CAPACITY 64
+
+static inline uint64_t
+nsv_qnames_mix (uint64_t value)
+{
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ULL;
+  value ^= value >> 33;
+  return value;
+}
+
+/* Hashes 'length' bytes of 'key', eight bytes at a time.  Qnames are
+ * usually 36-character UUIDs, which takes five rounds. */
+uint64_t
+nsv_qnames_hash (const char *key, size_t length)
+{
+  uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+  uint64_t word;
+
+  while (length >= 8)
+    {
+      memcpy (&word, key, 8);
+      hash = (hash ^ nsv_qnames_mix (word)) * 0x9e3779b97f4a7c15ULL;
+      key += 8;
+      length -= 8;
+    }
+
+  word = 0;
+  memcpy (&word, key, length);
+  hash = (hash ^ nsv_qnames_mix (word)) * 0x9e3779b97f4a7c15ULL;
+
+  return nsv_qnames_mix (hash);
+}
+
+/* The value of each lowercase hexadecimal digit.  Other characters have
+ * the 0x10 bit set, so that they can be detected after a whole group of
+ * digits is read. */
+#define NSV_QNAME_NOT_HEX16 \
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, \
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+
+static const uint8_t nsv_qname_hex_values[256] = {
+  NSV_QNAME_NOT_HEX16, NSV_QNAME_NOT_HEX16, NSV_QNAME_NOT_HEX16,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+  0x08, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  NSV_QNAME_NOT_HEX16, NSV_QNAME_NOT_HEX16,
+  0x10, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+  NSV_QNAME_NOT_HEX16, NSV_QNAME_NOT_HEX16, NSV_QNAME_NOT_HEX16,
+  NSV_QNAME_NOT_HEX16, NSV_QNAME_NOT_HEX16, NSV_QNAME_NOT_HEX16,
+  NSV_QNAME_NOT_HEX16, NSV_QNAME_NOT_HEX16, NSV_QNAME_NOT_HEX16
+};
+
+/* Appends 'length' hexadecimal digits to 'word', and records whether any
+ * of them was not a digit in 'invalid'. */
+static inline uint64_t
+nsv_qname_hex_group (uint64_t word, const char *digits, uint32_t length,
+                     uint8_t *invalid)
+{
+  uint32_t index;
+  for (index = 0; index < length; index++)
+    {
+      uint8_t value = nsv_qname_hex_values[(uint8_t)digits[index]];
+      *invalid |= value;
+      word = (word << 4) | (value & 0x0f);
+    }
+
+  return word;
+}
+
+void
+nsv_qname_init (struct nsv_qname_t *key, const char *qname)
+{
+  /* Only the lowercase form is encoded, so that the UUID can be written
+   * back out exactly as it was read. */
+  size_t length = strnlen (qname, NSV_QNAME_UUID_LEN + 1);
+  if (length == NSV_QNAME_UUID_LEN
+      && qname[8] == '-' && qname[13] == '-'
+      && qname[18] == '-' && qname[23] == '-')
+    {
+      uint8_t invalid = 0;
+      uint64_t high = nsv_qname_hex_group (0, qname, 8, &invalid);
+      high = nsv_qname_hex_group (high, qname + 9, 4, &invalid);
+      high = nsv_qname_hex_group (high, qname + 14, 4, &invalid);
+
+      uint64_t low = nsv_qname_hex_group (0, qname + 19, 4, &invalid);
+      low = nsv_qname_hex_group (low, qname + 24, 12, &invalid);
+
+      if (!(invalid & 0x10))
+        {
+          key->words[0] = high;
+          key->words[1] = low;
+          key->name = NULL;
+          return;
+        }
+    }
+
+  if (length > NSV_QNAME_UUID_LEN)
+    length = strlen (qname);
+
+  key->words[0] = nsv_qnames_hash (qname, length);
+  key->words[1] = length;
+  key->name = qname;
+}
+
+bool
+nsv_qname_equal (const struct nsv_qname_t *a, const struct nsv_qname_t *b)
+{
+  if (a->words[0] != b->words[0] || a->words[1] != b->words[1])
+    return false;
+
+  if (a->name == NULL || b->name == NULL)
+    return (a->name == b->name);
+
+  return !memcmp (a->name, b->name, a->words[1]);
+}
+
+const char *
+nsv_qname_string (const struct nsv_qname_t *key, char *buffer)
+{
+  if (key->name != NULL)
+    return key->name;
+
+  snprintf (buffer, NSV_QNAME_UUID_LEN + 1,
+            "%08" PRIx64 "-%04" PRIx64 "-%04" PRIx64 "-%04" PRIx64
+            "-%012" PRIx64,
+            key->words[0] >> 32, (key->words[0] >> 16) & 0xffff,
+            key->words[0] & 0xffff, key->words[1] >> 48,
+            key->words[1] & (uint64_t)0xffffffffffff);
+
+  return buffer;
+}
+
+/* The hash of a string key is stored in the key.  A UUID is random
+ * already, but its two halves are mixed to spread the bits. */
+static inline uint64_t
+nsv_qname_hash (const struct nsv_qname_t *key)
+{
+  if (key->name != NULL)
+    return key->words[0];
+
+  return nsv_qnames_mix (key->words[0] ^ nsv_qnames_mix (key->words[1]));
+}
+
+/* Returns the slot that holds 'key', or the empty slot where it belongs. */
+static inline struct nsv_qnames_slot_t *
+nsv_qnames_probe (struct nsv_qnames_slot_t *slots, uint32_t capacity,
+                  const struct nsv_qname_t *key)
+{
+  uint32_t mask = capacity - 1;
+  uint32_t index = nsv_qname_hash (key) & mask;
+
+  /* The table is never full, so this ends at an empty slot. */
+  while (slots[index].element != NULL
+         && !nsv_qname_equal (&(slots[index].key), key))
+    index = (index + 1) & mask;
+
+  return &(slots[index]);
+}
+
+static bool
+nsv_qnames_resize (struct nsv_qnames_t *qnames, uint32_t capacity)
+{
+  struct nsv_qnames_slot_t *slots;
+  slots = calloc (capacity, sizeof (struct nsv_qnames_slot_t));
+  if (slots == NULL)
+    return false;
+
+  /* The stored hashes are reused, so the keys are not read again. */
+  uint32_t index;
+  for (index = 0; index < qnames->capacity; index++)
+    {
+      struct nsv_qnames_slot_t *slot = &(qnames->slots[index]);
+      if (slot->element == NULL)
+        continue;
+
+      uint32_t position = nsv_qname_hash (&(slot->key)) & (capacity - 1);
+      while (slots[position].element != NULL)
+        position = (position + 1) & (capacity - 1);
+
+      slots[position] = *slot;
+    }
+
+  free (qnames->slots);
+  qnames->slots = slots;
+  qnames->capacity = capacity;
+  return true;
+}
+
+struct nsv_qnames_t *
+nsv_qnames_new (uint32_t capacity)
+{
+  struct nsv_qnames_t *qnames = calloc (1, sizeof (struct nsv_qnames_t));
+  if (qnames == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  /* Round up to a power of two that keeps the load below 7/8. */
+  uint32_t slots = NSV_QNAMES_MIN_CAPACITY;
+  while (slots < capacity + capacity / 7 + 1 && slots < (1U << 31))
+    slots <<= 1;
+
+  if (!nsv_qnames_resize (qnames, slots))
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      free (qnames);
+      return NULL;
+    }
+
+  return qnames;
+}
+
+bool
+nsv_qnames_insert (struct nsv_qnames_t *qnames,
+                   const struct nsv_qname_t *qname, void *element)
+{
+  if (qnames == NULL || qname == NULL || element == NULL)
+    return false;
+
+  if ((uint64_t)(qnames->count + 1) * 8 > (uint64_t)qnames->capacity * 7
+      && !nsv_qnames_resize (qnames, qnames->capacity * 2))
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return false;
+    }
+
+  struct nsv_qnames_slot_t *slot;
+  slot = nsv_qnames_probe (qnames->slots, qnames->capacity, qname);
+
+  if (slot->element == NULL)
+    {
+      /* The name is borrowed from the caller. */
+      slot->key = *qname;
+      qnames->count++;
+    }
+
+  slot->element = element;
+  return true;
+}
+
+void *
+nsv_qnames_find (struct nsv_qnames_t *qnames,
+                 const struct nsv_qname_t *qname)
+{
+  if (qnames == NULL || qname == NULL)
+    return NULL;
+
+  struct nsv_qnames_slot_t *slot;
+  slot = nsv_qnames_probe (qnames->slots, qnames->capacity, qname);
+
+  return slot->element;
+}
+
+uint32_t
+nsv_qnames_count (struct nsv_qnames_t *qnames)
+{
+  return (qnames == NULL) ? 0 : qnames->count;
+}
+
+void
+nsv_qnames_destroy (struct nsv_qnames_t *qnames)
+{
+  if (qnames == NULL)
+    return;
+
+  free (qnames->slots);
+  free (qnames);
+}
+
+/* The number of bits a qname sets in a Bloom filter, and the number of
+ * bits per qname.  Together, they give about one false positive in 50. */
+#define NSV_QNAMES_BLOOM_HASHES 6
+#define NSV_QNAMES_BLOOM_BITS   12
+
+struct nsv_qnames_bloom_t *
+nsv_qnames_bloom_new (const uint64_t *hashes, size_t hashes_len)
+{
+  struct nsv_qnames_bloom_t *bloom = malloc (sizeof (*bloom));
+  if (bloom == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  /* Each block is a cache line of 512 bits. */
+  size_t blocks_len = 1;
+  while (blocks_len * 512 < hashes_len * NSV_QNAMES_BLOOM_BITS)
+    blocks_len *= 2;
+
+  bloom->blocks = calloc (blocks_len * 8, sizeof (uint64_t));
+  if (bloom->blocks == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      free (bloom);
+      return NULL;
+    }
+
+  bloom->blocks_mask = blocks_len - 1;
+
+  size_t index;
+  for (index = 0; index < hashes_len; index++)
+    {
+      uint64_t *block = bloom->blocks
+                        + (hashes[index] & bloom->blocks_mask) * 8;
+      uint64_t bits = nsv_qnames_mix (hashes[index]);
+      uint32_t hash;
+      for (hash = 0; hash < NSV_QNAMES_BLOOM_HASHES; hash++, bits >>= 9)
+        block[(bits >> 6) & 7] |= 1ULL << (bits & 63);
+    }
+
+  return bloom;
+}
+
+bool
+nsv_qnames_bloom_find (const struct nsv_qnames_bloom_t *bloom, uint64_t hash)
+{
+  const uint64_t *block = bloom->blocks + (hash & bloom->blocks_mask) * 8;
+  uint64_t bits = nsv_qnames_mix (hash);
+  uint32_t index;
+  for (index = 0; index < NSV_QNAMES_BLOOM_HASHES; index++, bits >>= 9)
+    if (!(block[(bits >> 6) & 7] & (1ULL << (bits & 63))))
+      return false;
+
+  return true;
+}
+
+void
+nsv_qnames_bloom_destroy (struct nsv_qnames_bloom_t *bloom)
+{
+  if (bloom == NULL)
+    return;
+
+  free (bloom->blocks);
+  free (bloom);
+}
@@ -23,20 +23,34 @@
 #include <stdbool.h>
 
 #include "read.h"
+#include "bam.h"
+#include "index.h"
+#include "stream.h"
 #include "segment.h"
 #include "nanosvc.h"
-#include "trie.h"
+#include "qnames.h"
+#include "filter.h"
 
 #include <libinfra/logger.h>
 #include <libinfra/timer.h>
 
+/* The number of bases a single worker reads at a time from an indexed BAM
+ * file. */
+#define NSV_READS_TILE_SIZE (16 * 1024 * 1024)
+
 extern struct nsv_config_t nsv_config;
 
 struct nsv_read_t *
 nsv_read_new (void)
+{
+  return nsv_read_new_in_arena (NULL);
+}
+
+struct nsv_read_t *
+nsv_read_new_in_arena (struct nsv_arena_t *arena)
 {
   struct nsv_read_t *read;
-  read = calloc (1, sizeof (struct nsv_read_t));
+  read = nsv_arena_alloc0 (arena, sizeof (struct nsv_read_t));
   if (read == NULL)
     {
       infra_logger_error_alloc (nsv_config.logger);
@@ -44,6 +58,7 @@ nsv_read_new (void)
     }
 
   read->type = NSVC_OBJ_READ;
+  read->in_arena = (arena != NULL);
   return read;
 }
 
@@ -57,180 +72,1350 @@ nsv_read_add_segment (struct nsv_read_t *read, struct nsv_segment_t *segment)
   return TRUE;
 }
 
-bool
-nsv_reads_from_stream (FILE *stream, GList **output_ptr)
+/* Prepends 'segment' to the segments of 'read_obj'.  In an arena, the link
+ * is allocated from the arena as well, so that it goes with the arena. */
+static bool
+nsv_read_link_segment (struct nsv_read_t *read_obj,
+                       struct nsv_segment_t *segment,
+                       struct nsv_arena_t *arena)
 {
-  if (output_ptr == NULL)
-    return FALSE;
+  if (arena == NULL)
+    {
+      read_obj->segments = g_list_prepend (read_obj->segments, segment);
+      return true;
+    }
 
-  /* We will store the list of segments in this variable. */
-  GList *output = *output_ptr;
+  GList *link = nsv_arena_alloc (arena, sizeof (GList));
+  if (link == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return false;
+    }
 
-  /* Do some accounting for the segment parsing. */
-  uint32_t filtered_count = 0;
-  uint32_t added_count = 0;
+  link->data = segment;
+  link->prev = NULL;
+  link->next = read_obj->segments;
+  if (link->next != NULL)
+    link->next->prev = link;
 
-  /* This trie will index the qname values of reads so that a read can be
-   * found quickly. */
-  struct trie_node_t *trie = trie_new ();
-  if (trie == NULL)
-    goto allocation_error_handler;
+  read_obj->segments = link;
+  return true;
+}
+
+/* This data structure holds the state that is shared between consecutive
+ * calls to 'nsv_reads_add_segment'.
+ *
+ * Reads are either collected in 'output', with a hash index to find them
+ * by qname, or, for input that is grouped by qname, handed to 'callback' as
+ * soon as the qname changes.  In the latter case, only 'current' is kept
+ * in memory.
+ *
+ * When 'arena' is set, reads and segments are allocated from it, and
+ * segments that are filtered out right after parsing give their memory
+ * back.  Records that 'filter' rejects do not get a segment at all. */
+struct nsv_reads_state_t
+{
+  GList *output;
+  struct nsv_qnames_t *qnames;
+  struct nsv_read_t *current;
+  nsv_read_callback_t callback;
+  void *user_data;
+  struct nsv_contigs_t *contigs; /* Set to add the alignments in SA tags. */
+  struct nsv_arena_t *arena;    /* The arena to allocate from, or NULL. */
+  struct nsv_segment_filter_t filter;
+  uint32_t filtered_count;
+  uint32_t added_count;
+  uint32_t clause_counts[NSV_FILTER_MAX_CLAUSES]; /* See nsv_filter_keep. */
+};
+
+/* Sets up the part of the filters in nsv_reads_keep_segment that can be
+ * applied to the raw FLAG, MAPQ and CIGAR of a record.  It rejects a
+ * subset of the records that nsv_reads_keep_segment rejects, so applying
+ * it first does not change the result. */
+static void
+nsv_reads_filter_init (struct nsv_segment_filter_t *filter)
+{
+  filter->rejected_count = 0;
+  filter->members = NULL;
+
+  /* With --sa-tag, a primary record that fails the filters can still have
+   * other alignments in its SA tag that pass them. */
+  if (nsv_config.sa_tag)
+    {
+      filter->flags = 0x100 | 0x800;
+      filter->min_mapq = 0;
+      filter->reject_unavailable = false;
+      filter->require_clip = false;
+      return;
+    }
+
+  filter->flags = 0x4;
+  filter->min_mapq = (nsv_config.min_map_quality > 255)
+                     ? 255
+                     : nsv_config.min_map_quality;
+  filter->reject_unavailable = true;
+  filter->require_clip = true;
+}
+
+static bool
+nsv_reads_state_init (struct nsv_reads_state_t *state, GList *output,
+                      nsv_read_callback_t callback, void *user_data,
+                      struct nsv_arena_t *arena)
+{
+  state->output = output;
+  state->qnames = NULL;
+  state->current = NULL;
+  state->callback = callback;
+  state->user_data = user_data;
+  state->contigs = NULL;
+  state->arena = arena;
+  nsv_reads_filter_init (&(state->filter));
+  state->filtered_count = 0;
+  state->added_count = 0;
+  memset (state->clause_counts, 0, sizeof (state->clause_counts));
+
+  if (callback != NULL)
+    return true;
+
+  /* This index maps the qname values to reads so that a read can be found
+   * quickly. */
+  state->qnames = nsv_qnames_new (0);
+  return (state->qnames != NULL);
+}
+
+/* Hands the current read to the callback, and removes it from memory. */
+static bool
+nsv_reads_state_flush (struct nsv_reads_state_t *state)
+{
+  struct nsv_read_t *read_obj = state->current;
+  if (read_obj == NULL)
+    return true;
+
+  state->current = NULL;
+  bool success = state->callback (read_obj, state->user_data);
+  nsv_read_destroy (read_obj);
+
+  return success;
+}
+
+static void
+nsv_reads_state_clear (struct nsv_reads_state_t *state)
+{
+  nsv_qnames_destroy (state->qnames);
+  state->qnames = NULL;
+
+  if (state->current != NULL)
+    nsv_read_destroy (state->current);
+  state->current = NULL;
+
+  g_list_free_full (state->output, nsv_read_destroy);
+  state->output = NULL;
+}
+
+/* Adds the counts of the --filter clauses of a worker to 'state'. */
+static void
+nsv_reads_add_clause_counts (struct nsv_reads_state_t *state,
+                             const uint32_t *clause_counts)
+{
+  uint32_t index;
+  for (index = 0; index < NSV_FILTER_MAX_CLAUSES; index++)
+    state->clause_counts[index] += clause_counts[index];
+}
+
+/* Returns false for segments that cannot be used to detect structural
+ * variation, or that do not pass the --filter expression.  The clause that
+ * rejects a segment is counted in 'clause_counts'.  This function does not
+ * modify any shared state, so it can be called from multiple threads at
+ * once. */
+static bool
+nsv_reads_keep_alignment (struct nsv_segment_t *segment,
+                          uint32_t *clause_counts)
+{
+  /* Filter/remove unmapped and low map quality segments.
+   *
+   * When the 0x4 flag is set, the region is unmapped, and we cannot make
+   * any assumptions about the mapping quality.  We filter these segments
+   * out.
+   *
+   * According to the SAMv1 specification, a value of 255 indicates that
+   * the mapping quality is not available.  We therefore filter these out
+   * too.
+   *
+   * At run-time, the user can set the minimum map quality value.  Anything
+   * lower than this value will be filtered too.
+   *
+   * Other conditions can be added with --filter, see filter.h.
+   **/
+  if (segment->flag & 0x4
+      || segment->mapq < nsv_config.min_map_quality
+      || segment->mapq == 255
+      || nsv_segment_cigar_pid (segment) < nsv_config.min_identity)
+    return false;
+
+  /* When a segment does not have a clipping point, then we cannot
+   * use it to detect structural variation. */
+  if (nsv_segment_cigar_first_clip (segment) == -1)
+    return false;
+
+  return nsv_filter_keep (nsv_config.filter, segment, clause_counts);
+}
+
+/* Removes a segment that was filtered out right after it was parsed.  As
+ * it is the last object in 'arena', its memory can be reused. */
+static void
+nsv_reads_drop_segment (struct nsv_arena_t *arena,
+                        struct nsv_segment_t *segment)
+{
+  if (arena != NULL)
+    nsv_arena_free_from (arena, segment);
+  else
+    nsv_segment_destroy (segment);
+}
+
+/* Like nsv_reads_keep_alignment, but for records in the input.  With
+ * --sa-tag, the alignments of secondary and supplementary records are
+ * taken from the SA tag of the primary record, so the records themselves
+ * are left out.  Primary records with an SA tag are filtered after their
+ * tag has been read, because their other alignments may pass the filters
+ * when they do not. */
+static bool
+nsv_reads_keep_segment (struct nsv_segment_t *segment,
+                        uint32_t *clause_counts)
+{
+  if (nsv_config.sa_tag)
+    {
+      if (segment->flag & (0x100 | 0x800))
+        return false;
+
+      if (nsv_segment_cold (segment)->sa != NULL)
+        return true;
+    }
+
+  return nsv_reads_keep_alignment (segment, clause_counts);
+}
+
+/* Adds a segment that passed the filters to the read named 'qname'. */
+static bool
+nsv_reads_group_alignment (struct nsv_reads_state_t *state,
+                         struct nsv_segment_t *segment,
+                         const char *qname)
+{
+  struct nsv_qname_t key;
+  nsv_qname_init (&key, qname);
+
+  /* For grouped input, a read is complete when the qname changes. */
+  struct nsv_read_t *read_obj;
+  if (state->callback != NULL)
+    {
+      read_obj = state->current;
+      if (read_obj != NULL && !nsv_qname_equal (&(read_obj->qname), &key))
+        {
+          if (!nsv_reads_state_flush (state))
+            {
+              nsv_segment_destroy (segment);
+              return false;
+            }
+
+          read_obj = NULL;
+        }
+    }
+  else
+    read_obj = nsv_qnames_find (state->qnames, &key);
+
+  /* The qname is only valid until the next segment is parsed, so we make
+   * a copy of it for each new read, which the index borrows.  A UUID is
+   * stored in the key itself. */
+  if (read_obj == NULL)
+    {
+      read_obj = nsv_read_new_in_arena (state->arena);
+      if (read_obj != NULL)
+        {
+          read_obj->qname = key;
+          if (key.name != NULL)
+            read_obj->qname.name = nsv_arena_strndup (state->arena,
+                                                      key.name,
+                                                      key.words[1]);
+        }
+
+      if (read_obj == NULL
+          || (key.name != NULL && read_obj->qname.name == NULL))
+        {
+          if (read_obj != NULL)
+            {
+              infra_logger_error_alloc (nsv_config.logger);
+              nsv_read_destroy (read_obj);
+            }
 
-  char *qname = NULL;
-  struct nsv_segment_t *segment = NULL;
-  while ((segment = nsv_segment_from_stream (stream, &qname)) != NULL)
-    {
-      /* Filter/remove unmapped and low map quality segments.
-       *
-       * When the 0x4 flag is set, the region is unmapped, and we cannot make
-       * any assumptions about the mapping quality.  We filter these segments
-       * out.
-       *
-       * According to the SAMv1 specification, a value of 255 indicates that
-       * the mapping quality is not available.  We therefore filter these out
-       * too.
-       *
-       * At run-time, the user can set the minimum map quality value.  Anything
-       * lower than this value will be filtered too.
-       *
-       * TODO: These filter conditions can be abstracted away as functions,
-       * making the applicability of this function useful to a broader
-       * audience.
-       **/
-      if (segment->flag & 0x4
-          || segment->mapq < nsv_config.min_map_quality
-          || segment->mapq == 255
-          || nsv_segment_cigar_pid (segment) < nsv_config.min_identity)
-        {
-          free (qname);
           nsv_segment_destroy (segment);
-          filtered_count++;
+          return false;
         }
+
+      if (state->callback != NULL)
+        state->current = read_obj;
+      else if (nsv_qnames_insert (state->qnames, &(read_obj->qname),
+                                  read_obj))
+        state->output = g_list_prepend (state->output, read_obj);
       else
         {
-          /* When a segment does not have a clipping point, then we cannot
-           * use it to detect structural variation. */
-          int32_t clip = nsv_segment_cigar_first_clip (segment);
-          if (clip == -1)
+          nsv_read_destroy (read_obj);
+          nsv_segment_destroy (segment);
+          return false;
+        }
+    }
+
+  if (!nsv_read_link_segment (read_obj, segment, state->arena))
+    {
+      nsv_segment_destroy (segment);
+      return false;
+    }
+
+  nsv_segment_cold (segment)->read = read_obj;
+  state->added_count++;
+
+  return true;
+}
+
+/* Adds a segment that passed nsv_reads_keep_segment to the read named
+ * 'qname', along with the alignments in its SA tag when 'state' asks for
+ * them. */
+static bool
+nsv_reads_group_segment (struct nsv_reads_state_t *state,
+                         struct nsv_segment_t *segment,
+                         const char *qname)
+{
+  if (state->contigs == NULL || nsv_segment_cold (segment)->sa == NULL)
+    return nsv_reads_group_alignment (state, segment, qname);
+
+  /* The primary record of a read lists the read's other alignments. */
+  GList *segments = NULL;
+  if (!nsv_segment_sa_segments (segment, state->contigs, state->arena,
+                                &segments))
+    {
+      g_list_free_full (segments, nsv_segment_destroy);
+      nsv_segment_destroy (segment);
+      return false;
+    }
+
+  segments = g_list_prepend (segments, segment);
+
+  bool success = true;
+  GList *iterator;
+  for (iterator = segments; iterator != NULL; iterator = iterator->next)
+    {
+      struct nsv_segment_t *alignment = iterator->data;
+      if (!success)
+        nsv_segment_destroy (alignment);
+      else if (!nsv_reads_keep_alignment (alignment, state->clause_counts))
+        {
+          nsv_segment_destroy (alignment);
+          state->filtered_count++;
+        }
+      else
+        success = nsv_reads_group_alignment (state, alignment, qname);
+    }
+
+  g_list_free (segments);
+  return success;
+}
+
+static bool
+nsv_reads_add_segment (struct nsv_reads_state_t *state,
+                       struct nsv_segment_t *segment,
+                       const char *qname)
+{
+  if (!nsv_reads_keep_segment (segment, state->clause_counts))
+    {
+      nsv_reads_drop_segment (state->arena, segment);
+      state->filtered_count++;
+      return true;
+    }
+
+  return nsv_reads_group_segment (state, segment, qname);
+}
+
+/* A batch is a block of input that is parsed and filtered on a worker
+ * thread.  The segments that pass the filters are grouped into reads on
+ * the calling thread, in input order, so that the result is the same for
+ * any number of threads. */
+struct nsv_reads_batch_t
+{
+  struct nsv_chunk_t *chunk;    /* The chunk that holds the input. */
+  char *data;                   /* The start of the input in 'chunk'. */
+  size_t length;                /* The number of input bytes. */
+
+  GPtrArray *segments;          /* The segments that passed the filters. */
+  GPtrArray *qnames;            /* The qname of each segment. */
+  struct nsv_arena_t *arena;    /* The arena the segments are in, or NULL. */
+  uint32_t filtered_count;      /* The number of segments filtered out. */
+  uint32_t rejected_count;      /* The number of records rejected. */
+  uint32_t clause_counts[NSV_FILTER_MAX_CLAUSES]; /* See nsv_filter_keep. */
+
+  bool failed;                  /* Set when the input could not be parsed. */
+  bool done;                    /* Set when the worker is done. */
+};
+
+/* This data structure is shared by the workers of a parallel parse. */
+struct nsv_reads_parallel_t
+{
+  struct nsv_contigs_t *contigs; /* The dictionary for SAM input. */
+  struct nsv_bam_t *bam;         /* The BAM file, or NULL for SAM input. */
+  const struct nsv_segment_filter_t *filter; /* The filter to reject with. */
+  GThreadPool *pool;
+  GMutex mutex;
+  GCond condition;
+};
+
+static void
+nsv_reads_batch_destroy (struct nsv_reads_batch_t *batch)
+{
+  g_ptr_array_free (batch->segments, TRUE);
+  g_ptr_array_free (batch->qnames, TRUE);
+  nsv_arena_destroy (batch->arena);
+  nsv_chunk_unref (batch->chunk);
+  free (batch);
+}
+
+/* When 'with_arena' is set, the batch gets an arena of its own, so that
+ * the worker that parses it does not share an arena with other threads. */
+static struct nsv_reads_batch_t *
+nsv_reads_batch_new (struct nsv_chunk_t *chunk, char *data, size_t length,
+                     bool with_arena)
+{
+  struct nsv_reads_batch_t *batch = calloc (1, sizeof (*batch));
+  if (batch == NULL)
+    {
+      nsv_chunk_unref (chunk);
+      return NULL;
+    }
+
+  batch->chunk = chunk;
+  batch->data = data;
+  batch->length = length;
+  batch->segments = g_ptr_array_new ();
+  batch->qnames = g_ptr_array_new ();
+
+  if (with_arena && (batch->arena = nsv_arena_new ()) == NULL)
+    {
+      nsv_reads_batch_destroy (batch);
+      return NULL;
+    }
+
+  return batch;
+}
+
+static void
+nsv_reads_batch_keep (struct nsv_reads_batch_t *batch,
+                      struct nsv_segment_t *segment, const char *qname)
+{
+  if (nsv_reads_keep_segment (segment, batch->clause_counts))
+    {
+      g_ptr_array_add (batch->segments, segment);
+      g_ptr_array_add (batch->qnames, (gpointer)qname);
+    }
+  else
+    {
+      nsv_reads_drop_segment (batch->arena, segment);
+      batch->filtered_count++;
+    }
+}
+
+/* This function runs on a worker thread.  It turns the input of a batch
+ * into filtered segments. */
+static void
+nsv_reads_parse_batch (gpointer data, gpointer user_data)
+{
+  struct nsv_reads_batch_t *batch = data;
+  struct nsv_reads_parallel_t *parallel = user_data;
+
+  char *position = batch->data;
+  char *end = batch->data + batch->length;
+  while (position < end && !batch->failed)
+    {
+      const char *qname = NULL;
+      struct nsv_segment_t *segment = NULL;
+
+      if (parallel->bam != NULL)
+        {
+          /* See nsv_bam_read_records for the layout of the chunk. */
+          int32_t record_len;
+          memcpy (&record_len, position, sizeof (int32_t));
+          position += sizeof (int32_t);
+
+          if (nsv_bam_filter_record (parallel->filter,
+                                     (const uint8_t *)position, record_len))
             {
-              free (qname);
-              nsv_segment_destroy (segment);
-              filtered_count++;
+              position += record_len;
+              batch->rejected_count++;
               continue;
             }
 
-          struct nsv_read_t *read_obj = NULL;
-          struct nsv_read_t *trie_element = trie_find (trie, qname);
-          if (trie_element == NULL)
-            {
-              read_obj = nsv_read_new ();
-              if (read_obj == NULL)
-                goto allocation_error_handler;
-
-              read_obj->qname = qname;
-              qname = NULL;
-              trie_insert (trie, read_obj->qname, read_obj);
-              output = g_list_prepend (output, read_obj);
-            }
-          else
+          segment = nsv_bam_decode_record (parallel->bam,
+                                           (const uint8_t *)position,
+                                           record_len, batch->arena,
+                                           NSV_COLUMNS_BREAKPOINT, &qname);
+          position += record_len;
+        }
+      else
+        {
+          char *newline = memchr (position, '\n', end - position);
+          char *line = position;
+          size_t length = ((newline != NULL) ? newline : end) - position;
+          position += length + 1;
+
+          /* Header lines are handled before the input is split up. */
+          if (length == 0 || line[0] == '@')
+            continue;
+
+          if (nsv_segment_filter_line (parallel->filter, line, length))
             {
-              read_obj = trie_element;
-              free (qname);
+              batch->rejected_count++;
+              continue;
             }
 
-          segment->read = read_obj;
-          read_obj->segments = g_list_prepend (read_obj->segments, segment);
-          added_count++;
+          segment = nsv_segment_from_line (line, length,
+                                           (nsv_config.zero_copy)
+                                           ? batch->chunk
+                                           : NULL,
+                                           batch->arena, parallel->contigs,
+                                           NSV_COLUMNS_BREAKPOINT, &qname);
         }
+
+      if (segment == NULL)
+        batch->failed = true;
+      else
+        nsv_reads_batch_keep (batch, segment, qname);
     }
 
-  infra_logger_log (nsv_config.logger, LOG_INFO,
-                    "Parsed %u segments, of which %u were filtered.",
-                    added_count + filtered_count, filtered_count);
+  g_mutex_lock (&(parallel->mutex));
+  batch->done = true;
+  g_cond_broadcast (&(parallel->condition));
+  g_mutex_unlock (&(parallel->mutex));
+}
+
+/* Waits for a batch to be parsed, and moves its segments into reads. */
+static bool
+nsv_reads_merge_batch (struct nsv_reads_state_t *state,
+                       struct nsv_reads_parallel_t *parallel,
+                       struct nsv_reads_batch_t *batch)
+{
+  g_mutex_lock (&(parallel->mutex));
+  while (!batch->done)
+    g_cond_wait (&(parallel->condition), &(parallel->mutex));
+  g_mutex_unlock (&(parallel->mutex));
+
+  bool success = !batch->failed;
+  state->filtered_count += batch->filtered_count;
+  state->filter.rejected_count += batch->rejected_count;
+  nsv_reads_add_clause_counts (state, batch->clause_counts);
+
+  guint index;
+  for (index = 0; index < batch->segments->len; index++)
+    {
+      struct nsv_segment_t *segment;
+      segment = g_ptr_array_index (batch->segments, index);
+
+      /* After a failure, the remaining segments are only cleaned up. */
+      if (success)
+        success = nsv_reads_group_segment (state, segment,
+                                           g_ptr_array_index (batch->qnames,
+                                                              index));
+      else
+        nsv_segment_destroy (segment);
+    }
+
+  /* The segments of the batch live on in reads, even after a failure. */
+  nsv_arena_merge (state->arena, batch->arena);
+  batch->arena = NULL;
+
+  nsv_reads_batch_destroy (batch);
+  return success;
+}
+
+/* Parses the input of 'lines' or 'bam' on 'max_threads' threads.  The input
+ * is read in chunks on the calling thread, and at most two chunks per
+ * thread are in flight at any time. */
+static bool
+nsv_reads_from_batches (struct nsv_reads_state_t *state,
+                        struct nsv_stream_t *lines,
+                        struct nsv_bam_t *bam,
+                        struct nsv_contigs_t *contigs)
+{
+  struct nsv_reads_parallel_t parallel;
+  parallel.contigs = contigs;
+  parallel.bam = bam;
+  parallel.filter = &(state->filter);
+  g_mutex_init (&(parallel.mutex));
+  g_cond_init (&(parallel.condition));
+
+  parallel.pool = g_thread_pool_new (nsv_reads_parse_batch, &parallel,
+                                     nsv_config.max_threads, TRUE, NULL);
+  if (parallel.pool == NULL)
+    {
+      g_mutex_clear (&(parallel.mutex));
+      g_cond_clear (&(parallel.condition));
+      return false;
+    }
+
+  uint32_t max_batches = nsv_config.max_threads * 2;
+  GList *batches = NULL;
+  uint32_t batches_len = 0;
+  bool in_header = (lines != NULL);
+  bool success = true;
+
+  while (success)
+    {
+      size_t length = 0;
+      char *data = NULL;
+      struct nsv_chunk_t *chunk = NULL;
+      if (bam != NULL)
+        {
+          chunk = nsv_bam_read_records (bam, &length);
+          data = (chunk != NULL) ? chunk->data : NULL;
+        }
+      else
+        {
+          data = nsv_stream_next_lines (lines, &length);
+          chunk = (data != NULL) ? nsv_chunk_ref (lines->chunk) : NULL;
+        }
+
+      if (chunk == NULL)
+        break;
+
+      /* The header determines the contig indexes, so it is parsed here
+       * rather than on the worker threads. */
+      while (success && in_header && length > 0 && data[0] == '@')
+        {
+          char *newline = memchr (data, '\n', length);
+          size_t line_len = (newline != NULL)
+                            ? (size_t)(newline - data)
+                            : length;
+          success = nsv_contigs_add_header_line (contigs, data, line_len);
+
+          line_len = (newline != NULL) ? line_len + 1 : line_len;
+          data += line_len;
+          length -= line_len;
+        }
+
+      /* The worker threads look up the contigs of the header without
+       * locking the dictionary. */
+      if (in_header && length > 0)
+        {
+          in_header = false;
+          nsv_contigs_seal (contigs);
+        }
+
+      struct nsv_reads_batch_t *batch;
+      batch = nsv_reads_batch_new (chunk, data, length, state->arena != NULL);
+      if (batch == NULL)
+        {
+          infra_logger_error_alloc (nsv_config.logger);
+          success = false;
+          break;
+        }
+
+      batches = g_list_append (batches, batch);
+      batches_len++;
+      g_thread_pool_push (parallel.pool, batch, NULL);
+
+      if (batches_len >= max_batches)
+        {
+          success = nsv_reads_merge_batch (state, &parallel, batches->data);
+          batches = g_list_delete_link (batches, batches);
+          batches_len--;
+        }
+    }
+
+  /* Even after a failure, the batches that are in flight must be waited
+   * for before they can be destroyed. */
+  while (batches != NULL)
+    {
+      if (!nsv_reads_merge_batch (state, &parallel, batches->data))
+        success = false;
+
+      batches = g_list_delete_link (batches, batches);
+    }
+
+  g_thread_pool_free (parallel.pool, FALSE, TRUE);
+  g_mutex_clear (&(parallel.mutex));
+  g_cond_clear (&(parallel.condition));
+
+  /* A malformed or truncated file, or one that could not be read, ends the
+   * loop like its end does. */
+  return (success
+          && (bam == NULL || !bam->error)
+          && (lines == NULL || !lines->error));
+}
+
+static bool
+nsv_reads_state_finish (struct nsv_reads_state_t *state)
+{
+  /* The last read of grouped input has not been handed over yet. */
+  if (state->callback != NULL && !nsv_reads_state_flush (state))
+    return false;
+
+  /* Records that were rejected before parsing count as filtered. */
+  state->filtered_count += state->filter.rejected_count;
+  state->filter.rejected_count = 0;
 
   /* Provide feedback to the user on the parsing step. */
   infra_logger_log (nsv_config.logger, LOG_INFO,
-                    "Parsed %u segments from sambamba's output.",
-                    filtered_count + added_count);
+                    "Parsed %u segments, of which %u were filtered.",
+                    state->added_count + state->filtered_count,
+                    state->filtered_count);
 
   infra_logger_log (nsv_config.logger, LOG_INFO,
                     "Filtered %u segments with a map quality threshold of %d.",
-                    filtered_count, nsv_config.min_map_quality);
+                    state->filtered_count, nsv_config.min_map_quality);
 
-  /* All segments have been read, so we no longer need the trie. */
-  trie_destroy (trie);
+  nsv_filter_log_counts (nsv_config.filter, state->clause_counts);
 
-  *output_ptr = output;
-  return TRUE;
+  /* All segments have been read, so we no longer need the index. */
+  nsv_qnames_destroy (state->qnames);
+  state->qnames = NULL;
 
- allocation_error_handler:
-  infra_logger_error_alloc (nsv_config.logger);
-  g_list_free_full (output, nsv_read_destroy);
-  *output_ptr = NULL;
-  return FALSE;
+  return true;
 }
 
-GList *
-nsv_reads_from_sam (const char *filename)
+/* Parses the SAM text in 'stream' into 'state'. */
+static bool
+nsv_reads_parse_stream (struct nsv_reads_state_t *state, FILE *stream,
+                        struct nsv_contigs_t *contigs)
+{
+  /* Read the input in large blocks, rather than one character at a time.
+   * Only the columns needed to find breakpoints are stored, which leaves
+   * out the sequence and base qualities. */
+  struct nsv_stream_t *lines = nsv_stream_new (stream);
+  if (lines == NULL)
+    return false;
+
+  bool success = true;
+
+  /* With multiple threads, blocks of lines are parsed in parallel. */
+  if (nsv_config.max_threads > 1)
+    success = nsv_reads_from_batches (state, lines, NULL, contigs);
+  else
+    {
+      const char *qname = NULL;
+      struct nsv_segment_t *segment = NULL;
+      while (success
+             && (segment = nsv_segment_from_stream (lines, state->arena,
+                                                    contigs,
+                                                    NSV_COLUMNS_BREAKPOINT,
+                                                    &(state->filter),
+                                                    &qname)) != NULL)
+        success = nsv_reads_add_segment (state, segment, qname);
+
+      success = success && !lines->error;
+    }
+
+  nsv_stream_destroy (lines);
+  return success;
+}
+
+/* Decodes the records of 'bam' into 'state'. */
+static bool
+nsv_reads_parse_bam (struct nsv_reads_state_t *state, struct nsv_bam_t *bam,
+                     struct nsv_contigs_t *contigs)
+{
+  /* With multiple threads, the records are decoded in parallel too. */
+  if (nsv_config.max_threads > 1)
+    return nsv_reads_from_batches (state, NULL, bam, contigs);
+
+  bool success = true;
+  const char *qname = NULL;
+  struct nsv_segment_t *segment = NULL;
+  while (success
+         && (segment = nsv_bam_read_segment (bam, state->arena,
+                                             NSV_COLUMNS_BREAKPOINT,
+                                             &(state->filter),
+                                             &qname)) != NULL)
+    success = nsv_reads_add_segment (state, segment, qname);
+
+  /* A malformed or truncated file ends the loop like its end does. */
+  return (success && !bam->error);
+}
+
+/* Adds the hash of the qname of each record in a chunk of BAM records
+ * that may have other alignments to 'hashes'. */
+static void
+nsv_reads_find_split_records (GArray *hashes, const char *data,
+                              size_t length)
+{
+  /* See nsv_bam_read_records for the layout of the chunk. */
+  const char *position = data;
+  while (position + sizeof (int32_t) <= data + length)
+    {
+      int32_t record_len;
+      memcpy (&record_len, position, sizeof (int32_t));
+      position += sizeof (int32_t);
+
+      const char *qname;
+      size_t qname_len;
+      if (nsv_bam_record_is_split ((const uint8_t *)position, record_len,
+                                   &qname, &qname_len))
+        {
+          uint64_t hash = nsv_qnames_hash (qname, qname_len);
+          g_array_append_val (hashes, hash);
+        }
+
+      position += record_len;
+    }
+}
+
+/* Reads 'filename' once to find the reads that can have more than one
+ * segment: those with a paired, secondary or supplementary record, or
+ * with an SA tag.  Only the qname, FLAG and optional fields of each record
+ * are looked at, and only the hashes of the qnames are kept, so that the
+ * Bloom filter can be made just large enough. */
+static struct nsv_qnames_bloom_t *
+nsv_reads_find_split_reads (const char *filename, bool is_bam)
+{
+  GArray *hashes = g_array_new (FALSE, FALSE, sizeof (uint64_t));
+  bool success = false;
+  if (is_bam)
+    {
+      /* The references are added to the dictionary in the second pass. */
+      struct nsv_contigs_t *contigs = nsv_contigs_new ();
+      struct nsv_bam_t *bam = (contigs != NULL)
+                              ? nsv_bam_open (filename, contigs,
+                                              nsv_config.max_threads)
+                              : NULL;
+      struct nsv_chunk_t *chunk;
+      size_t length;
+      while (bam != NULL
+             && (chunk = nsv_bam_read_records (bam, &length)) != NULL)
+        {
+          nsv_reads_find_split_records (hashes, chunk->data, length);
+          nsv_chunk_unref (chunk);
+        }
+
+      success = (bam != NULL && !bam->error);
+      nsv_bam_close (bam);
+      nsv_contigs_destroy (contigs);
+    }
+  else
+    {
+      FILE *sam_file = fopen (filename, "r");
+      struct nsv_stream_t *lines = (sam_file != NULL)
+                                   ? nsv_stream_new (sam_file)
+                                   : NULL;
+      char *line;
+      size_t length;
+      while (lines != NULL
+             && (line = nsv_stream_next_line (lines, &length)) != NULL)
+        {
+          size_t qname_len;
+          if (length > 0 && line[0] != '@'
+              && nsv_segment_line_is_split (line, length, &qname_len))
+            {
+              uint64_t hash = nsv_qnames_hash (line, qname_len);
+              g_array_append_val (hashes, hash);
+            }
+        }
+
+      success = (lines != NULL && !lines->error);
+      nsv_stream_destroy (lines);
+      if (sam_file != NULL)
+        fclose (sam_file);
+      else
+        infra_logger_log (nsv_config.logger, LOG_ERROR,
+                          "Could not open the SAM file.");
+    }
+
+  infra_logger_log (nsv_config.logger, LOG_INFO,
+                    "Found %u records of reads with more than one "
+                    "alignment.", hashes->len);
+
+  struct nsv_qnames_bloom_t *members = NULL;
+  if (success)
+    members = nsv_qnames_bloom_new ((uint64_t *)hashes->data, hashes->len);
+
+  g_array_free (hashes, TRUE);
+  return members;
+}
+
+/* Parses the SAM or BAM file 'filename' into 'state', and finishes it. */
+static bool
+nsv_reads_parse_file (struct nsv_reads_state_t *state, const char *filename,
+                      bool is_bam, struct nsv_contigs_t *contigs)
 {
+  /* With --sa-tag, the alignments of a read are taken from the SA tag of
+   * its primary record. */
+  if (nsv_config.sa_tag)
+    state->contigs = contigs;
+
+  /* A read with a single alignment cannot have a breakpoint.  With
+   * --prefilter, such reads are found in a first pass, and their records
+   * are rejected before they are parsed. */
+  struct nsv_qnames_bloom_t *members = NULL;
+  if (nsv_config.prefilter)
+    {
+      members = nsv_reads_find_split_reads (filename, is_bam);
+      if (members == NULL)
+        return false;
+
+      state->filter.members = members;
+    }
+
+  bool success;
+  if (is_bam)
+    {
+      infra_logger_log (nsv_config.logger, LOG_INFO,
+                        "Reading from: %s using %u threads.",
+                        filename, nsv_config.max_threads);
+
+      struct nsv_bam_t *bam = nsv_bam_open (filename, contigs,
+                                            nsv_config.max_threads);
+      success = (bam != NULL && nsv_reads_parse_bam (state, bam, contigs));
+
+      /* Now that we have decoded all records, we can close the file. */
+      nsv_bam_close (bam);
+    }
+  else
+    {
+      FILE *sam_file = fopen (filename, "r");
+      if (sam_file == NULL)
+        {
+          infra_logger_log (nsv_config.logger, LOG_ERROR,
+                            "Could not open the SAM file.");
+          success = false;
+        }
+      else
+        {
+          infra_logger_log (nsv_config.logger, LOG_INFO,
+                            "Reading from: %s", filename);
+
+          success = nsv_reads_parse_stream (state, sam_file, contigs);
+          fclose (sam_file);
+        }
+    }
+
+  state->filter.members = NULL;
+  nsv_qnames_bloom_destroy (members);
+
+  return (success && nsv_reads_state_finish (state));
+}
+
+static GList *
+nsv_reads_from_file (const char *filename, bool is_bam,
+                     struct nsv_contigs_t *contigs, struct nsv_arena_t *arena,
+                     bool *success_ptr)
+{
+  if (success_ptr == NULL)
+    return NULL;
+
+  *success_ptr = false;
   if (filename == NULL)
     return NULL;
 
-  FILE *sam_file = fopen (filename, "r");
-  if (sam_file == NULL)
+  struct nsv_reads_state_t state;
+  if (!nsv_reads_state_init (&state, NULL, NULL, NULL, arena)
+      || !nsv_reads_parse_file (&state, filename, is_bam, contigs))
     {
-      infra_logger_log (nsv_config.logger, LOG_ERROR,
-                        "Could not open the SAM file.");
-
+      nsv_reads_state_clear (&state);
       return NULL;
     }
 
-  infra_logger_log (nsv_config.logger, LOG_INFO, "Reading from: %s", filename);
+  *success_ptr = true;
+  return state.output;
+}
 
-  /* When nsv_reads_from_stream fails, 'output' will be NULL, which is
-   * exactly the value we need upon an error. */
-  GList *output = NULL;
-  nsv_reads_from_stream (sam_file, &output);
-  
-  fclose (sam_file);
-  return output;
+GList *
+nsv_reads_from_sam (const char *filename, struct nsv_contigs_t *contigs,
+                    struct nsv_arena_t *arena, bool *success_ptr)
+{
+  return nsv_reads_from_file (filename, false, contigs, arena, success_ptr);
 }
 
 GList *
-nsv_reads_from_bam (const char *filename)
+nsv_reads_from_bam (const char *filename, struct nsv_contigs_t *contigs,
+                    struct nsv_arena_t *arena, bool *success_ptr)
 {
-  if (filename == NULL)
-    return NULL;
+  return nsv_reads_from_file (filename, true, contigs, arena, success_ptr);
+}
+
+static bool
+nsv_reads_foreach_in_file (const char *filename, bool is_bam,
+                           struct nsv_contigs_t *contigs,
+                           nsv_read_callback_t callback, void *user_data)
+{
+  if (filename == NULL || callback == NULL)
+    return false;
+
+  struct nsv_reads_state_t state;
+  nsv_reads_state_init (&state, NULL, callback, user_data, NULL);
+  if (!nsv_reads_parse_file (&state, filename, is_bam, contigs))
+    {
+      nsv_reads_state_clear (&state);
+      return false;
+    }
+
+  return true;
+}
+
+bool
+nsv_reads_foreach_in_sam (const char *filename, struct nsv_contigs_t *contigs,
+                          nsv_read_callback_t callback, void *user_data)
+{
+  return nsv_reads_foreach_in_file (filename, false, contigs,
+                                    callback, user_data);
+}
+
+bool
+nsv_reads_foreach_in_bam (const char *filename, struct nsv_contigs_t *contigs,
+                          nsv_read_callback_t callback, void *user_data)
+{
+  return nsv_reads_foreach_in_file (filename, true, contigs,
+                                    callback, user_data);
+}
+
+/* A tile is a part of a reference sequence that is read from an indexed
+ * BAM file by a single worker.  Each record is assigned to the tile that
+ * contains its start position, or, for records that start before the
+ * region, to the first tile. */
+struct nsv_reads_tile_t
+{
+  int32_t reference;            /* The index of the reference in the file. */
+  int32_t rname_id;             /* The contig index of 'reference'. */
+  int64_t begin;                /* The 0-based start of the tile. */
+  int64_t end;                  /* The 0-based end of the tile, exclusive. */
+  struct nsv_region_t region;   /* The region records must overlap. */
+
+  struct nsv_reads_state_t state;
+  bool success;
+  bool done;
+};
+
+/* This data structure is shared by the workers of an indexed parse. */
+struct nsv_reads_tiles_t
+{
+  const char *filename;
+  struct nsv_contigs_t *contigs;
+  struct nsv_index_t *index;
+
+  struct nsv_reads_tile_t *tiles;
+  uint32_t tiles_len;
+  gint next_tile;               /* The next tile a worker can claim. */
+  bool arenas;                  /* Set when each tile has its own arena. */
+
+  GMutex mutex;
+  GCond condition;
+};
+
+/* Reads the records of a tile into the tile's own state. */
+static bool
+nsv_reads_parse_tile (struct nsv_reads_tile_t *tile, struct nsv_bam_t *bam,
+                      struct nsv_index_t *index)
+{
+  struct nsv_arena_t *arena = tile->state.arena;
+  uint32_t chunks_len = 0;
+  struct nsv_index_chunk_t *chunks;
+  chunks = nsv_index_query (index, tile->reference, tile->begin, tile->end,
+                            &chunks_len);
+
+  bool success = true;
+  bool past_tile = false;
+  uint32_t chunk_index;
+  for (chunk_index = 0;
+       success && !past_tile && chunk_index < chunks_len;
+       chunk_index++)
+    {
+      success = nsv_bam_seek (bam, chunks[chunk_index].begin);
+      while (success && nsv_bam_tell (bam) < chunks[chunk_index].end)
+        {
+          const char *qname = NULL;
+          struct nsv_segment_t *segment;
+
+          /* Records are not rejected before they are decoded here,
+           * because skipping them could run past the end of the file, and
+           * a rejected record may belong to another tile. */
+          segment = nsv_bam_read_segment (bam, arena, NSV_COLUMNS_BREAKPOINT,
+                                          NULL, &qname);
+          if (segment == NULL)
+            {
+              success = false;
+              break;
+            }
+
+          /* Records are sorted by position, so once a record starts after
+           * the tile, the remaining ones do too. */
+          int64_t start = segment->pos - 1;
+          if (segment->rname_id == tile->rname_id && start >= tile->end)
+            {
+              nsv_reads_drop_segment (arena, segment);
+              past_tile = true;
+              break;
+            }
+
+          uint32_t length = nsv_segment_cigar_reference_length (segment);
+          int64_t anchor = (start < tile->region.begin)
+                           ? tile->region.begin
+                           : start;
+
+          if (segment->rname_id != tile->rname_id
+              || start + ((length > 0) ? length : 1) <= tile->region.begin
+              || anchor < tile->begin || anchor >= tile->end)
+            {
+              nsv_reads_drop_segment (arena, segment);
+              continue;
+            }
+
+          success = nsv_reads_add_segment (&(tile->state), segment, qname);
+        }
+    }
+
+  free (chunks);
+
+  /* The reads of all tiles are joined in a single index later on. */
+  nsv_qnames_destroy (tile->state.qnames);
+  tile->state.qnames = NULL;
+
+  return success;
+}
+
+/* This function runs on its own thread, with its own handle to the BAM
+ * file.  It claims tiles until there are none left. */
+static gpointer
+nsv_reads_tile_worker (gpointer data)
+{
+  struct nsv_reads_tiles_t *tiles = data;
+  struct nsv_bam_t *bam = nsv_bam_open (tiles->filename, tiles->contigs, 1);
+
+  uint32_t tile_index;
+  while ((tile_index = g_atomic_int_add (&(tiles->next_tile), 1))
+         < tiles->tiles_len)
+    {
+      struct nsv_reads_tile_t *tile = &(tiles->tiles[tile_index]);
+      struct nsv_arena_t *arena = (tiles->arenas) ? nsv_arena_new () : NULL;
+      tile->success = (bam != NULL
+                       && (arena != NULL || !tiles->arenas)
+                       && nsv_reads_state_init (&(tile->state), NULL,
+                                                NULL, NULL, arena)
+                       && nsv_reads_parse_tile (tile, bam, tiles->index));
+
+      /* The arena is kept even when the state could not be set up, so
+       * that it is always merged. */
+      tile->state.arena = arena;
+
+      g_mutex_lock (&(tiles->mutex));
+      tile->done = true;
+      g_cond_broadcast (&(tiles->condition));
+      g_mutex_unlock (&(tiles->mutex));
+    }
+
+  nsv_bam_close (bam);
+  return NULL;
+}
+
+/* Moves the reads of a tile into 'state'.  Reads that were also found in
+ * an earlier tile are joined with the read from that tile. */
+static bool
+nsv_reads_merge_tile (struct nsv_reads_state_t *state,
+                      struct nsv_reads_tiles_t *tiles,
+                      struct nsv_reads_tile_t *tile)
+{
+  g_mutex_lock (&(tiles->mutex));
+  while (!tile->done)
+    g_cond_wait (&(tiles->condition), &(tiles->mutex));
+  g_mutex_unlock (&(tiles->mutex));
+
+  state->added_count += tile->state.added_count;
+  state->filtered_count += tile->state.filtered_count;
+  nsv_reads_add_clause_counts (state, tile->state.clause_counts);
 
-  /* This stack buffer will contain the command to run. */
-  size_t command_line_len = 20 + strlen (filename);
-  char command_line[command_line_len];
+  /* The tile's reads are in reverse input order, like 'state->output'. */
+  GList *reads = g_list_reverse (tile->state.output);
+  tile->state.output = NULL;
 
-  snprintf (command_line, command_line_len,
-            "sambamba view -t %u %s",
-            nsv_config.max_threads, filename);
+  bool success = tile->success;
+  GList *iterator;
+  for (iterator = reads; iterator != NULL; iterator = iterator->next)
+    {
+      struct nsv_read_t *read_obj = iterator->data;
+      struct nsv_read_t *existing = NULL;
+      if (success)
+        existing = nsv_qnames_find (state->qnames, &(read_obj->qname));
+
+      if (!success)
+        nsv_read_destroy (read_obj);
+      else if (existing == NULL)
+        {
+          success = nsv_qnames_insert (state->qnames, &(read_obj->qname),
+                                       read_obj);
+          if (success)
+            state->output = g_list_prepend (state->output, read_obj);
+          else
+            nsv_read_destroy (read_obj);
+        }
+      else
+        {
+          GList *segment;
+          for (segment = read_obj->segments; segment; segment = segment->next)
+            nsv_segment_cold (segment->data)->read = existing;
 
-  command_line[command_line_len - 1] = '\0';
+          existing->segments = g_list_concat (read_obj->segments,
+                                              existing->segments);
+          read_obj->segments = NULL;
+          nsv_read_destroy (read_obj);
+        }
+    }
+
+  g_list_free (reads);
+
+  /* The reads of the tile now belong to 'state', even after a failure. */
+  nsv_arena_merge (state->arena, tile->state.arena);
+  tile->state.arena = NULL;
+
+  return success;
+}
 
-  infra_logger_log (nsv_config.logger, LOG_INFO, "Running: %s", command_line);
+/* Splits 'region' into tiles of at most NSV_READS_TILE_SIZE bases. */
+static void
+nsv_reads_add_tiles (GArray *tiles, int32_t reference,
+                     struct nsv_region_t *region)
+{
+  int64_t begin;
+  for (begin = region->begin; begin < region->end;
+       begin += NSV_READS_TILE_SIZE)
+    {
+      struct nsv_reads_tile_t tile;
+      memset (&tile, 0, sizeof (struct nsv_reads_tile_t));
+      tile.reference = reference;
+      tile.rname_id = region->rname_id;
+      tile.begin = begin;
+      tile.end = (region->end - begin > NSV_READS_TILE_SIZE)
+                 ? begin + NSV_READS_TILE_SIZE
+                 : region->end;
+      tile.region = *region;
+      g_array_append_val (tiles, tile);
+    }
+}
+
+GList *
+nsv_reads_from_bam_index (const char *filename, struct nsv_contigs_t *contigs,
+                          const char *region_text, struct nsv_arena_t *arena,
+                          bool *success_ptr)
+{
+  if (success_ptr == NULL)
+    return NULL;
+
+  *success_ptr = false;
+  if (filename == NULL || contigs == NULL)
+    return NULL;
+
+  /* The header is read once here, so that the contig dictionary is
+   * complete before the region is looked up and the workers start. */
+  struct nsv_bam_t *bam = nsv_bam_open (filename, contigs, 1);
+  if (bam == NULL)
+    return NULL;
 
-  FILE *command = popen (command_line, "r");
-  if (command == NULL)
+  struct nsv_region_t region;
+  if (region_text != NULL
+      && !nsv_contigs_parse_region (contigs, region_text, &region))
     {
       infra_logger_log (nsv_config.logger, LOG_ERROR,
-                        "Could not run sambamba.");
+                        "Invalid region '%s'.", region_text);
+      nsv_bam_close (bam);
+      return NULL;
+    }
+
+  struct nsv_reads_tiles_t tiles;
+  memset (&tiles, 0, sizeof (struct nsv_reads_tiles_t));
+  tiles.filename = filename;
+  tiles.contigs = contigs;
+  tiles.index = nsv_index_open (filename);
+  tiles.arenas = (arena != NULL);
 
+  struct nsv_reads_state_t state;
+  if (tiles.index == NULL
+      || !nsv_reads_state_init (&state, NULL, NULL, NULL, arena))
+    {
+      nsv_index_destroy (tiles.index);
+      nsv_bam_close (bam);
       return NULL;
     }
 
-  /* We will store the list of reads in this variable. */
-  GList *output = NULL;
-  nsv_reads_from_stream (command, &output);
+  /* The index refers to references by their position in the file, rather
+   * than by their index in the contig dictionary. */
+  GArray *tiles_array = g_array_new (FALSE, FALSE,
+                                     sizeof (struct nsv_reads_tile_t));
+  int64_t max_position = nsv_index_max_position (tiles.index);
+  int32_t reference;
+  for (reference = 0; reference < bam->references_len; reference++)
+    {
+      if (region_text == NULL)
+        {
+          region.rname_id = bam->reference_ids[reference];
+          region.begin = 0;
+          region.end = nsv_contigs_length (contigs, region.rname_id);
+          if (region.end == 0)
+            region.end = max_position;
+        }
+      else if (bam->reference_ids[reference] != region.rname_id)
+        continue;
+
+      if (region.end > max_position)
+        region.end = max_position;
+
+      nsv_reads_add_tiles (tiles_array, reference, &region);
+    }
+
+  nsv_bam_close (bam);
+
+  tiles.tiles_len = tiles_array->len;
+  tiles.tiles = (struct nsv_reads_tile_t *)g_array_free (tiles_array, FALSE);
+  g_mutex_init (&(tiles.mutex));
+  g_cond_init (&(tiles.condition));
 
-  /* Now that we have parsed all output from sambamba, we can close the pipe. */
-  pclose (command);
+  infra_logger_log (nsv_config.logger, LOG_INFO,
+                    "Reading %u regions from: %s using %u threads.",
+                    tiles.tiles_len, filename, nsv_config.max_threads);
+
+  /* Every worker has its own file handle, so there is no parsing state
+   * that workers share. */
+  uint32_t threads_len = (nsv_config.max_threads < tiles.tiles_len)
+                         ? nsv_config.max_threads
+                         : tiles.tiles_len;
+  if (threads_len == 0 && tiles.tiles_len > 0)
+    threads_len = 1;
+
+  GThread **threads = calloc (threads_len + 1, sizeof (GThread *));
+  uint32_t thread_index;
+  for (thread_index = 0; threads != NULL && thread_index < threads_len;
+       thread_index++)
+    threads[thread_index] = g_thread_new ("tile", nsv_reads_tile_worker,
+                                          &tiles);
+
+  /* Tiles are merged in order, so the result does not depend on which
+   * worker finishes first. */
+  bool success = true;
+  uint32_t tile_index;
+  for (tile_index = 0; threads != NULL && tile_index < tiles.tiles_len;
+       tile_index++)
+    if (!nsv_reads_merge_tile (&state, &tiles, &(tiles.tiles[tile_index])))
+      success = false;
+
+  for (thread_index = 0; threads != NULL && thread_index < threads_len;
+       thread_index++)
+    g_thread_join (threads[thread_index]);
+
+  free (threads);
+  free (tiles.tiles);
+  g_mutex_clear (&(tiles.mutex));
+  g_cond_clear (&(tiles.condition));
+  nsv_index_destroy (tiles.index);
 
-  return output;
+  if (threads == NULL || !success || !nsv_reads_state_finish (&state))
+    {
+      if (threads == NULL)
+        infra_logger_error_alloc (nsv_config.logger);
+
+      nsv_reads_state_clear (&state);
+      return NULL;
+    }
+
+  *success_ptr = true;
+  return state.output;
 }
 
 void
@@ -245,7 +1430,10 @@ nsv_read_destroy (void *read_obj)
       return;
     }
 
-  free (obj->qname);
+  if (obj->in_arena)
+    return;
+
+  free ((char *)obj->qname.name);
   g_list_free_full (obj->segments, nsv_segment_destroy);
   free (obj);
 }
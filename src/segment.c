@@ -20,9 +20,12 @@
 #include <getopt.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include "trie.h"
 #include "segment.h"
+#include "cigar.h"
+#include "stream.h"
 #include "nanosvc.h"
 
 #include <libinfra/logger.h>
@@ -33,135 +36,435 @@ extern struct nsv_config_t nsv_config;
 struct nsv_segment_t *
 nsv_segment_new (void)
 {
+  return nsv_segment_new_in_arena (NULL);
+}
+
+struct nsv_segment_t *
+nsv_segment_new_in_arena (struct nsv_arena_t *arena)
+{
+  /* In an arena, the segments are packed together and the cold fields go
+   * to a parallel table.  Otherwise, they are allocated along with the
+   * segment. */
+  size_t cold_size = sizeof (struct nsv_segment_cold_t);
   struct nsv_segment_t *segment;
-  segment = calloc (1, sizeof (struct nsv_segment_t));
+  if (arena != NULL)
+    segment = nsv_arena_alloc_record (arena, NSV_SEGMENT_HOT_SIZE,
+                                      cold_size);
+  else
+    segment = nsv_arena_alloc_aligned (NULL, NSV_SEGMENT_HOT_SIZE + cold_size,
+                                       NSV_SEGMENT_HOT_SIZE);
   if (segment == NULL)
     {
       infra_logger_error_alloc (nsv_config.logger);
       return NULL;
     }
 
+  memset (segment, 0, NSV_SEGMENT_HOT_SIZE);
   segment->type = NSVC_OBJ_SEGMENT;
+  segment->in_arena = (arena != NULL);
+  segment->rname_id = -1;
+  segment->clip = -1;
+  segment->pid = -1;
+
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+  memset (cold, 0, cold_size);
+  cold->rnext_id = -1;
+  cold->nm = -1;
+  cold->md_mismatches = -1;
+  nsv_segment_cigar_init (&(cold->overview));
   return segment;
 }
 
-struct nsv_segment_t *
-nsv_segment_from_stream (FILE *stream, char **qname_ptr)
+/* Parses the decimal integer at the start of 'field'.  Like atoi, parsing
+ * stops at the first character that is not a digit.  Unlike atoi, it does
+ * not need a null-terminated string, and it doesn't go through the locale
+ * machinery. */
+static inline int32_t
+nsv_segment_parse_int32 (const char *field, const char *end)
 {
-  if (stream == NULL || qname_ptr == NULL)
-    return NULL;
+  bool negative = false;
+  if (field < end && (*field == '-' || *field == '+'))
+    {
+      negative = (*field == '-');
+      field++;
+    }
 
-  struct nsv_segment_t *segment = nsv_segment_new ();
-  if (segment == NULL)
-    return NULL;
+  uint32_t value = 0;
+  while (field < end && (uint8_t)(*field - '0') < 10)
+    {
+      value = value * 10 + (uint8_t)(*field - '0');
+      field++;
+    }
 
-  /* Columns:
-   * qname, flag, rname, pos, mapq, cigar, rnext, pnext, tlen, seq, qual, tags. */
+  return negative ? -(int32_t)value : (int32_t)value;
+}
 
-  /* The 'field_index' tells which field we are currently parsing.
-   * So, field_index = 0 means we are parsing the qname, field_index = 1 means
-   * we are parsing the flag. */
-  uint8_t field_index = 0;
+/* Resolves the reference name 'name' to its index in 'contigs'.  Names that
+ * are not in the dictionary, because the input has no @SQ header lines,
+ * are added to it. */
+static inline bool
+nsv_segment_parse_contig (struct nsv_contigs_t *contigs, const char *name,
+                          int32_t *index_ptr)
+{
+  if (name[0] == '*' && name[1] == '\0')
+    {
+      *index_ptr = -1;
+      return true;
+    }
+
+  *index_ptr = nsv_contigs_add (contigs, name, 0);
+  return (*index_ptr >= 0);
+}
 
-  /* 'field' is a temporary buffer on the stack that contains the contents of
-   * the current field.  When the field's contents are complete, we make a copy
-   * to the heap memory. */
-  const uint16_t field_max_length = 512;
-  char field[field_max_length];
-  uint16_t field_pos = 0;
-  memset (field, '\0', field_max_length);
-
-  char *qname = NULL;
-  char buffer;
-  buffer = getc(stream);
-  if (buffer == EOF)
+int32_t
+nsv_segment_md_mismatches (const char *md, size_t length)
+{
+  /* The MD value is a run of matches, followed by a mismatched reference
+   * base or by '^' and the deleted reference bases, and so on. */
+  int32_t mismatches = 0;
+  bool deletion = false;
+  size_t index;
+  for (index = 0; index < length; index++)
     {
-      nsv_segment_destroy (segment);
-      return NULL;
+      char character = md[index];
+      if (character >= '0' && character <= '9')
+        deletion = false;
+      else if (character == '^')
+        deletion = true;
+      else if (!deletion)
+        mismatches++;
     }
 
-  while (buffer != EOF)
+  return mismatches;
+}
+
+/* Stores the NM, MD and SA fields of the optional fields from 'tags' to
+ * 'end'.
+ * The SA value is null-terminated in place, and copied into 'arena' when
+ * 'copy' is set. */
+static bool
+nsv_segment_parse_tags (struct nsv_segment_t *segment, char *tags, char *end,
+                        bool copy, struct nsv_arena_t *arena)
+{
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+  char *tag = tags;
+  while (tag < end)
     {
-      /* When we encounter a header line, we need to skip the entire line. */
-      if (field_pos == 0 && field_index == 0 && buffer == '@')
-        {
-          /* Skip the current line. */
-          while (buffer != '\n' && buffer != EOF)
-            buffer = getc (stream);
+      char *next = memchr (tag, '\t', end - tag);
+      if (next == NULL)
+        next = end;
 
-          if (buffer == EOF)
+      /* Each field has the form TAG:TYPE:VALUE. */
+      if (next - tag >= 5 && tag[2] == ':' && tag[4] == ':')
+        {
+          if (tag[0] == 'N' && tag[1] == 'M' && tag[3] == 'i')
+            cold->nm = nsv_segment_parse_int32 (tag + 5, next);
+          else if (tag[0] == 'M' && tag[1] == 'D' && tag[3] == 'Z')
+            cold->md_mismatches = nsv_segment_md_mismatches (tag + 5,
+                                                             next - tag - 5);
+          else if (tag[0] == 'S' && tag[1] == 'A' && tag[3] == 'Z')
             {
-              nsv_segment_destroy (segment);
-              return NULL;
+              *next = '\0';
+              cold->sa = (copy)
+                ? nsv_arena_strndup (arena, tag + 5, next - tag - 5)
+                : tag + 5;
+
+              if (cold->sa == NULL)
+                return false;
             }
+        }
 
-          /* Reset the state. */
-          field_pos = 0;
-          field_index = 0;
+      tag = next + 1;
+    }
 
-          /* Move past the '\n' character. */
-          buffer = getc (stream);
-          continue;
-        }
+  return true;
+}
+
+struct nsv_segment_t *
+nsv_segment_from_line (char *line, size_t length, struct nsv_chunk_t *chunk,
+                       struct nsv_arena_t *arena,
+                       struct nsv_contigs_t *contigs, uint32_t columns,
+                       const char **qname_ptr)
+{
+  if (line == NULL || contigs == NULL || qname_ptr == NULL)
+    return NULL;
 
-      else if (buffer == '\n')
+  struct nsv_segment_t *segment = nsv_segment_new_in_arena (arena);
+  if (segment == NULL)
+    return NULL;
+
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+  struct nsv_segment_cigar_overview_t overview;
+  nsv_segment_cigar_init (&overview);
+
+  /* The chunk is referenced before any field points into it, so that a
+   * segment that fails to parse does not free those fields.  An arena
+   * holds a single reference for all of its segments. */
+  if (chunk != NULL)
+    {
+      if (arena == NULL)
+        cold->chunk = nsv_chunk_ref (chunk);
+      else if (nsv_arena_hold_chunk (arena, chunk))
+        cold->chunk = chunk;
+      else
         {
-          /* TODO: Add the last field to the segment. */
-          break;
+          infra_logger_error_alloc (nsv_config.logger);
+          return NULL;
         }
+    }
+
+  /* Columns:
+   * qname, flag, rname, pos, mapq, cigar, rnext, pnext, tlen, seq, qual, tags.
+   *
+   * The 'field_index' tells which field we are currently parsing.
+   * So, field_index = 0 means we are parsing the qname, field_index = 1 means
+   * we are parsing the flag.  The optional fields are treated as a single
+   * column, of which only NM and SA are kept.
+   *
+   * Each delimiter is replaced by a null character, which turns the fields
+   * into strings without moving them.  In zero-copy mode, the segment
+   * points into the line.  Otherwise, the fields are copied.
+   *
+   * Columns that are not in 'columns' are skipped, and we stop looking for
+   * delimiters after the last column that was asked for.  The qname is
+   * always needed to group segments into reads, and an rnext of '=' refers
+   * to the rname. */
+  columns |= NSV_COLUMN_QNAME;
+  if (columns & NSV_COLUMN_RNEXT)
+    columns |= NSV_COLUMN_RNAME;
+  uint8_t last_field_index = 0;
+  while ((columns >> (last_field_index + 1)) & NSV_COLUMNS_ALL)
+    last_field_index++;
+
+  char *end = line + length;
+  char *field = line;
+  uint8_t field_index = 0;
+
+  while (field_index <= last_field_index)
+    {
+      /* memchr is vectorized by the C library, which makes finding the
+       * end of long fields like 'seq' and 'qual' cheap. */
+      char *delimiter = (field_index < 11)
+                        ? memchr (field, '\t', end - field)
+                        : end;
+      if (delimiter == NULL)
+        delimiter = end;
+
+      *delimiter = '\0';
 
-      else if (buffer == '\t')
+      if (columns & (1 << field_index))
         {
-          /* Process the field that has now been completely parsed. */
+          size_t field_len = delimiter - field;
+          char *text = field;
+          if (chunk == NULL
+              && (field_index == 9 || field_index == 10))
+            {
+              text = nsv_arena_strndup (arena, field, field_len);
+              if (text == NULL)
+                {
+                  infra_logger_error_alloc (nsv_config.logger);
+                  nsv_segment_destroy (segment);
+                  return NULL;
+                }
+            }
+
           switch (field_index)
             {
-              case 0:  qname          = strdup (field); break;
-              case 1:  segment->flag  = atoi(field);    break;
-              case 2:  segment->rname = strdup (field); break;
-              case 3:  segment->pos   = atoi(field);    break;
-              case 4:  segment->mapq  = atoi(field);    break;
-              case 5:  segment->cigar = strdup (field); break;
-              case 6:  segment->rnext = strdup (field); break;
-              case 7:  segment->pnext = atoi(field);    break;
-              case 8:  segment->tlen  = atoi(field);    break;
-              case 9:  segment->seq   = strdup (field); break;
-              case 10: segment->qual  = strdup (field); break;
+              case 0:  *qname_ptr     = text; break;
+              case 1:  segment->flag  = nsv_segment_parse_int32 (field, delimiter); break;
+              case 2:
+                if (!nsv_segment_parse_contig (contigs, text,
+                                               &(segment->rname_id)))
+                  {
+                    nsv_segment_destroy (segment);
+                    return NULL;
+                  }
+                break;
+              case 3:  segment->pos   = nsv_segment_parse_int32 (field, delimiter); break;
+              case 4:  segment->mapq  = nsv_segment_parse_int32 (field, delimiter); break;
+              case 5:
+                /* The CIGAR is always converted, so it never points into
+                 * the line. */
+                cold->cigar = nsv_segment_cigar_from_text (field, field_len,
+                                                           arena,
+                                                           &(cold->cigar_len),
+                                                           &overview);
+                if (cold->cigar == NULL)
+                  {
+                    infra_logger_error_alloc (nsv_config.logger);
+                    nsv_segment_destroy (segment);
+                    return NULL;
+                  }
+                break;
+              case 6:
+                if (!strcmp (text, "="))
+                  cold->rnext_id = segment->rname_id;
+                else if (!nsv_segment_parse_contig (contigs, text,
+                                                    &(cold->rnext_id)))
+                  {
+                    nsv_segment_destroy (segment);
+                    return NULL;
+                  }
+                break;
+              case 7:  cold->pnext = nsv_segment_parse_int32 (field, delimiter); break;
+              case 8:  cold->tlen  = nsv_segment_parse_int32 (field, delimiter); break;
+              case 9:
+                cold->seq = text;
+                segment->seq_len = field_len;
+                break;
+              case 10: cold->qual  = text; break;
+              case 11:
+                if (!nsv_segment_parse_tags (segment, field, delimiter,
+                                             chunk == NULL, arena))
+                  {
+                    infra_logger_error_alloc (nsv_config.logger);
+                    nsv_segment_destroy (segment);
+                    return NULL;
+                  }
+                break;
             }
+        }
 
-          field_index++;
+      field_index++;
+      if (delimiter == end)
+        break;
 
-          /* Reset the field so that the next field can be stored into it. */
-          memset (field, '\0', field_pos + 1);
-          field_pos = 0;
-        }
-      /* When the maximum length of the field buffer has been reached, we wait
-       * for the next delimiter, effectively truncating the field's contents. */
-      else if (field_pos < field_max_length)
-        {
-          field[field_pos] = buffer;
-          field_pos++;
-        }
+      field = delimiter + 1;
+    }
+
+  /* Without a stored sequence, the CIGAR tells how long it is. */
+  if (cold->seq == NULL || !strcmp (cold->seq, "*"))
+    segment->seq_len = 0;
+
+  nsv_segment_set_overview (segment, &overview);
+  return segment;
+}
+
+bool
+nsv_segment_filter_line (const struct nsv_segment_filter_t *filter,
+                         const char *line, size_t length)
+{
+  /* Find the start of the first six columns: qname, flag, rname, pos,
+   * mapq and cigar. */
+  const char *end = line + length;
+  const char *fields[6];
+  const char *field = line;
+  uint8_t field_index;
+  for (field_index = 0; field_index < 6; field_index++)
+    {
+      fields[field_index] = field;
+      if (field_index == 5)
+        break;
 
-      buffer = getc(stream);
+      const char *delimiter = memchr (field, '\t', end - field);
+      if (delimiter == NULL)
+        return false;
+
+      field = delimiter + 1;
     }
 
-  if (segment->cigar != NULL)
+  const char *cigar_end = memchr (fields[5], '\t', end - fields[5]);
+  if (cigar_end == NULL)
+    cigar_end = end;
+
+  /* The values are truncated like they are in a segment. */
+  uint16_t flag = nsv_segment_parse_int32 (fields[1], fields[2] - 1);
+  uint8_t mapq = nsv_segment_parse_int32 (fields[4], fields[5] - 1);
+  if (nsv_segment_filter_fields (filter, flag, mapq))
+    return true;
+
+  if (filter->members != NULL
+      && !nsv_qnames_bloom_find (filter->members,
+                                 nsv_qnames_hash (line,
+                                                  fields[1] - 1 - line)))
+    return true;
+
+  /* The operators are the only letters in a CIGAR, so a clip is an 'S' or
+   * an 'H' anywhere in it. */
+  if (filter->require_clip)
     {
-      //segment->clip = nsv_segment_parse_cigar (segment);
+      const char *position;
+      for (position = fields[5]; position < cigar_end; position++)
+        if (*position == 'S' || *position == 'H')
+          return false;
+
+      return true;
     }
 
-  /* Set extra fields. */
-  if (segment->seq != NULL)
-    segment->seq_len = strlen (segment->seq);
+  return false;
+}
 
-  /* TODO: What's the proper name for this? */
-  struct nsv_segment_cigar_overview_t overview;
-  segment->end = segment->pos + segment->seq_len;
-  segment->end += overview.deletions;
-  segment->end -= overview.insertions;
+bool
+nsv_segment_line_is_split (const char *line, size_t length,
+                           size_t *qname_len)
+{
+  const char *end = line + length;
+  const char *qname_end = memchr (line, '\t', length);
+  if (qname_end == NULL)
+    {
+      *qname_len = length;
+      return false;
+    }
 
-  *qname_ptr = qname;
-  return segment;
+  *qname_len = qname_end - line;
+  const char *flag_end = memchr (qname_end + 1, '\t', end - qname_end - 1);
+  uint16_t flag = nsv_segment_parse_int32 (qname_end + 1,
+                                           (flag_end != NULL) ? flag_end : end);
+  if (flag & (0x1 | 0x100 | 0x800))
+    return true;
+
+  /* Tabs only separate columns, so the tag cannot be matched inside the
+   * sequence or base qualities. */
+  const char *tab = qname_end;
+  while ((tab = memchr (tab + 1, '\t', end - tab - 1)) != NULL)
+    if (end - tab >= 6 && !memcmp (tab, "\tSA:Z:", 6))
+      return true;
+
+  return false;
+}
+
+struct nsv_segment_t *
+nsv_segment_from_stream (struct nsv_stream_t *stream,
+                         struct nsv_arena_t *arena,
+                         struct nsv_contigs_t *contigs, uint32_t columns,
+                         struct nsv_segment_filter_t *filter,
+                         const char **qname_ptr)
+{
+  if (stream == NULL || contigs == NULL || qname_ptr == NULL)
+    return NULL;
+
+  size_t length;
+  char *line;
+  while ((line = nsv_stream_next_line (stream, &length)) != NULL)
+    {
+      /* Skip empty lines. */
+      if (length == 0)
+        continue;
+
+      /* Header lines describe the reference sequences. */
+      if (line[0] == '@')
+        {
+          if (!nsv_contigs_add_header_line (contigs, line, length))
+            return NULL;
+
+          continue;
+        }
+
+      /* Rejected lines are skipped before any memory is allocated. */
+      if (filter != NULL && nsv_segment_filter_line (filter, line, length))
+        {
+          filter->rejected_count++;
+          continue;
+        }
+
+      return nsv_segment_from_line (line, length,
+                                    (nsv_config.zero_copy)
+                                    ? stream->chunk
+                                    : NULL,
+                                    arena, contigs, columns, qname_ptr);
+    }
+
+  return NULL;
 }
 
 int
@@ -186,160 +489,340 @@ nsv_segment_clip_compare (const void *first, const void *second)
   return (a_clip < b_clip) ? -1 : (a_clip == b_clip) ? 0 : 1;
 }
 
-float
-nsv_segment_cigar_pid (struct nsv_segment_t *segment)
+void
+nsv_segment_cigar_init (struct nsv_segment_cigar_overview_t *overview)
 {
-  /* We assume a number won't have more than 64 digits here. :) */
-  char buffer[64];
-  memset (buffer, '\0', 64);
+  memset (overview, 0, sizeof (struct nsv_segment_cigar_overview_t));
+  overview->first_clip = -1;
+  overview->last_clip = -1;
+}
 
-  uint32_t cigar_len = strlen (segment->cigar);
-  if (cigar_len == 0)
-    return -1;
+void
+nsv_segment_cigar_add (struct nsv_segment_cigar_overview_t *overview,
+                       uint32_t element)
+{
+  uint32_t length = nsv_cigar_length (element);
 
-  uint32_t cigar_index = 0;
-  uint32_t buffer_index = 0;
-  for (; cigar_index < cigar_len; cigar_index++)
+  /* M, I, S, = and X consume query bases, and M, D, N, = and X consume
+   * reference bases. */
+  switch (nsv_cigar_operation (element))
     {
-      switch (segment->cigar[cigar_index])
+    case NSV_CIGAR_MATCH:
+      overview->alignment_matches += length;
+      overview->query_length += length;
+      overview->reference_length += length;
+      break;
+    case NSV_CIGAR_EQUAL:
+      overview->matches += length;
+      overview->query_length += length;
+      overview->reference_length += length;
+      break;
+    case NSV_CIGAR_DIFF:
+      overview->mismatches += length;
+      overview->query_length += length;
+      overview->reference_length += length;
+      break;
+    case NSV_CIGAR_INSERTION:
+      overview->insertions += length;
+      overview->query_length += length;
+      break;
+    case NSV_CIGAR_DELETION:
+      overview->deletions += length;
+      overview->reference_length += length;
+      break;
+    case NSV_CIGAR_SKIP:
+      overview->skipped += length;
+      overview->reference_length += length;
+      break;
+    case NSV_CIGAR_PADDING:
+      overview->padding += length;
+      break;
+    case NSV_CIGAR_SOFT_CLIP:
+    case NSV_CIGAR_HARD_CLIP:
+      if (nsv_cigar_operation (element) == NSV_CIGAR_SOFT_CLIP)
         {
-        case 'I':
-        case 'D':
-        case 'M':
-        case 'N':
-        case 'X':
-        case 'S':
-        case 'H':
-          break;
-        case '=':
-          return (atof (buffer) / segment->seq_len);
-          break;
-        default:
-          {
-            buffer[buffer_index] = segment->cigar[cigar_index];
-            buffer_index++;
-
-            /* We don't want to clear the buffer when it hasn't reached an
-             * action yet.  We therefore skip the rest of the loop. */
-            continue;
-          }
-          break;
+          overview->soft_clip += length;
+          overview->query_length += length;
         }
+      else
+        overview->hard_clip += length;
 
-      memset (buffer, '\0', buffer_index);
-      buffer_index = 0;
-    }
+      if (overview->first_clip == -1)
+        overview->first_clip = length;
 
-  return -1;
+      overview->last_clip = length;
+      break;
+    }
 }
 
-int32_t
-nsv_segment_cigar_first_clip (struct nsv_segment_t *segment)
+void
+nsv_segment_set_overview (struct nsv_segment_t *segment,
+                          const struct nsv_segment_cigar_overview_t *overview)
 {
-  if (segment == NULL)
-    return -1;
-
-  /* Use the cached value whenever it's available. */
-  if (segment->clip != -1)
-    return segment->clip;
+  nsv_segment_cold (segment)->overview = *overview;
+
+  segment->clip = overview->first_clip;
+  segment->end = segment->pos + overview->reference_length;
+  if (segment->seq_len == 0)
+    segment->seq_len = overview->query_length;
+
+  /* An M operation can be either a match or a mismatch.  The mismatches
+   * are counted in the MD tag, and the NM tag counts them along with the
+   * inserted and deleted bases.  Either way, the mismatches include those
+   * of the X operations. */
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+  uint32_t columns = overview->alignment_matches + overview->matches
+                     + overview->mismatches + overview->insertions
+                     + overview->deletions;
+  int64_t mismatches = overview->mismatches;
+  if (overview->alignment_matches > 0)
+    {
+      if (cold->md_mismatches >= 0)
+        mismatches = cold->md_mismatches;
+      else if (cold->nm >= 0)
+        mismatches = (int64_t)cold->nm - overview->insertions
+                     - overview->deletions;
+      else
+        columns = 0;
+    }
 
-  /* We assume a number won't have more than 64 digits here. :) */
-  char buffer[64];
-  memset (buffer, '\0', 64);
+  /* Tags that disagree with the CIGAR are clamped to it. */
+  uint32_t aligned = overview->alignment_matches + overview->matches
+                     + overview->mismatches;
+  if (mismatches < 0)
+    mismatches = 0;
+  else if (mismatches > aligned)
+    mismatches = aligned;
+
+  segment->pid = (columns > 0)
+                 ? (float)(aligned - mismatches) / columns
+                 : -1;
+}
 
-  uint32_t cigar_len = strlen (segment->cigar);
-  if (cigar_len == 0)
-    return -1;
+/* Maps each operator character to its nsv_cigar_operation_e plus one, so
+ * that other characters map to zero. */
+static const uint8_t nsv_cigar_operations[256] = {
+  ['M'] = NSV_CIGAR_MATCH + 1,
+  ['I'] = NSV_CIGAR_INSERTION + 1,
+  ['D'] = NSV_CIGAR_DELETION + 1,
+  ['N'] = NSV_CIGAR_SKIP + 1,
+  ['S'] = NSV_CIGAR_SOFT_CLIP + 1,
+  ['H'] = NSV_CIGAR_HARD_CLIP + 1,
+  ['P'] = NSV_CIGAR_PADDING + 1,
+  ['='] = NSV_CIGAR_EQUAL + 1,
+  ['X'] = NSV_CIGAR_DIFF + 1
+};
+
+uint32_t *
+nsv_segment_cigar_from_text (const char *text, size_t length,
+                             struct nsv_arena_t *arena, uint32_t *length_ptr,
+                             struct nsv_segment_cigar_overview_t *overview)
+{
+  /* Count the operators first, so that the array is allocated at its
+   * final size. */
+  uint32_t elements = 0;
+  size_t index;
+  for (index = 0; index < length; index++)
+    elements += (nsv_cigar_operations[(uint8_t)text[index]] != 0);
+
+  /* malloc (0) may return NULL, so an empty CIGAR gets one element. */
+  size_t size = ((elements > 0) ? elements : 1) * sizeof (uint32_t);
+  uint32_t *cigar = nsv_arena_alloc (arena, size);
+  if (cigar == NULL)
+    return NULL;
 
-  uint32_t cigar_index = 0;
-  uint32_t buffer_index = 0;
-  for (; cigar_index < cigar_len; cigar_index++)
+  /* Each operation is a run of digits followed by its operator, so the
+   * length is accumulated digit by digit and stored at the operator. */
+  uint32_t *element = cigar;
+  uint32_t operation_length = 0;
+  for (index = 0; index < length; index++)
     {
-      switch (segment->cigar[cigar_index])
+      uint8_t character = (uint8_t)text[index];
+      uint8_t digit = (uint8_t)(character - '0');
+      if (digit < 10)
+        operation_length = operation_length * 10 + digit;
+      else
         {
-        case 'I':
-        case 'D':
-        case 'M':
-        case 'N':
-        case '=':
-        case 'X':
-          break;
-        case 'S':
-        case 'H':
-          segment->clip = atoi (buffer);
-          return segment->clip;
-          break;
-        default:
-          {
-            buffer[buffer_index] = segment->cigar[cigar_index];
-            buffer_index++;
-
-            /* We don't want to clear the buffer when it hasn't reached an
-             * action yet.  We therefore skip the rest of the loop. */
-            continue;
-          }
-          break;
-        }
+          if (nsv_cigar_operations[character] != 0)
+            {
+              *element = operation_length << 4
+                         | (nsv_cigar_operations[character] - 1);
+              element++;
+            }
 
-      memset (buffer, '\0', buffer_index);
-      buffer_index = 0;
+          operation_length = 0;
+        }
     }
 
-  return -1;
+  nsv_cigar_overview (cigar, elements, overview);
+  *length_ptr = elements;
+  return cigar;
+}
+
+char *
+nsv_segment_cigar_string (struct nsv_segment_t *segment)
+{
+  if (segment == NULL)
+    return NULL;
+
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+  if (cold->cigar_len == 0)
+    return strdup ("*");
+
+  /* Each operation takes at most nine digits and one operator. */
+  char *text = malloc (cold->cigar_len * 10 + 1);
+  if (text == NULL)
+    return NULL;
+
+  char *position = text;
+  uint32_t index;
+  for (index = 0; index < cold->cigar_len; index++)
+    position += sprintf (position, "%u%c",
+                         nsv_cigar_length (cold->cigar[index]),
+                         nsv_cigar_operator (cold->cigar[index]));
+
+  return text;
+}
+
+void
+nsv_segment_cigar_decode (struct nsv_segment_t *segment)
+{
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+  struct nsv_segment_cigar_overview_t overview;
+  nsv_cigar_overview (cold->cigar, cold->cigar_len, &overview);
+  nsv_segment_set_overview (segment, &overview);
 }
 
 struct nsv_segment_cigar_overview_t
 nsv_segment_cigar_overview (struct nsv_segment_t *segment)
 {
-  struct nsv_segment_cigar_overview_t overview =
-    { .insertions = 0, .deletions = 0, .matches = 0 };
+  return nsv_segment_cold (segment)->overview;
+}
+
+uint32_t
+nsv_segment_cigar_query_length (struct nsv_segment_t *segment)
+{
+  return (segment == NULL)
+         ? 0
+         : nsv_segment_cold (segment)->overview.query_length;
+}
+
+uint32_t
+nsv_segment_cigar_reference_length (struct nsv_segment_t *segment)
+{
+  return (segment == NULL)
+         ? 0
+         : nsv_segment_cold (segment)->overview.reference_length;
+}
+
+/* Creates a segment from a single "rname,pos,strand,CIGAR,mapQ,NM" entry of
+ * an SA tag.  'entry' does not have to be null-terminated. */
+static struct nsv_segment_t *
+nsv_segment_from_sa_entry (const char *entry, const char *end,
+                           struct nsv_contigs_t *contigs,
+                           struct nsv_arena_t *arena)
+{
+  const char *fields[6];
+  const char *position = entry;
+  uint8_t field_index;
+  for (field_index = 0; field_index < 6; field_index++)
+    {
+      fields[field_index] = position;
+      position = memchr (position, ',', end - position);
+      if (position == NULL)
+        position = end;
+      else if (field_index < 5)
+        position++;
+    }
 
+  /* Each entry must have exactly six fields. */
+  if (position != end || fields[5] >= end)
+    return NULL;
+
+  struct nsv_segment_t *segment = nsv_segment_new_in_arena (arena);
   if (segment == NULL)
-    return overview;
+    return NULL;
 
-  if (segment->cigar == NULL)
-    return overview;
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+  char *rname = strndup (fields[0], fields[1] - fields[0] - 1);
+  struct nsv_segment_cigar_overview_t overview;
+  cold->cigar = nsv_segment_cigar_from_text (fields[3],
+                                             fields[4] - fields[3] - 1,
+                                             arena, &(cold->cigar_len),
+                                             &overview);
+  if (rname == NULL || cold->cigar == NULL
+      || !nsv_segment_parse_contig (contigs, rname, &(segment->rname_id)))
+    {
+      free (rname);
+      nsv_segment_destroy (segment);
+      return NULL;
+    }
 
-  uint32_t cigar_len = strlen (segment->cigar);
-  if (cigar_len == 0)
-    return overview;
+  free (rname);
 
-  /* We assume a number won't have more than 64 digits here. :) */
-  char buffer[64];
-  memset (buffer, '\0', 64);
+  segment->flag = 0x800 | ((*fields[2] == '-') ? 0x10 : 0);
+  segment->pos = nsv_segment_parse_int32 (fields[1], fields[2]);
+  segment->mapq = nsv_segment_parse_int32 (fields[4], fields[5]);
+  cold->nm = nsv_segment_parse_int32 (fields[5], end);
 
-  uint32_t cigar_index = 0;
-  uint32_t buffer_index = 0;
-  for (; cigar_index < cigar_len; cigar_index++)
+  /* An SA entry has no sequence, so its length comes from the CIGAR. */
+  nsv_segment_set_overview (segment, &overview);
+  return segment;
+}
+
+bool
+nsv_segment_sa_segments (struct nsv_segment_t *segment,
+                         struct nsv_contigs_t *contigs,
+                         struct nsv_arena_t *arena, GList **segments_ptr)
+{
+  if (segment == NULL || contigs == NULL || segments_ptr == NULL)
+    return false;
+
+  const char *entry = nsv_segment_cold (segment)->sa;
+  if (entry == NULL)
+    return true;
+
+  /* Entries are separated by semicolons, and the last one ends with one. */
+  while (*entry != '\0')
     {
-      switch (segment->cigar[cigar_index])
+      const char *end = strchr (entry, ';');
+      if (end == NULL)
+        end = entry + strlen (entry);
+
+      struct nsv_segment_t *supplementary;
+      supplementary = nsv_segment_from_sa_entry (entry, end, contigs, arena);
+      if (supplementary == NULL)
         {
-        case 'I': overview.insertions        += atoi (buffer); break;
-        case 'D': overview.deletions         += atoi (buffer); break;
-        case 'M': overview.alignment_matches += atoi (buffer); break;
-        case 'N': overview.skipped           += atoi (buffer); break;
-        case 'S': overview.soft_clip          = atoi (buffer); break;
-        case 'H': overview.hard_clip          = atoi (buffer); break;
-        case 'P': overview.padding           += atoi (buffer); break;
-        case '=': overview.matches           += atoi (buffer); break;
-        case 'X': overview.mismatches        += atoi (buffer); break;
-        default:
-          {
-            buffer[buffer_index] = segment->cigar[cigar_index];
-            buffer_index++;
-
-            /* We don't want to clear the buffer when it hasn't reached an
-             * action yet.  We therefore skip the rest of the loop. */
-            continue;
-          }
-          break;
+          infra_logger_log (nsv_config.logger, LOG_ERROR,
+                            "Encountered a malformed SA tag.\n");
+          return false;
         }
 
-      memset (buffer, '\0', buffer_index);
-      buffer_index = 0;
+      *segments_ptr = g_list_prepend (*segments_ptr, supplementary);
+      entry = (*end == ';') ? end + 1 : end;
     }
 
-  return overview;
+  return true;
+}
+
+float
+nsv_segment_cigar_pid (struct nsv_segment_t *segment)
+{
+  return (segment == NULL) ? -1 : segment->pid;
+}
+
+int32_t
+nsv_segment_cigar_first_clip (struct nsv_segment_t *segment)
+{
+  return (segment == NULL) ? -1 : segment->clip;
+}
+
+int32_t
+nsv_segment_cigar_last_clip (struct nsv_segment_t *segment)
+{
+  return (segment == NULL)
+         ? -1
+         : nsv_segment_cold (segment)->overview.last_clip;
 }
 
 void
@@ -354,10 +837,22 @@ nsv_segment_destroy (void *segment_obj)
       return;
     }
 
-  free (segment->rname);
-  free (segment->cigar);
-  free (segment->rnext);
-  free (segment->seq);
-  free (segment->qual);
+  if (segment->in_arena)
+    return;
+
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+
+  /* In zero-copy mode, the strings are owned by the chunk.  The CIGAR
+   * operations are never part of the input. */
+  free (cold->cigar);
+  if (cold->chunk != NULL)
+    nsv_chunk_unref (cold->chunk);
+  else
+    {
+      free (cold->seq);
+      free (cold->qual);
+      free (cold->sa);
+    }
+
   free (segment);
 }
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "segments.h"
+#include "nanosvc.h"
+
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+/* Allocates the columns for 'length' segments and 'reads_len' reads. */
+static bool
+nsv_segments_alloc (struct nsv_segments_t *segments, uint32_t length,
+                    uint32_t reads_len)
+{
+  /* malloc (0) may return NULL, so at least one row is allocated.  The
+   * offsets have an extra element for the end of the last read, and the
+   * reads get one as well, so that neither is ever empty. */
+  size_t rows = (length > 0) ? length : 1;
+
+  segments->length = length;
+  segments->flag = malloc (rows * sizeof (uint16_t));
+  segments->rname_id = malloc (rows * sizeof (int32_t));
+  segments->pos = malloc (rows * sizeof (int32_t));
+  segments->end = malloc (rows * sizeof (int32_t));
+  segments->mapq = malloc (rows * sizeof (uint8_t));
+  segments->clip = malloc (rows * sizeof (int32_t));
+  segments->pid = malloc (rows * sizeof (float));
+  segments->seq_len = malloc (rows * sizeof (uint32_t));
+  segments->read = malloc (rows * sizeof (uint32_t));
+  segments->segments = malloc (rows * sizeof (struct nsv_segment_t *));
+
+  segments->reads_len = reads_len;
+  segments->reads = malloc ((reads_len + 1) * sizeof (struct nsv_read_t *));
+  segments->read_offsets = malloc ((reads_len + 1) * sizeof (uint32_t));
+
+  return (segments->flag != NULL && segments->rname_id != NULL
+          && segments->pos != NULL && segments->end != NULL
+          && segments->mapq != NULL && segments->clip != NULL
+          && segments->pid != NULL && segments->seq_len != NULL
+          && segments->read != NULL && segments->segments != NULL
+          && segments->reads != NULL && segments->read_offsets != NULL);
+}
+
+struct nsv_segments_t *
+nsv_segments_from_reads (GList *reads)
+{
+  uint32_t length = 0;
+  uint32_t reads_len = 0;
+  GList *iterator;
+  for (iterator = reads; iterator != NULL; iterator = iterator->next)
+    {
+      struct nsv_read_t *read_obj = iterator->data;
+      if (read_obj == NULL)
+        continue;
+
+      length += g_list_length (read_obj->segments);
+      reads_len++;
+    }
+
+  struct nsv_segments_t *segments;
+  segments = calloc (1, sizeof (struct nsv_segments_t));
+  if (segments == NULL || !nsv_segments_alloc (segments, length, reads_len))
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      nsv_segments_destroy (segments);
+      return NULL;
+    }
+
+  uint32_t row = 0;
+  uint32_t read_index = 0;
+  for (iterator = reads; iterator != NULL; iterator = iterator->next)
+    {
+      struct nsv_read_t *read_obj = iterator->data;
+      if (read_obj == NULL)
+        continue;
+
+      segments->reads[read_index] = read_obj;
+      segments->read_offsets[read_index] = row;
+
+      GList *link;
+      for (link = read_obj->segments; link != NULL; link = link->next)
+        {
+          struct nsv_segment_t *segment = link->data;
+          segments->flag[row] = segment->flag;
+          segments->rname_id[row] = segment->rname_id;
+          segments->pos[row] = segment->pos;
+          segments->end[row] = segment->end;
+          segments->mapq[row] = segment->mapq;
+          segments->clip[row] = nsv_segment_cigar_first_clip (segment);
+          segments->pid[row] = nsv_segment_cigar_pid (segment);
+          segments->seq_len[row] = segment->seq_len;
+          segments->read[row] = read_index;
+          segments->segments[row] = segment;
+          row++;
+        }
+
+      read_index++;
+    }
+
+  segments->read_offsets[reads_len] = length;
+  return segments;
+}
+
+/* Moves row 'from' to row 'to', which must be free. */
+static inline void
+nsv_segments_move_row (struct nsv_segments_t *segments, uint32_t to,
+                       uint32_t from)
+{
+  segments->flag[to] = segments->flag[from];
+  segments->rname_id[to] = segments->rname_id[from];
+  segments->pos[to] = segments->pos[from];
+  segments->end[to] = segments->end[from];
+  segments->mapq[to] = segments->mapq[from];
+  segments->clip[to] = segments->clip[from];
+  segments->pid[to] = segments->pid[from];
+  segments->seq_len[to] = segments->seq_len[from];
+  segments->read[to] = segments->read[from];
+  segments->segments[to] = segments->segments[from];
+}
+
+void
+nsv_segments_sort_by_clip (struct nsv_segments_t *segments)
+{
+  if (segments == NULL)
+    return;
+
+  /* A read has only a handful of segments, so an insertion sort is both
+   * the fastest and a stable choice. */
+  uint32_t read_index;
+  for (read_index = 0; read_index < segments->reads_len; read_index++)
+    {
+      uint32_t first = segments->read_offsets[read_index];
+      uint32_t last = segments->read_offsets[read_index + 1];
+      uint32_t row;
+      for (row = first + 1; row < last; row++)
+        {
+          int32_t clip = segments->clip[row];
+          if (segments->clip[row - 1] <= clip)
+            continue;
+
+          struct nsv_segment_t *segment = segments->segments[row];
+          uint16_t flag = segments->flag[row];
+          int32_t rname_id = segments->rname_id[row];
+          int32_t pos = segments->pos[row];
+          int32_t end = segments->end[row];
+          uint8_t mapq = segments->mapq[row];
+          float pid = segments->pid[row];
+          uint32_t seq_len = segments->seq_len[row];
+
+          uint32_t position = row;
+          while (position > first && segments->clip[position - 1] > clip)
+            {
+              nsv_segments_move_row (segments, position, position - 1);
+              position--;
+            }
+
+          segments->flag[position] = flag;
+          segments->rname_id[position] = rname_id;
+          segments->pos[position] = pos;
+          segments->end[position] = end;
+          segments->mapq[position] = mapq;
+          segments->clip[position] = clip;
+          segments->pid[position] = pid;
+          segments->seq_len[position] = seq_len;
+          segments->read[position] = read_index;
+          segments->segments[position] = segment;
+        }
+    }
+}
+
+void
+nsv_segments_destroy (struct nsv_segments_t *segments)
+{
+  if (segments == NULL)
+    return;
+
+  free (segments->flag);
+  free (segments->rname_id);
+  free (segments->pos);
+  free (segments->end);
+  free (segments->mapq);
+  free (segments->clip);
+  free (segments->pid);
+  free (segments->seq_len);
+  free (segments->read);
+  free (segments->segments);
+  free (segments->reads);
+  free (segments->read_offsets);
+  free (segments);
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2016  Roel Janssen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stream.h"
+#include "nanosvc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <libinfra/logger.h>
+
+extern struct nsv_config_t nsv_config;
+
+struct nsv_chunk_t *
+nsv_chunk_new (size_t capacity)
+{
+  /* The spare byte allows a caller to terminate the last line in the chunk,
+   * even when it fills the chunk up to its capacity. */
+  struct nsv_chunk_t *chunk = malloc (sizeof (struct nsv_chunk_t)
+                                      + capacity + 1);
+  if (chunk == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  chunk->references = 1;
+  chunk->capacity = capacity;
+  return chunk;
+}
+
+struct nsv_chunk_t *
+nsv_chunk_ref (struct nsv_chunk_t *chunk)
+{
+  if (chunk != NULL)
+    g_atomic_int_inc (&(chunk->references));
+
+  return chunk;
+}
+
+void
+nsv_chunk_unref (struct nsv_chunk_t *chunk)
+{
+  if (chunk != NULL && g_atomic_int_dec_and_test (&(chunk->references)))
+    free (chunk);
+}
+
+struct nsv_stream_t *
+nsv_stream_new (FILE *file)
+{
+  if (file == NULL)
+    return NULL;
+
+  struct nsv_stream_t *stream = calloc (1, sizeof (struct nsv_stream_t));
+  if (stream == NULL)
+    {
+      infra_logger_error_alloc (nsv_config.logger);
+      return NULL;
+    }
+
+  stream->chunk = nsv_chunk_new (NSV_STREAM_BUFFER_SIZE);
+  if (stream->chunk == NULL)
+    {
+      free (stream);
+      return NULL;
+    }
+
+  stream->file = file;
+  return stream;
+}
+
+static bool
+nsv_stream_fill (struct nsv_stream_t *stream)
+{
+  struct nsv_chunk_t *chunk = stream->chunk;
+  size_t remaining = stream->end - stream->begin;
+
+  /* A single line can be longer than the chunk. */
+  size_t capacity = chunk->capacity;
+  if (remaining == capacity)
+    capacity *= 2;
+
+  /* When segments still point into the current chunk, or when the chunk is
+   * too small, the incomplete line is carried over to a new chunk.
+   * Otherwise, it is moved to the start of the current chunk. */
+  if (g_atomic_int_get (&(chunk->references)) > 1
+      || capacity != chunk->capacity)
+    {
+      struct nsv_chunk_t *next = nsv_chunk_new (capacity);
+      if (next == NULL)
+        {
+          stream->error = true;
+          return false;
+        }
+
+      memcpy (next->data, chunk->data + stream->begin, remaining);
+      nsv_chunk_unref (chunk);
+      stream->chunk = next;
+    }
+  else if (stream->begin > 0)
+    memmove (chunk->data, chunk->data + stream->begin, remaining);
+
+  stream->begin = 0;
+  stream->end = remaining;
+
+  chunk = stream->chunk;
+  size_t bytes = fread (chunk->data + stream->end, 1,
+                        chunk->capacity - stream->end, stream->file);
+  if (bytes == 0 && ferror (stream->file))
+    {
+      infra_logger_log (nsv_config.logger, LOG_ERROR,
+                        "Could not read the input.");
+      stream->error = true;
+      return false;
+    }
+
+  if (bytes == 0)
+    stream->eof = true;
+
+  stream->end += bytes;
+  return true;
+}
+
+char *
+nsv_stream_next_line (struct nsv_stream_t *stream, size_t *length_ptr)
+{
+  if (stream == NULL || length_ptr == NULL)
+    return NULL;
+
+  /* Bytes before 'scanned' are known not to contain a newline. */
+  size_t scanned = stream->begin;
+  while (true)
+    {
+      char *start = stream->chunk->data + stream->begin;
+      char *newline = memchr (stream->chunk->data + scanned, '\n',
+                              stream->end - scanned);
+      if (newline != NULL)
+        {
+          *length_ptr = newline - start;
+          stream->begin = newline - stream->chunk->data + 1;
+          return start;
+        }
+
+      if (stream->eof)
+        {
+          /* The last line does not need to end with a newline. */
+          if (stream->begin == stream->end)
+            return NULL;
+
+          *length_ptr = stream->end - stream->begin;
+          stream->begin = stream->end;
+          return start;
+        }
+
+      scanned = stream->end - stream->begin;
+      if (!nsv_stream_fill (stream))
+        return NULL;
+    }
+}
+
+char *
+nsv_stream_next_lines (struct nsv_stream_t *stream, size_t *length_ptr)
+{
+  if (stream == NULL || length_ptr == NULL)
+    return NULL;
+
+  while (true)
+    {
+      char *start = stream->chunk->data + stream->begin;
+      char *last = stream->chunk->data + stream->end;
+
+      /* The incomplete line at the end of the buffer is usually short, so
+       * it is found quickly by scanning backwards. */
+      while (last > start && last[-1] != '\n')
+        last--;
+
+      if (last > start)
+        {
+          *length_ptr = last - start;
+          stream->begin += last - start;
+          return start;
+        }
+
+      if (stream->eof)
+        {
+          /* The last line does not need to end with a newline. */
+          if (stream->begin == stream->end)
+            return NULL;
+
+          *length_ptr = stream->end - stream->begin;
+          stream->begin = stream->end;
+          return start;
+        }
+
+      if (!nsv_stream_fill (stream))
+        return NULL;
+    }
+}
+
+void
+nsv_stream_destroy (struct nsv_stream_t *stream)
+{
+  if (stream == NULL)
+    return;
+
+  nsv_chunk_unref (stream->chunk);
+  free (stream);
+}
@@ -22,95 +22,593 @@
 #include <string.h>
 #include <stdlib.h>
 
-struct trie_node_t *
-trie_new (void)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The number of prefix bytes that are stored in a node.  Longer prefixes
+ * are checked against a leaf below the node. */
+#define TRIE_MAX_PREFIX_LEN 10
+
+/* The size of the blocks that nodes and leaves are allocated from. */
+#define TRIE_POOL_BLOCK_SIZE (256 * 1024)
+
+/* Leaves are told apart from inner nodes by the lowest bit of their
+ * address, which is otherwise always zero. */
+#define TRIE_IS_LEAF(x)  (((uintptr_t)(x)) & 1)
+#define TRIE_LEAF(x)     \
+  ((struct trie_leaf_t *)((uintptr_t)(x) & ~(uintptr_t)1))
+#define TRIE_TAG_LEAF(x) ((void *)((uintptr_t)(x) | 1))
+
+enum trie_node_type_e {
+  TRIE_NODE4 = 0,
+  TRIE_NODE16,
+  TRIE_NODE48,
+  TRIE_NODE256,
+  TRIE_NODE_TYPES
+};
+
+/* The part that all inner nodes have in common. */
+struct trie_inner_t
 {
-  return calloc (1, sizeof (struct trie_node_t));
-}
+  uint32_t prefix_len;          /* The length of the compressed path. */
+  uint16_t children_len;        /* The number of children. */
+  uint8_t type;                 /* One of trie_node_type_e. */
+  unsigned char prefix[TRIE_MAX_PREFIX_LEN];
+};
+
+/* Nodes with up to 4 or 16 children keep their keys sorted. */
+struct trie_node4_t
+{
+  struct trie_inner_t inner;
+  unsigned char keys[4];
+  void *children[4];
+};
 
-static struct trie_node_t *
-trie_create_path (const char *key, void *element)
+struct trie_node16_t
 {
-  if (key == NULL || element == NULL)
-    return NULL;
+  struct trie_inner_t inner;
+  unsigned char keys[16];
+  void *children[16];
+};
 
-  struct trie_node_t *node = trie_new ();
-  if (node == NULL)
-    return NULL;
+/* Nodes with up to 48 children map each byte to a child index plus one. */
+struct trie_node48_t
+{
+  struct trie_inner_t inner;
+  unsigned char keys[256];
+  void *children[48];
+};
 
-  node->key = key[0];
+struct trie_node256_t
+{
+  struct trie_inner_t inner;
+  void *children[256];
+};
+
+/* A leaf holds the whole name, including its null character.  Because of
+ * that null character, no name is a prefix of another name. */
+struct trie_leaf_t
+{
+  void *element;
+  uint32_t key_len;
+  unsigned char key[];
+};
+
+struct trie_pool_block_t
+{
+  struct trie_pool_block_t *next;
+  size_t used;
+  size_t size;
+  void *data[];                 /* Aligned for pointers. */
+};
+
+/* Nodes that were replaced by a larger node are kept in 'free_nodes' to be
+ * reused.  Everything is freed at once when the trie is destroyed. */
+struct trie_pool_t
+{
+  struct trie_pool_block_t *blocks;
+  void *free_nodes[TRIE_NODE_TYPES];
+};
+
+static const size_t trie_node_sizes[TRIE_NODE_TYPES] = {
+  sizeof (struct trie_node4_t),
+  sizeof (struct trie_node16_t),
+  sizeof (struct trie_node48_t),
+  sizeof (struct trie_node256_t)
+};
+
+static void *
+trie_pool_alloc (struct trie_pool_t *pool, size_t size)
+{
+  /* Keep every allocation aligned for pointers, and the lowest bit of
+   * every address free for the leaf tag. */
+  size = (size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
 
-  if (strlen (key) > 1)
+  struct trie_pool_block_t *block = pool->blocks;
+  if (block == NULL || block->size - block->used < size)
     {
-      struct trie_node_t **children;
-      struct trie_node_t *child;
-      child = trie_create_path (key + 1, element);
-      children = realloc (node->children, sizeof (struct trie_node_t *) *
-                                          (node->children_len + 1));
+      size_t block_size = (size > TRIE_POOL_BLOCK_SIZE)
+                          ? size
+                          : TRIE_POOL_BLOCK_SIZE;
 
-      if (children == NULL)
+      block = malloc (sizeof (struct trie_pool_block_t) + block_size);
+      if (block == NULL)
         return NULL;
-      else
-        {
-          children[node->children_len] = child;
-          node->children = children;
-          node->children_len++;
-        }
+
+      block->next = pool->blocks;
+      block->used = 0;
+      block->size = block_size;
+      pool->blocks = block;
     }
+
+  void *memory = (char *)block->data + block->used;
+  block->used += size;
+  return memory;
+}
+
+static struct trie_inner_t *
+trie_node_new (struct trie_pool_t *pool, enum trie_node_type_e type)
+{
+  struct trie_inner_t *node = pool->free_nodes[type];
+  if (node != NULL)
+    pool->free_nodes[type] = *(void **)node;
   else
-      node->element = element;
+    node = trie_pool_alloc (pool, trie_node_sizes[type]);
+
+  if (node == NULL)
+    return NULL;
 
+  memset (node, 0, trie_node_sizes[type]);
+  node->type = type;
   return node;
 }
 
-bool
-trie_insert (struct trie_node_t *trie, const char *name, void *element)
+static void
+trie_node_free (struct trie_pool_t *pool, struct trie_inner_t *node)
 {
-  if (trie == NULL || element == NULL)
-    return false;
+  enum trie_node_type_e type = node->type;
+  *(void **)node = pool->free_nodes[type];
+  pool->free_nodes[type] = node;
+}
 
-  size_t name_len = strlen (name);
-  size_t position = 0;
-  struct trie_node_t *node = trie;
+static struct trie_leaf_t *
+trie_leaf_new (struct trie_pool_t *pool, const unsigned char *key,
+               uint32_t key_len, void *element)
+{
+  struct trie_leaf_t *leaf;
+  leaf = trie_pool_alloc (pool, sizeof (struct trie_leaf_t) + key_len);
+  if (leaf == NULL)
+    return NULL;
 
-  size_t child_index = 0;
-  struct trie_node_t *child;
+  leaf->element = element;
+  leaf->key_len = key_len;
+  memcpy (leaf->key, key, key_len);
+  return leaf;
+}
 
-  while (position < name_len && child_index < node->children_len)
+static inline bool
+trie_leaf_matches (struct trie_leaf_t *leaf, const unsigned char *key,
+                   uint32_t key_len)
+{
+  return (leaf->key_len == key_len && !memcmp (leaf->key, key, key_len));
+}
+
+/* Returns the slot of the child for 'byte', or NULL. */
+static void **
+trie_find_child (struct trie_inner_t *node, unsigned char byte)
+{
+  switch (node->type)
+    {
+    case TRIE_NODE4:
+      {
+        struct trie_node4_t *node4 = (struct trie_node4_t *)node;
+        uint16_t index;
+        for (index = 0; index < node->children_len; index++)
+          if (node4->keys[index] == byte)
+            return &(node4->children[index]);
+      }
+      break;
+    case TRIE_NODE16:
+      {
+        struct trie_node16_t *node16 = (struct trie_node16_t *)node;
+#ifdef __SSE2__
+        /* Compare all keys at once. */
+        __m128i keys = _mm_loadu_si128 ((const __m128i *)node16->keys);
+        __m128i matches = _mm_cmpeq_epi8 (_mm_set1_epi8 ((char)byte), keys);
+        uint32_t mask = _mm_movemask_epi8 (matches)
+                        & ((1U << node->children_len) - 1);
+        if (mask != 0)
+          return &(node16->children[__builtin_ctz (mask)]);
+#else
+        uint16_t index;
+        for (index = 0; index < node->children_len; index++)
+          if (node16->keys[index] == byte)
+            return &(node16->children[index]);
+#endif
+      }
+      break;
+    case TRIE_NODE48:
+      {
+        struct trie_node48_t *node48 = (struct trie_node48_t *)node;
+        if (node48->keys[byte] != 0)
+          return &(node48->children[node48->keys[byte] - 1]);
+      }
+      break;
+    case TRIE_NODE256:
+      {
+        struct trie_node256_t *node256 = (struct trie_node256_t *)node;
+        if (node256->children[byte] != NULL)
+          return &(node256->children[byte]);
+      }
+      break;
+    }
+
+  return NULL;
+}
+
+/* Returns the leftmost leaf below 'node'. */
+static struct trie_leaf_t *
+trie_minimum (void *node)
+{
+  while (node != NULL && !TRIE_IS_LEAF (node))
     {
-      child = node->children[child_index];
-      if (child->key == name[position])
+      struct trie_inner_t *inner = node;
+      switch (inner->type)
         {
-          node = child;
-          child_index = 0;
-          position++;
+        case TRIE_NODE4:
+          node = ((struct trie_node4_t *)inner)->children[0];
+          break;
+        case TRIE_NODE16:
+          node = ((struct trie_node16_t *)inner)->children[0];
+          break;
+        case TRIE_NODE48:
+          {
+            struct trie_node48_t *node48 = (struct trie_node48_t *)inner;
+            uint16_t byte = 0;
+            while (node48->keys[byte] == 0)
+              byte++;
+            node = node48->children[node48->keys[byte] - 1];
+          }
+          break;
+        case TRIE_NODE256:
+          {
+            struct trie_node256_t *node256 = (struct trie_node256_t *)inner;
+            uint16_t byte = 0;
+            while (node256->children[byte] == NULL)
+              byte++;
+            node = node256->children[byte];
+          }
+          break;
         }
-      else
-        child_index++;
     }
 
-  if (position == name_len)
-    node->element = element;
-  else if (position < name_len)
+  return (node == NULL) ? NULL : TRIE_LEAF (node);
+}
+
+/* Returns the number of bytes of the stored prefix of 'node' that match
+ * 'key' at 'depth'. */
+static inline uint32_t
+trie_check_prefix (struct trie_inner_t *node, const unsigned char *key,
+                   uint32_t key_len, uint32_t depth)
+{
+  uint32_t length = (node->prefix_len < TRIE_MAX_PREFIX_LEN)
+                    ? node->prefix_len
+                    : TRIE_MAX_PREFIX_LEN;
+  if (length > key_len - depth)
+    length = key_len - depth;
+
+  uint32_t index;
+  for (index = 0; index < length; index++)
+    if (node->prefix[index] != key[depth + index])
+      break;
+
+  return index;
+}
+
+/* Like trie_check_prefix, but for the whole prefix, of which the part
+ * that is not stored in the node is taken from a leaf below it. */
+static uint32_t
+trie_prefix_mismatch (struct trie_inner_t *node, const unsigned char *key,
+                      uint32_t key_len, uint32_t depth)
+{
+  uint32_t index = trie_check_prefix (node, key, key_len, depth);
+  if (index < TRIE_MAX_PREFIX_LEN || node->prefix_len <= TRIE_MAX_PREFIX_LEN)
+    return index;
+
+  struct trie_leaf_t *leaf = trie_minimum (node);
+  uint32_t length = node->prefix_len;
+  if (length > leaf->key_len - depth)
+    length = leaf->key_len - depth;
+  if (length > key_len - depth)
+    length = key_len - depth;
+
+  for (; index < length; index++)
+    if (leaf->key[depth + index] != key[depth + index])
+      break;
+
+  return index;
+}
+
+static void
+trie_copy_header (struct trie_inner_t *destination,
+                  struct trie_inner_t *source)
+{
+  destination->children_len = source->children_len;
+  destination->prefix_len = source->prefix_len;
+  memcpy (destination->prefix, source->prefix, TRIE_MAX_PREFIX_LEN);
+}
+
+/* Adds 'child' under 'byte' to 'node'.  When 'node' is full, it is
+ * replaced by a larger node in 'reference'. */
+static bool
+trie_add_child (struct trie_pool_t *pool, struct trie_inner_t *node,
+                void **reference, unsigned char byte, void *child)
+{
+  switch (node->type)
     {
-      struct trie_node_t *branch;
-      branch = trie_create_path (name + position, element);
-      if (branch == NULL)
-        return false;
+    case TRIE_NODE4:
+    case TRIE_NODE16:
+      {
+        uint16_t capacity = (node->type == TRIE_NODE4) ? 4 : 16;
+        unsigned char *keys = (node->type == TRIE_NODE4)
+                              ? ((struct trie_node4_t *)node)->keys
+                              : ((struct trie_node16_t *)node)->keys;
+        void **children = (node->type == TRIE_NODE4)
+                          ? ((struct trie_node4_t *)node)->children
+                          : ((struct trie_node16_t *)node)->children;
+
+        if (node->children_len < capacity)
+          {
+            uint16_t index = 0;
+            while (index < node->children_len && keys[index] < byte)
+              index++;
+
+            memmove (keys + index + 1, keys + index,
+                     node->children_len - index);
+            memmove (children + index + 1, children + index,
+                     (node->children_len - index) * sizeof (void *));
+
+            keys[index] = byte;
+            children[index] = child;
+            node->children_len++;
+            return true;
+          }
+
+        /* Grow to the next node type. */
+        struct trie_inner_t *larger;
+        larger = trie_node_new (pool, (node->type == TRIE_NODE4)
+                                      ? TRIE_NODE16
+                                      : TRIE_NODE48);
+        if (larger == NULL)
+          return false;
+
+        trie_copy_header (larger, node);
+        if (larger->type == TRIE_NODE16)
+          {
+            struct trie_node16_t *node16 = (struct trie_node16_t *)larger;
+            memcpy (node16->keys, keys, capacity);
+            memcpy (node16->children, children, capacity * sizeof (void *));
+          }
+        else
+          {
+            struct trie_node48_t *node48 = (struct trie_node48_t *)larger;
+            uint16_t index;
+            for (index = 0; index < capacity; index++)
+              {
+                node48->keys[keys[index]] = index + 1;
+                node48->children[index] = children[index];
+              }
+          }
+
+        *reference = larger;
+        trie_node_free (pool, node);
+        return trie_add_child (pool, larger, reference, byte, child);
+      }
+    case TRIE_NODE48:
+      {
+        struct trie_node48_t *node48 = (struct trie_node48_t *)node;
+        if (node->children_len < 48)
+          {
+            uint16_t index = 0;
+            while (node48->children[index] != NULL)
+              index++;
+
+            node48->children[index] = child;
+            node48->keys[byte] = index + 1;
+            node->children_len++;
+            return true;
+          }
+
+        struct trie_node256_t *node256;
+        node256 = (struct trie_node256_t *)trie_node_new (pool, TRIE_NODE256);
+        if (node256 == NULL)
+          return false;
+
+        trie_copy_header (&(node256->inner), node);
+        uint16_t key;
+        for (key = 0; key < 256; key++)
+          if (node48->keys[key] != 0)
+            node256->children[key] = node48->children[node48->keys[key] - 1];
+
+        *reference = node256;
+        trie_node_free (pool, node);
+        return trie_add_child (pool, &(node256->inner), reference, byte,
+                               child);
+      }
+    case TRIE_NODE256:
+      {
+        struct trie_node256_t *node256 = (struct trie_node256_t *)node;
+        node256->children[byte] = child;
+        node->children_len++;
+        return true;
+      }
+    }
+
+  return false;
+}
+
+/* Creates a node with two children: the existing 'node' or leaf under
+ * 'byte', and a new leaf for 'key' under 'key[depth + prefix_len]'. */
+static struct trie_inner_t *
+trie_split (struct trie_node_t *trie, void *node, unsigned char byte,
+            const unsigned char *key, uint32_t key_len, void *element,
+            uint32_t depth, uint32_t prefix_len)
+{
+  struct trie_inner_t *node4 = trie_node_new (trie->pool, TRIE_NODE4);
+  struct trie_leaf_t *leaf = trie_leaf_new (trie->pool, key, key_len,
+                                            element);
+  if (node4 == NULL || leaf == NULL)
+    return NULL;
+
+  node4->prefix_len = prefix_len;
+  memcpy (node4->prefix, key + depth,
+          (prefix_len < TRIE_MAX_PREFIX_LEN) ? prefix_len
+                                             : TRIE_MAX_PREFIX_LEN);
 
-      struct trie_node_t **children;
-      children = realloc (node->children, sizeof (struct trie_node_t *) *
-                                          (node->children_len + 1));
+  /* A node with room for four children does not grow here. */
+  trie_add_child (trie->pool, node4, NULL, byte, node);
+  trie_add_child (trie->pool, node4, NULL, key[depth + prefix_len],
+                  TRIE_TAG_LEAF (leaf));
 
-      if (children == NULL)
+  trie->elements_len++;
+  return node4;
+}
+
+static bool
+trie_insert_at (struct trie_node_t *trie, void **reference,
+                const unsigned char *key, uint32_t key_len, void *element,
+                uint32_t depth)
+{
+  while (true)
+    {
+      void *node = *reference;
+      if (node == NULL)
+        {
+          struct trie_leaf_t *leaf = trie_leaf_new (trie->pool, key, key_len,
+                                                    element);
+          if (leaf == NULL)
+            return false;
+
+          *reference = TRIE_TAG_LEAF (leaf);
+          trie->elements_len++;
+          return true;
+        }
+
+      /* Replace a leaf by a node that holds both the leaf and the new
+       * name, with their common bytes as its prefix. */
+      if (TRIE_IS_LEAF (node))
+        {
+          struct trie_leaf_t *leaf = TRIE_LEAF (node);
+          if (trie_leaf_matches (leaf, key, key_len))
+            {
+              leaf->element = element;
+              return true;
+            }
+
+          uint32_t prefix_len = 0;
+          while (leaf->key[depth + prefix_len] == key[depth + prefix_len])
+            prefix_len++;
+
+          struct trie_inner_t *split;
+          split = trie_split (trie, node, leaf->key[depth + prefix_len],
+                              key, key_len, element, depth, prefix_len);
+          if (split == NULL)
+            return false;
+
+          *reference = split;
+          return true;
+        }
+
+      /* Split the prefix of a node where it differs from the name. */
+      struct trie_inner_t *inner = node;
+      if (inner->prefix_len > 0)
+        {
+          uint32_t mismatch = trie_prefix_mismatch (inner, key, key_len,
+                                                    depth);
+          if (mismatch < inner->prefix_len)
+            {
+              /* The byte where the node's prefix differs, from the node
+               * itself or from a leaf below it when it is not stored. */
+              unsigned char byte;
+              const unsigned char *rest;
+              if (inner->prefix_len <= TRIE_MAX_PREFIX_LEN)
+                {
+                  byte = inner->prefix[mismatch];
+                  rest = inner->prefix + mismatch + 1;
+                }
+              else
+                {
+                  struct trie_leaf_t *minimum = trie_minimum (inner);
+                  byte = minimum->key[depth + mismatch];
+                  rest = minimum->key + depth + mismatch + 1;
+                }
+
+              struct trie_inner_t *split;
+              split = trie_split (trie, node, byte, key, key_len, element,
+                                  depth, mismatch);
+              if (split == NULL)
+                return false;
+
+              inner->prefix_len -= mismatch + 1;
+              memmove (inner->prefix, rest,
+                       (inner->prefix_len < TRIE_MAX_PREFIX_LEN)
+                       ? inner->prefix_len
+                       : TRIE_MAX_PREFIX_LEN);
+
+              *reference = split;
+              return true;
+            }
+
+          depth += inner->prefix_len;
+        }
+
+      void **child = trie_find_child (inner, key[depth]);
+      if (child != NULL)
+        {
+          reference = child;
+          depth++;
+          continue;
+        }
+
+      struct trie_leaf_t *leaf = trie_leaf_new (trie->pool, key, key_len,
+                                                element);
+      if (leaf == NULL
+          || !trie_add_child (trie->pool, inner, reference, key[depth],
+                              TRIE_TAG_LEAF (leaf)))
         return false;
 
-      children[node->children_len] = branch;
-      node->children = children;
-      node->children_len++;
+      trie->elements_len++;
+      return true;
     }
+}
+
+struct trie_node_t *
+trie_new (void)
+{
+  struct trie_node_t *trie = calloc (1, sizeof (struct trie_node_t));
+  if (trie == NULL)
+    return NULL;
+
+  trie->pool = calloc (1, sizeof (struct trie_pool_t));
+  if (trie->pool == NULL)
+    {
+      free (trie);
+      return NULL;
+    }
+
+  return trie;
+}
+
+bool
+trie_insert (struct trie_node_t *trie, const char *name, void *element)
+{
+  if (trie == NULL || name == NULL || element == NULL)
+    return false;
 
-  return true;
+  /* The null character is part of the key. */
+  return trie_insert_at (trie, &(trie->root), (const unsigned char *)name,
+                         strlen (name) + 1, element, 0);
 }
 
 void *
@@ -119,28 +617,42 @@ trie_find (struct trie_node_t *trie, const char *name)
   if (trie == NULL || name == NULL)
     return NULL;
 
-  size_t name_len = strlen (name);
-  size_t position = 0;
-  struct trie_node_t *node = trie;
+  const unsigned char *key = (const unsigned char *)name;
+  uint32_t key_len = strlen (name) + 1;
+  uint32_t depth = 0;
+  void *node = trie->root;
 
-  size_t child_index = 0;
-  struct trie_node_t *child = NULL;
-
-  while (position < name_len && child_index < node->children_len)
+  while (node != NULL)
     {
-      child = node->children[child_index];
-      if (child->key == name[position])
+      /* Prefixes that are longer than what is stored in a node are only
+       * checked here, against the whole name. */
+      if (TRIE_IS_LEAF (node))
         {
-          node = child;
-          child_index = 0;
-          position++;
+          struct trie_leaf_t *leaf = TRIE_LEAF (node);
+          return trie_leaf_matches (leaf, key, key_len)
+                 ? leaf->element
+                 : NULL;
+        }
+
+      struct trie_inner_t *inner = node;
+      if (inner->prefix_len > 0)
+        {
+          uint32_t stored = (inner->prefix_len < TRIE_MAX_PREFIX_LEN)
+                            ? inner->prefix_len
+                            : TRIE_MAX_PREFIX_LEN;
+          if (trie_check_prefix (inner, key, key_len, depth) != stored)
+            return NULL;
+
+          depth += inner->prefix_len;
         }
-      else
-        child_index++;
-    }
 
-  if (position == name_len)
-    return child->element;
+      if (depth >= key_len)
+        return NULL;
+
+      void **child = trie_find_child (inner, key[depth]);
+      node = (child != NULL) ? *child : NULL;
+      depth++;
+    }
 
   return NULL;
 }
@@ -151,35 +663,54 @@ trie_elements_in_trie (struct trie_node_t *trie)
   if (trie == NULL)
     return 0;
 
-  uint32_t num_elements = 0;
-
-  size_t index;
-  for (index = 0; index < trie->children_len; index++)
-    num_elements += trie_elements_in_trie (trie->children[index]);
-
-  if (trie->element != NULL)
-    num_elements++;
-
-  return num_elements;
+  return trie->elements_len;
 }
 
-void
-trie_destroy (struct trie_node_t *trie)
+/* Calls 'callback' on the element of each leaf below 'node'. */
+static void
+trie_foreach_element (void *node, void (*callback) (void *))
 {
-  if (trie == NULL)
+  if (node == NULL)
     return;
 
-  size_t index;
-  for (index = 0; index < trie->children_len; index++)
-    trie_destroy (trie->children[index]);
+  if (TRIE_IS_LEAF (node))
+    {
+      callback (TRIE_LEAF (node)->element);
+      return;
+    }
 
-  trie->key = '\0';
-  trie->element = NULL;
+  struct trie_inner_t *inner = node;
+  void **children = NULL;
+  uint16_t children_len = 0;
+  switch (inner->type)
+    {
+    case TRIE_NODE4:
+      children = ((struct trie_node4_t *)inner)->children;
+      children_len = inner->children_len;
+      break;
+    case TRIE_NODE16:
+      children = ((struct trie_node16_t *)inner)->children;
+      children_len = inner->children_len;
+      break;
+    case TRIE_NODE48:
+      children = ((struct trie_node48_t *)inner)->children;
+      children_len = 48;
+      break;
+    case TRIE_NODE256:
+      children = ((struct trie_node256_t *)inner)->children;
+      children_len = 256;
+      break;
+    }
 
-  free (trie->children);
-  trie->children_len = 0;
+  uint16_t index;
+  for (index = 0; index < children_len; index++)
+    trie_foreach_element (children[index], callback);
+}
 
-  free (trie);
+void
+trie_destroy (struct trie_node_t *trie)
+{
+  trie_destroy_full (trie, NULL);
 }
 
 void
@@ -188,18 +719,18 @@ trie_destroy_full (struct trie_node_t *trie, void (*callback) (void *))
   if (trie == NULL)
     return;
 
-  size_t index;
-  for (index = 0; index < trie->children_len; index++)
-    trie_destroy_full (trie->children[index], callback);
-
-  trie->key = '\0';
+  if (callback != NULL)
+    trie_foreach_element (trie->root, callback);
 
-  if (trie->element != NULL)
-    callback (trie->element);
-  trie->element = NULL;
-
-  free (trie->children);
-  trie->children_len = 0;
+  /* All nodes and leaves live in the pool, so there is no need to visit
+   * them to free them. */
+  while (trie->pool->blocks != NULL)
+    {
+      struct trie_pool_block_t *next = trie->pool->blocks->next;
+      free (trie->pool->blocks);
+      trie->pool->blocks = next;
+    }
 
+  free (trie->pool);
   free (trie);
 }
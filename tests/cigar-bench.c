@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cigar.h"
+#include "segment.h"
+
+/* This program compares the throughput of the CIGAR kernels.  Pass a SAM
+ * file as the first argument to use its CIGARs, or let the program
+ * generate ones like those of ultra-long nanopore reads. */
+
+struct cigar_t
+{
+  uint32_t *operations;
+  uint32_t length;
+};
+
+static double
+seconds_since (struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static struct cigar_t *
+read_cigars (const char *filename, uint32_t *cigars_len)
+{
+  FILE *file = fopen (filename, "r");
+  if (file == NULL)
+    return NULL;
+
+  uint32_t capacity = 1024;
+  struct cigar_t *cigars = malloc (capacity * sizeof (struct cigar_t));
+  struct nsv_segment_cigar_overview_t overview;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  *cigars_len = 0;
+  while (cigars != NULL && getline (&line, &line_capacity, file) > 0)
+    {
+      if (line[0] == '@')
+        continue;
+
+      /* The CIGAR is the sixth column. */
+      char *field = line;
+      uint8_t column;
+      for (column = 0; column < 5 && field != NULL; column++)
+        {
+          field = strchr (field, '\t');
+          if (field != NULL)
+            field++;
+        }
+
+      if (field == NULL)
+        continue;
+
+      if (*cigars_len == capacity)
+        {
+          capacity *= 2;
+          cigars = realloc (cigars, capacity * sizeof (struct cigar_t));
+          if (cigars == NULL)
+            break;
+        }
+
+      struct cigar_t *cigar = &(cigars[*cigars_len]);
+      cigar->operations = nsv_segment_cigar_from_text (field,
+                                                       strcspn (field, "\t"),
+                                                       NULL, &(cigar->length),
+                                                       &overview);
+      if (cigar->operations != NULL)
+        (*cigars_len)++;
+    }
+
+  free (line);
+  fclose (file);
+  return cigars;
+}
+
+static struct cigar_t *
+generate_cigars (uint32_t *cigars_len)
+{
+  struct cigar_t *cigars = malloc (*cigars_len * sizeof (struct cigar_t));
+  if (cigars == NULL)
+    return NULL;
+
+  /* Nanopore alignments alternate between runs of matches and short
+   * mismatches, insertions and deletions, and are clipped at both ends. */
+  const uint8_t events[] = { NSV_CIGAR_DIFF, NSV_CIGAR_INSERTION,
+                             NSV_CIGAR_DELETION };
+  srand (42);
+
+  uint32_t index;
+  for (index = 0; index < *cigars_len; index++)
+    {
+      uint32_t length = 1000 + rand () % 19000;
+      uint32_t *operations = malloc (length * sizeof (uint32_t));
+      if (operations == NULL)
+        {
+          *cigars_len = index;
+          break;
+        }
+
+      operations[0] = (uint32_t)(rand () % 5000) << 4 | NSV_CIGAR_HARD_CLIP;
+      uint32_t position;
+      for (position = 1; position < length - 1; position++)
+        operations[position] = (position % 2 == 1)
+          ? (uint32_t)(1 + rand () % 400) << 4 | NSV_CIGAR_EQUAL
+          : (uint32_t)(1 + rand () % 10) << 4 | events[rand () % 3];
+
+      operations[length - 1] = (uint32_t)(rand () % 5000) << 4
+                               | NSV_CIGAR_SOFT_CLIP;
+      cigars[index].operations = operations;
+      cigars[index].length = length;
+    }
+
+  return cigars;
+}
+
+/* Runs the current kernel over all CIGARs 'rounds' times, and returns a
+ * checksum of the overviews so that the work cannot be optimized away. */
+static uint32_t
+run_kernel (struct cigar_t *cigars, uint32_t cigars_len, uint32_t rounds)
+{
+  struct nsv_segment_cigar_overview_t overview;
+  uint32_t checksum = 0;
+  uint32_t round;
+  for (round = 0; round < rounds; round++)
+    {
+      uint32_t index;
+      for (index = 0; index < cigars_len; index++)
+        {
+          nsv_cigar_overview (cigars[index].operations, cigars[index].length,
+                              &overview);
+          checksum = checksum * 31 + overview.query_length
+                     + overview.reference_length + overview.mismatches
+                     + overview.first_clip + overview.last_clip;
+        }
+    }
+
+  return checksum;
+}
+
+int
+main (int argc, char **argv)
+{
+  uint32_t cigars_len = 2000;
+  struct cigar_t *cigars = (argc > 1)
+                           ? read_cigars (argv[1], &cigars_len)
+                           : generate_cigars (&cigars_len);
+  if (cigars == NULL)
+    {
+      puts ("Could not open the input.");
+      return 1;
+    }
+
+  uint64_t operations = 0;
+  uint32_t index;
+  for (index = 0; index < cigars_len; index++)
+    operations += cigars[index].length;
+
+  /* Run each kernel for about the same number of operations, whatever
+   * the input. */
+  uint32_t rounds = (operations > 0) ? 1 + 200000000 / operations : 1;
+
+  puts ("---------------------- CIGAR KERNEL BENCHMARK ----------------------");
+  printf ("  Input:      %u CIGARs, %lu operations, %u rounds\n",
+          cigars_len, (unsigned long)operations, rounds);
+
+  struct timespec start;
+  double scalar_time = 0;
+  uint32_t scalar_checksum = 0;
+  bool agree = true;
+  enum nsv_cigar_kernel_e kernel;
+  for (kernel = NSV_CIGAR_KERNEL_SCALAR; kernel <= NSV_CIGAR_KERNEL_AVX2;
+       kernel++)
+    {
+      if (!nsv_cigar_set_kernel (kernel))
+        {
+          printf ("  %-10s  not supported\n", nsv_cigar_kernel_name (kernel));
+          continue;
+        }
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      uint32_t checksum = run_kernel (cigars, cigars_len, rounds);
+      double time = seconds_since (&start);
+
+      if (kernel == NSV_CIGAR_KERNEL_SCALAR)
+        {
+          scalar_time = time;
+          scalar_checksum = checksum;
+        }
+
+      agree = agree && (checksum == scalar_checksum);
+      printf ("  %-10s  %.3fs (%.0f Mops/s, %.1fx)%s\n",
+              nsv_cigar_kernel_name (kernel), time,
+              operations * rounds / time / 1e6, scalar_time / time,
+              (checksum == scalar_checksum) ? "" : "  MISMATCH");
+    }
+
+  puts ("-------------------- END CIGAR KERNEL BENCHMARK --------------------");
+
+  for (index = 0; index < cigars_len; index++)
+    free (cigars[index].operations);
+
+  free (cigars);
+  return !agree;
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cluster.h"
+#include "breakpoint.h"
+#include "segment.h"
+#include "nanosvc.h"
+
+extern struct nsv_config_t nsv_config;
+
+/* Fills in a segment with only the fields a breakpoint looks at. */
+static void
+set_segment (struct nsv_segment_t *segment, int32_t rname_id, bool reverse,
+             int32_t pos, int32_t end)
+{
+  memset (segment, 0, sizeof (struct nsv_segment_t));
+  segment->type = NSVC_OBJ_SEGMENT;
+  segment->flag = (reverse) ? 0x10 : 0;
+  segment->rname_id = rname_id;
+  segment->pos = pos;
+  segment->end = end;
+}
+
+static void
+add_breakpoint (GArray *breakpoints, struct nsv_segment_t *first,
+                struct nsv_segment_t *second)
+{
+  struct nsv_breakpoint_t breakpoint;
+  memset (&breakpoint, 0, sizeof (struct nsv_breakpoint_t));
+  nsv_breakpoint_init (&breakpoint, first, second);
+  g_array_append_val (breakpoints, breakpoint);
+}
+
+/* Counts the clusters of at least 'cluster_count' breakpoints by comparing
+ * every pair of breakpoints. */
+static uint32_t
+count_clusters_pairwise (GArray *breakpoints)
+{
+  uint32_t length = breakpoints->len;
+  uint32_t *labels = malloc (length * sizeof (uint32_t));
+  if (labels == NULL)
+    return UINT32_MAX;
+
+  uint32_t index;
+  for (index = 0; index < length; index++)
+    labels[index] = index;
+
+  /* Relabel until no linked pair has different labels. */
+  bool changed = true;
+  while (changed)
+    {
+      changed = false;
+      uint32_t other;
+      for (index = 0; index < length; index++)
+        for (other = index + 1; other < length; other++)
+          {
+            struct nsv_breakpoint_t *a, *b;
+            a = &g_array_index (breakpoints, struct nsv_breakpoint_t, index);
+            b = &g_array_index (breakpoints, struct nsv_breakpoint_t, other);
+            if (labels[index] == labels[other]
+                || a->segments[0]->rname_id != b->segments[0]->rname_id
+                || a->segments[1]->rname_id != b->segments[1]->rname_id
+                || a->orientation != b->orientation
+                || abs (a->breakpoints[0] - b->breakpoints[0])
+                   > (int32_t)nsv_config.cluster_distance
+                || abs (a->breakpoints[1] - b->breakpoints[1])
+                   > (int32_t)nsv_config.cluster_distance)
+              continue;
+
+            uint32_t label = (labels[index] < labels[other])
+                             ? labels[index] : labels[other];
+            labels[index] = label;
+            labels[other] = label;
+            changed = true;
+          }
+    }
+
+  uint32_t *sizes = calloc (length, sizeof (uint32_t));
+  uint32_t clusters_len = UINT32_MAX;
+  if (sizes != NULL)
+    {
+      for (index = 0; index < length; index++)
+        sizes[labels[index]]++;
+
+      clusters_len = 0;
+      for (index = 0; index < length; index++)
+        clusters_len += (sizes[index] >= nsv_config.cluster_count);
+    }
+
+  free (sizes);
+  free (labels);
+  return clusters_len;
+}
+
+int
+main ()
+{
+  uint8_t succeeded = 0;
+  uint8_t failed = 0;
+  uint8_t skipped = 0;
+
+  nsv_config.cluster_distance = 10;
+  nsv_config.cluster_count = 2;
+
+  puts ("--------------------------- CLUSTER TESTS --------------------------");
+
+  /* Three breakpoints that are linked through the middle one, one that is
+   * too far away, and one that only reaches the first. */
+  struct nsv_segment_t segments[10];
+  set_segment (&segments[0], 0, false, 1, 1000);
+  set_segment (&segments[1], 1, false, 5000, 6000);
+  set_segment (&segments[2], 0, false, 1, 1008);
+  set_segment (&segments[3], 1, false, 5000, 6006);
+  set_segment (&segments[4], 0, false, 1, 1016);
+  set_segment (&segments[5], 1, false, 5000, 6012);
+  set_segment (&segments[6], 0, false, 1, 1200);
+  set_segment (&segments[7], 1, false, 5000, 6000);
+  set_segment (&segments[8], 0, false, 1, 1004);
+  set_segment (&segments[9], 1, false, 5000, 6003);
+
+  GArray *breakpoints = g_array_new (FALSE, FALSE,
+                                     sizeof (struct nsv_breakpoint_t));
+  uint32_t index;
+  for (index = 0; index < 10; index += 2)
+    add_breakpoint (breakpoints, &segments[index], &segments[index + 1]);
+
+  struct nsv_clusters_t *clusters;
+  clusters = nsv_clusters_from_breakpoints (breakpoints);
+  if (clusters == NULL)
+    {
+      puts ("  * Skipped clustering because of a memory allocation error.");
+      skipped++;
+    }
+  else
+    {
+      struct nsv_cluster_t *cluster = &(clusters->clusters[0]);
+      if (clusters->length == 1
+          && cluster->breakpoints_len == 4
+          && cluster->rname_ids[0] == 0 && cluster->rname_ids[1] == 1
+          && cluster->orientation == 0
+          && cluster->starts[0] == 1000 && cluster->ends[0] == 1016
+          && cluster->starts[1] == 6000 && cluster->ends[1] == 6012
+          && cluster->breakpoints[1]->segments[0] == &segments[8])
+        {
+          puts ("  * Clustering breakpoints works fine.");
+          succeeded++;
+        }
+      else
+        {
+          puts ("  * ERROR: Clustering breakpoints failed.");
+          failed++;
+        }
+
+      nsv_clusters_destroy (clusters);
+    }
+
+  g_array_free (breakpoints, TRUE);
+
+  /* Breakpoints with random positions on a few pairs of reference
+   * sequences, compared with clustering them pair by pair. */
+  const uint32_t random_len = 3000;
+  struct nsv_segment_t *random_segments;
+  random_segments = malloc (2 * random_len * sizeof (struct nsv_segment_t));
+  breakpoints = g_array_new (FALSE, FALSE, sizeof (struct nsv_breakpoint_t));
+  if (random_segments == NULL)
+    {
+      puts ("  * Skipped comparing because of a memory allocation error.");
+      skipped++;
+    }
+  else
+    {
+      srand (42);
+      for (index = 0; index < random_len; index++)
+        {
+          int32_t first = 1000 + rand () % 300;
+          int32_t second = 1000 + rand () % 300;
+          set_segment (&random_segments[2 * index], rand () % 3,
+                       rand () % 2, first - 500, first);
+          set_segment (&random_segments[2 * index + 1], rand () % 3,
+                       rand () % 2, second, second + 500);
+          add_breakpoint (breakpoints, &random_segments[2 * index],
+                          &random_segments[2 * index + 1]);
+        }
+
+      uint32_t expected = count_clusters_pairwise (breakpoints);
+
+      nsv_config.max_threads = 1;
+      struct nsv_clusters_t *serial;
+      serial = nsv_clusters_from_breakpoints (breakpoints);
+
+      nsv_config.max_threads = 4;
+      struct nsv_clusters_t *parallel;
+      parallel = nsv_clusters_from_breakpoints (breakpoints);
+
+      bool same = (serial != NULL && parallel != NULL
+                   && serial->length == expected
+                   && parallel->length == expected);
+      for (index = 0; same && index < expected; index++)
+        {
+          struct nsv_cluster_t *a = &(serial->clusters[index]);
+          struct nsv_cluster_t *b = &(parallel->clusters[index]);
+          same = (a->rname_ids[0] == b->rname_ids[0]
+                  && a->rname_ids[1] == b->rname_ids[1]
+                  && a->orientation == b->orientation
+                  && a->starts[0] == b->starts[0]
+                  && a->ends[1] == b->ends[1]
+                  && a->breakpoints_len == b->breakpoints_len
+                  && a->breakpoints[0] == b->breakpoints[0]);
+        }
+
+      if (same)
+        {
+          puts ("  * Clustering in parallel works fine.");
+          succeeded++;
+        }
+      else
+        {
+          puts ("  * ERROR: Clustering in parallel failed.");
+          failed++;
+        }
+
+      nsv_clusters_destroy (serial);
+      nsv_clusters_destroy (parallel);
+    }
+
+  g_array_free (breakpoints, TRUE);
+  free (random_segments);
+
+  puts ("------------------------- END CLUSTER TESTS ------------------------");
+
+  printf ("\nSucceeded: %u\nFailed:    %u\nSkipped:   %u\n",
+          succeeded, failed, skipped);
+
+  return (failed != 0);
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "filter.h"
+#include "segment.h"
+#include "cigar.h"
+
+/* Parses a SAM line into a segment.  The line is copied, because the
+ * parser writes into it. */
+static struct nsv_segment_t *
+parse_line (struct nsv_contigs_t *contigs, const char *line)
+{
+  char *copy = strdup (line);
+  if (copy == NULL)
+    return NULL;
+
+  const char *qname;
+  struct nsv_segment_t *segment;
+  segment = nsv_segment_from_line (copy, strlen (copy), NULL, NULL, contigs,
+                                   NSV_COLUMNS_BREAKPOINT, &qname);
+  free (copy);
+  return segment;
+}
+
+/* Returns whether 'expression' compiles to 'clauses_len' clauses, or does
+ * not compile when 'clauses_len' is zero. */
+static bool
+compiles (const char *expression, uint32_t clauses_len)
+{
+  struct nsv_filter_t *filter = nsv_filter_compile (expression);
+  bool result = (filter == NULL)
+                ? (clauses_len == 0)
+                : (filter->clauses_len == clauses_len);
+
+  nsv_filter_destroy (filter);
+  return result;
+}
+
+/* Returns whether 'expression' keeps 'segment' as expected. */
+static bool
+keeps (const char *expression, struct nsv_segment_t *segment, bool expected)
+{
+  uint32_t counts[NSV_FILTER_MAX_CLAUSES] = { 0 };
+  struct nsv_filter_t *filter = nsv_filter_compile (expression);
+  bool result = (filter != NULL
+                 && nsv_filter_keep (filter, segment, counts) == expected);
+
+  nsv_filter_destroy (filter);
+  return result;
+}
+
+int
+main ()
+{
+  uint8_t succeeded = 0;
+  uint8_t failed = 0;
+  uint8_t skipped = 0;
+
+  nsv_cigar_init ();
+  puts ("--------------------------- FILTER TESTS ---------------------------");
+
+  if (compiles ("flag & 0x500 == 0 && mapq>=20&&length >= 1000", 3)
+      && compiles ("identity > 0.9 && [NM] <= 10 && [MD] != 0", 3)
+      && compiles ("", 0)
+      && compiles ("mapq >", 0)
+      && compiles ("mapquality > 1", 0)
+      && compiles ("identity & 1 == 0", 0)
+      && compiles ("mapq > 1 &&", 0)
+      && compiles ("mapq > 1 & mapq < 2", 0)
+      && compiles ("flag == 0 && flag == 0 && flag == 0 && flag == 0 && "
+                   "flag == 0 && flag == 0 && flag == 0 && flag == 0 && "
+                   "flag == 0 && flag == 0 && flag == 0 && flag == 0 && "
+                   "flag == 0 && flag == 0 && flag == 0 && flag == 0 && "
+                   "flag == 0", 0))
+    {
+      puts ("  * Compiling expressions works fine.");
+      succeeded++;
+    }
+  else
+    {
+      puts ("  * ERROR: Compiling expressions failed.");
+      failed++;
+    }
+
+  struct nsv_contigs_t *contigs = nsv_contigs_new ();
+  struct nsv_segment_t *segment = NULL;
+  if (contigs != NULL)
+    segment = parse_line (contigs, "read1\t272\tchr1\t100\t30\t5S1000=2X3D"
+                          "\t*\t0\t0\t*\t*\tNM:i:5\tMD:Z:500A0C502^ACG0");
+
+  if (segment == NULL)
+    {
+      puts ("  * Skipped evaluation because of a memory allocation error.");
+      skipped++;
+    }
+  else
+    {
+      if (keeps ("flag & 0x100 == 0", segment, false)
+          && keeps ("flag & 0x100 != 0", segment, true)
+          && keeps ("flag & 0x400 == 0", segment, true)
+          && keeps ("mapq > 30", segment, false)
+          && keeps ("mapq >= 30", segment, true)
+          && keeps ("mapq < 31 && mapq != 29", segment, true)
+          && keeps ("length >= 1005", segment, true)
+          && keeps ("length > 1005", segment, false))
+        {
+          puts ("  * Comparing core fields works fine.");
+          succeeded++;
+        }
+      else
+        {
+          puts ("  * ERROR: Comparing core fields failed.");
+          failed++;
+        }
+
+      if (keeps ("[NM] == 5 && [MD] == 2", segment, true)
+          && keeps ("[NM] < 5", segment, false)
+          && keeps ("identity > 0.995", segment, true)
+          && keeps ("identity > 0.999", segment, false))
+        {
+          puts ("  * Comparing tags and identity works fine.");
+          succeeded++;
+        }
+      else
+        {
+          puts ("  * ERROR: Comparing tags and identity failed.");
+          failed++;
+        }
+
+      /* A missing tag fails every comparison, including '!='. */
+      nsv_segment_cold (segment)->nm = -1;
+
+      uint32_t counts[NSV_FILTER_MAX_CLAUSES] = { 0 };
+      struct nsv_filter_t *filter;
+      filter = nsv_filter_compile ("mapq > 10 && [NM] != 3 && mapq > 40");
+      if (filter != NULL
+          && !nsv_filter_keep (filter, segment, counts)
+          && !nsv_filter_keep (filter, segment, counts)
+          && counts[0] == 0 && counts[1] == 2 && counts[2] == 0)
+        {
+          puts ("  * Counting rejects per clause works fine.");
+          succeeded++;
+        }
+      else
+        {
+          puts ("  * ERROR: Counting rejects per clause failed.");
+          failed++;
+        }
+
+      nsv_filter_destroy (filter);
+      nsv_segment_destroy (segment);
+    }
+
+  nsv_contigs_destroy (contigs);
+  puts ("------------------------- END FILTER TESTS -------------------------");
+
+  printf ("\nSucceeded: %u\nFailed:    %u\nSkipped:   %u\n",
+          succeeded, failed, skipped);
+
+  return (failed != 0);
+}
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "segment.h"
+#include "stream.h"
+#include "contig.h"
+
+extern struct nsv_config_t nsv_config;
+
+/* This program compares the throughput of the block-buffered SAM tokenizer
+ * with the character-at-a-time loop it replaced.  Pass a SAM file as the
+ * first argument, or let the program generate nanopore-like records. */
+
+static double
+seconds_since (struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* This is the parser as it was before the tokenizer was introduced.  The
+ * only changes are that the field buffer stays null-terminated when a field
+ * is truncated, that the reference names, which segments no longer
+ * store, are copied and released here, and that the CIGAR is converted to
+ * its packed operations. */
+static struct nsv_segment_t *
+getc_segment_from_stream (FILE *stream, char **qname_ptr)
+{
+  struct nsv_segment_t *segment = nsv_segment_new ();
+  if (segment == NULL)
+    return NULL;
+
+  struct nsv_segment_cold_t *cold = nsv_segment_cold (segment);
+  struct nsv_segment_cigar_overview_t overview;
+  nsv_segment_cigar_init (&overview);
+
+  uint8_t field_index = 0;
+  const uint16_t field_max_length = 512;
+  char field[field_max_length];
+  uint16_t field_pos = 0;
+  memset (field, '\0', field_max_length);
+
+  char *qname = NULL;
+  char *rname = NULL;
+  char *rnext = NULL;
+  int buffer = getc (stream);
+  if (buffer == EOF)
+    {
+      nsv_segment_destroy (segment);
+      return NULL;
+    }
+
+  while (buffer != EOF)
+    {
+      if (field_pos == 0 && field_index == 0 && buffer == '@')
+        {
+          while (buffer != '\n' && buffer != EOF)
+            buffer = getc (stream);
+
+          if (buffer == EOF)
+            {
+              nsv_segment_destroy (segment);
+              return NULL;
+            }
+
+          field_pos = 0;
+          field_index = 0;
+          buffer = getc (stream);
+          continue;
+        }
+      else if (buffer == '\n')
+        break;
+      else if (buffer == '\t')
+        {
+          switch (field_index)
+            {
+              case 0:  qname          = strdup (field); break;
+              case 1:  segment->flag  = atoi(field);    break;
+              case 2:  rname          = strdup (field); break;
+              case 3:  segment->pos   = atoi(field);    break;
+              case 4:  segment->mapq  = atoi(field);    break;
+              case 5:
+                cold->cigar = nsv_segment_cigar_from_text (field,
+                                                           strlen (field),
+                                                           NULL,
+                                                           &(cold->cigar_len),
+                                                           &overview);
+                break;
+              case 6:  rnext          = strdup (field); break;
+              case 7:  cold->pnext = atoi(field);    break;
+              case 8:  cold->tlen  = atoi(field);    break;
+              case 9:  cold->seq   = strdup (field); break;
+              case 10: cold->qual  = strdup (field); break;
+            }
+
+          field_index++;
+          memset (field, '\0', field_pos + 1);
+          field_pos = 0;
+        }
+      else if (field_pos < field_max_length - 1)
+        {
+          field[field_pos] = buffer;
+          field_pos++;
+        }
+
+      buffer = getc (stream);
+    }
+
+  if (cold->seq != NULL)
+    segment->seq_len = strlen (cold->seq);
+
+  free (rname);
+  free (rnext);
+
+  *qname_ptr = qname;
+  return segment;
+}
+
+static FILE *
+generate_input (uint32_t records)
+{
+  FILE *file = tmpfile ();
+  if (file == NULL)
+    return NULL;
+
+  const char bases[] = "ACGT";
+  char *seq = malloc (20001);
+  char *qual = malloc (20001);
+  if (seq == NULL || qual == NULL)
+    {
+      free (seq);
+      free (qual);
+      fclose (file);
+      return NULL;
+    }
+
+  fputs ("@HD\tVN:1.6\tSO:unsorted\n@SQ\tSN:chr1\tLN:248956422\n", file);
+  srand (42);
+
+  uint32_t index;
+  for (index = 0; index < records; index++)
+    {
+      uint32_t length = 1000 + rand () % 19000;
+      uint32_t position;
+      for (position = 0; position < length; position++)
+        {
+          seq[position] = bases[rand () % 4];
+          qual[position] = '!' + 5 + rand () % 35;
+        }
+      seq[length] = '\0';
+      qual[length] = '\0';
+
+      fprintf (file, "%08x-%04x-%04x-%04x-%012x\t%d\tchr1\t%d\t60\t"
+               "%dS%d=3X%d=\t*\t0\t0\t%s\t%s\tNM:i:3\n",
+               rand (), rand () & 0xffff, rand () & 0xffff, rand () & 0xffff,
+               rand (), (index % 3 == 0) ? 2048 : 0, 1 + rand () % 200000000,
+               length / 4, length / 2, length - length / 4 - length / 2 - 3,
+               seq, qual);
+    }
+
+  free (seq);
+  free (qual);
+  return file;
+}
+
+static uint32_t
+run_getc (FILE *file)
+{
+  uint32_t segments = 0;
+  char *qname = NULL;
+  struct nsv_segment_t *segment;
+
+  rewind (file);
+  while ((segment = getc_segment_from_stream (file, &qname)) != NULL)
+    {
+      free (qname);
+      nsv_segment_destroy (segment);
+      segments++;
+    }
+
+  return segments;
+}
+
+static uint32_t
+run_tokenizer (FILE *file, uint32_t columns)
+{
+  uint32_t segments = 0;
+  const char *qname = NULL;
+  struct nsv_segment_t *segment;
+
+  rewind (file);
+  struct nsv_stream_t *stream = nsv_stream_new (file);
+  struct nsv_contigs_t *contigs = nsv_contigs_new ();
+  if (stream == NULL || contigs == NULL)
+    {
+      nsv_stream_destroy (stream);
+      nsv_contigs_destroy (contigs);
+      return 0;
+    }
+
+  while ((segment = nsv_segment_from_stream (stream, NULL, contigs, columns,
+                                             NULL, &qname)) != NULL)
+    {
+      nsv_segment_destroy (segment);
+      segments++;
+    }
+
+  nsv_stream_destroy (stream);
+  nsv_contigs_destroy (contigs);
+  return segments;
+}
+
+int
+main (int argc, char **argv)
+{
+  FILE *file = (argc > 1) ? fopen (argv[1], "r") : generate_input (5000);
+  if (file == NULL)
+    {
+      puts ("Could not open the input.");
+      return 1;
+    }
+
+  fseek (file, 0, SEEK_END);
+  double megabytes = ftell (file) / (1024.0 * 1024.0);
+
+  /* Warm the page cache so that both parsers read from memory. */
+  run_tokenizer (file, NSV_COLUMNS_ALL);
+
+  struct timespec start;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  uint32_t getc_segments = run_getc (file);
+  double getc_time = seconds_since (&start);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  uint32_t tokenizer_segments = run_tokenizer (file, NSV_COLUMNS_ALL);
+  double tokenizer_time = seconds_since (&start);
+
+  nsv_config.zero_copy = true;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  uint32_t zero_copy_segments = run_tokenizer (file, NSV_COLUMNS_ALL);
+  double zero_copy_time = seconds_since (&start);
+
+  /* This is how the program itself reads its input. */
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  uint32_t projected_segments = run_tokenizer (file, NSV_COLUMNS_BREAKPOINT);
+  double projected_time = seconds_since (&start);
+
+  fclose (file);
+
+  puts ("------------------------ SAM PARSER BENCHMARK ------------------------");
+  printf ("  Input:      %.1f MiB\n", megabytes);
+  printf ("  getc loop:  %u segments in %.3fs (%.1f MiB/s)\n",
+          getc_segments, getc_time, megabytes / getc_time);
+  printf ("  Tokenizer:  %u segments in %.3fs (%.1f MiB/s)\n",
+          tokenizer_segments, tokenizer_time, megabytes / tokenizer_time);
+  printf ("  Zero-copy:  %u segments in %.3fs (%.1f MiB/s)\n",
+          zero_copy_segments, zero_copy_time, megabytes / zero_copy_time);
+  printf ("  Projected:  %u segments in %.3fs (%.1f MiB/s)\n",
+          projected_segments, projected_time, megabytes / projected_time);
+  printf ("  Speedup:    %.1fx (%.1fx without copies, %.1fx projected)\n",
+          getc_time / tokenizer_time, getc_time / zero_copy_time,
+          getc_time / projected_time);
+  puts ("---------------------- END SAM PARSER BENCHMARK ----------------------");
+
+  return (getc_segments != tokenizer_segments
+          || getc_segments != zero_copy_segments
+          || getc_segments != projected_segments);
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include "qnames.h"
+#include "trie.h"
+#include "nanosvc.h"
+
+extern struct nsv_config_t nsv_config;
+
+/* This program compares the qname index that groups segments into reads
+ * with the trie it replaced.  Pass a SAM file as the first argument to use
+ * its qnames, or let the program generate nanopore-like ones.  Like the
+ * parser, the benchmark looks each qname up before inserting it. */
+
+static double
+seconds_since (struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Returns the number of bytes allocated with malloc, including the large
+ * allocations that are served by mmap. */
+static size_t
+allocated_bytes (void)
+{
+#if defined (__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 info = mallinfo2 ();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+static char **
+read_qnames (const char *filename, uint32_t *qnames_len)
+{
+  FILE *file = fopen (filename, "r");
+  if (file == NULL)
+    return NULL;
+
+  uint32_t capacity = 1024;
+  char **qnames = malloc (capacity * sizeof (char *));
+  char *line = NULL;
+  size_t line_capacity = 0;
+  *qnames_len = 0;
+
+  while (qnames != NULL && getline (&line, &line_capacity, file) > 0)
+    {
+      if (line[0] == '@')
+        continue;
+
+      if (*qnames_len == capacity)
+        {
+          capacity *= 2;
+          qnames = realloc (qnames, capacity * sizeof (char *));
+          if (qnames == NULL)
+            break;
+        }
+
+      qnames[*qnames_len] = strndup (line, strcspn (line, "\t\n"));
+      (*qnames_len)++;
+    }
+
+  free (line);
+  fclose (file);
+  return qnames;
+}
+
+/* Most nanopore reads are named by a UUID.  Like in real data, a third of
+ * the reads have more than one record. */
+static char **
+generate_qnames (uint32_t reads, uint32_t seed, uint32_t *qnames_len)
+{
+  char **qnames = malloc (reads * 2 * sizeof (char *));
+  if (qnames == NULL)
+    return NULL;
+
+  srand (seed);
+  *qnames_len = 0;
+
+  uint32_t index;
+  for (index = 0; index < reads; index++)
+    {
+      char qname[64];
+      snprintf (qname, sizeof (qname), "%08x-%04x-%04x-%04x-%04x%08x",
+                rand (), rand () & 0xffff, rand () & 0xffff,
+                rand () & 0xffff, rand () & 0xffff, rand ());
+
+      qnames[(*qnames_len)++] = strdup (qname);
+      if (index % 3 == 0)
+        qnames[(*qnames_len)++] = strdup (qname);
+    }
+
+  return qnames;
+}
+
+static void
+free_qnames (char **qnames, uint32_t qnames_len)
+{
+  uint32_t index;
+  for (index = 0; index < qnames_len; index++)
+    free (qnames[index]);
+
+  free (qnames);
+}
+
+int
+main (int argc, char **argv)
+{
+  uint32_t qnames_len = 0;
+  char **qnames = (argc > 1)
+                  ? read_qnames (argv[1], &qnames_len)
+                  : generate_qnames (200000, 42, &qnames_len);
+
+  /* These names are not in the index. */
+  uint32_t misses_len = 0;
+  char **misses = generate_qnames (qnames_len / 2 + 1, 7, &misses_len);
+
+  if (qnames == NULL || misses == NULL)
+    {
+      puts ("Could not read the qnames.");
+      return 1;
+    }
+
+  uint32_t index;
+  uint32_t trie_found = 0;
+  uint32_t hash_found = 0;
+  struct timespec start;
+
+  /* The hash index goes first, because freeing the many small nodes of
+   * the trie slows down the allocations that follow it. */
+  size_t memory = allocated_bytes ();
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  struct nsv_qnames_t *hash = nsv_qnames_new (0);
+  struct nsv_qname_t key;
+  for (index = 0; index < qnames_len; index++)
+    {
+      nsv_qname_init (&key, qnames[index]);
+      if (nsv_qnames_find (hash, &key) == NULL)
+        nsv_qnames_insert (hash, &key, qnames[index]);
+    }
+  double hash_insert_time = seconds_since (&start);
+  size_t hash_memory = allocated_bytes () - memory;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (index = 0; index < qnames_len; index++)
+    {
+      nsv_qname_init (&key, qnames[index]);
+      hash_found += (nsv_qnames_find (hash, &key) != NULL);
+    }
+  for (index = 0; index < misses_len; index++)
+    {
+      nsv_qname_init (&key, misses[index]);
+      hash_found += (nsv_qnames_find (hash, &key) != NULL);
+    }
+  double hash_find_time = seconds_since (&start);
+  uint32_t reads = nsv_qnames_count (hash);
+  nsv_qnames_destroy (hash);
+
+  /* Trie. */
+  memory = allocated_bytes ();
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  struct trie_node_t *trie = trie_new ();
+  for (index = 0; index < qnames_len; index++)
+    if (trie_find (trie, qnames[index]) == NULL)
+      trie_insert (trie, qnames[index], qnames[index]);
+  double trie_insert_time = seconds_since (&start);
+  size_t trie_memory = allocated_bytes () - memory;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (index = 0; index < qnames_len; index++)
+    trie_found += (trie_find (trie, qnames[index]) != NULL);
+  for (index = 0; index < misses_len; index++)
+    trie_found += (trie_find (trie, misses[index]) != NULL);
+  double trie_find_time = seconds_since (&start);
+  trie_destroy (trie);
+
+  free_qnames (qnames, qnames_len);
+  free_qnames (misses, misses_len);
+
+  puts ("------------------------ QNAME INDEX BENCHMARK -----------------------");
+  printf ("  Input:      %u records of %u reads, %u misses\n",
+          qnames_len, reads, misses_len);
+  printf ("  Trie:       insert %.3fs, find %.3fs, %.1f MiB\n",
+          trie_insert_time, trie_find_time, trie_memory / 1048576.0);
+  printf ("  Hash index: insert %.3fs, find %.3fs, %.1f MiB\n",
+          hash_insert_time, hash_find_time, hash_memory / 1048576.0);
+  printf ("  Speedup:    %.1fx insert, %.1fx find\n",
+          trie_insert_time / hash_insert_time,
+          trie_find_time / hash_find_time);
+  puts ("---------------------- END QNAME INDEX BENCHMARK ---------------------");
+
+  /* Both must find every record, and none of the misses. */
+  return (trie_found != qnames_len || hash_found != qnames_len);
+}